@@ -45,6 +45,13 @@ _stride=(
     128
 )
 
+_streaming=(
+    push
+    pull
+    aa
+    sailfish
+)
+
 if [ -e $LOG ]; then
     rm $LOG
 fi
@@ -66,13 +73,17 @@ for d in "${_dim[@]}"; do
                         gws=$(($x * $y * $z))
                         if ((($gws <= 1024) && (($x <= $d) && ($y <= $d) && ($z <= $d)))); then
                             for s in "${_stride[@]}"; do
-                                for k in `seq 1 10`; do
-                                    #echo "$d - $x, $y, $z - $s"
-                                    if [ "$PRECISION" = "single" ]; then
-                                        ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $s -o 2>> $LOG
-                                    else
-                                        ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $s -o -F 2>> $LOG
-                                    fi
+                                for m in "${_streaming[@]}"; do
+                                    # Sailfish streaming runs on rows of work items
+                                    if [ "$m" = "sailfish" ] && (($y > 1)); then continue; fi
+                                    for k in `seq 1 10`; do
+                                        #echo "$d - $x, $y, $z - $s - $m"
+                                        if [ "$PRECISION" = "single" ]; then
+                                            ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $s -S $m -o 2>> $LOG
+                                        else
+                                            ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $s -S $m -o -F 2>> $LOG
+                                        fi
+                                    done
                                 done
                             done
                         fi
@@ -91,12 +102,16 @@ for d in "${_dim[@]}"; do
                     if (($z <= $y)); then
                         gws=$(($x * $y * $z))
                         if ((($gws <= 1024) && (($x <= $d) && ($y <= $d) && ($z <= $d)))); then
-                            for k in `seq 1 10`; do
-                                if [ "$PRECISION" = "single" ]; then
-                                    ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $(($d * $d * $d)) -o 2>> $LOG
-                                else
-                                    ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $(($d * $d * $d)) -o -F 2>> $LOG
-                                fi
+                            for m in "${_streaming[@]}"; do
+                                # Sailfish streaming runs on rows of work items
+                                if [ "$m" = "sailfish" ] && (($y > 1)); then continue; fi
+                                for k in `seq 1 10`; do
+                                    if [ "$PRECISION" = "single" ]; then
+                                        ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $(($d * $d * $d)) -S $m -o 2>> $LOG
+                                    else
+                                        ./lbmcl -P $PLATFORM -D $DEVICE -d $d -n $VISCOSITY -u $VELOCITY -i $ITERATIONS -e $EVERY -w "$x,$y,$z" -s $(($d * $d * $d)) -S $m -o -F 2>> $LOG
+                                    fi
+                                done
                             done
                         fi
                     fi
@@ -110,7 +125,7 @@ DISCRIMINATOR='$9'
 
 cat $LOG | grep -v 'beignet-opencl-icd:\|(If you' | awk -F\; '{
 
-    i = $1";"$2";"$3";"$6";"$7;
+    i = $1";"$2";"$3";"$6";"$7";"$13";"$14;
 
     found = 0
     for (n in names) {
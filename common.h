@@ -9,16 +9,43 @@
 #define MOVING                          0x00000002 //(1 << 1)
 #define CORNER                          0x00000004 //(1 << 2)
 #define WALL                            0x00000008 //(1 << 3)
+#define BOUNDARY                        0x00000010 //(1 << 4)
 
-#define LEFT                            0x00000010 //(1 << 4)
-#define RIGHT                           0x00000020 //(1 << 5)
-#define TOP                             0x00000040 //(1 << 6)
-#define BOTTOM                          0x00000080 //(1 << 7)
-#define FRONT                           0x00000100 //(1 << 8)
-#define BACK                            0x00000200 //(1 << 9)
+#define LEFT                            0x00000020 //(1 << 5)
+#define RIGHT                           0x00000040 //(1 << 6)
+#define TOP                             0x00000080 //(1 << 7)
+#define BOTTOM                          0x00000100 //(1 << 8)
+#define FRONT                           0x00000200 //(1 << 9)
+#define BACK                            0x00000400 //(1 << 10)
 
+#define FACES                   (LEFT | RIGHT | TOP | BOTTOM | FRONT | BACK)
 #define MOVING_BOUNDARY         FRONT
 
+// The map stores one byte for each cell: the faces of the boundary cells,
+// only needed to initialize them, are summarized by the BOUNDARY bit.
+#define MAP_MASK                (FLUID | MOVING | CORNER | WALL | BOUNDARY)
+
+// Scalar diagnostics of an iteration, reduced over the cells storing macro
+// quantities: total mass, kinetic energy, maximum velocity magnitude and
+// enstrophy.
+#define DIAG_MASS                       0
+#define DIAG_KINETIC_ENERGY             1
+#define DIAG_MAX_VELOCITY               2
+#define DIAG_ENSTROPHY                  3
+#define DIAGNOSTICS                     4
+
+// The residual of the velocity between two checks is reduced in the same
+// slots: the sums of |u - u_prev|^2 and |u|^2, and the max |u - u_prev|.
+#define RESIDUAL_DU2                    DIAG_MASS
+#define RESIDUAL_U2                     DIAG_KINETIC_ENERGY
+#define RESIDUAL_MAX_DU                 DIAG_MAX_VELOCITY
+
+#ifdef __OPENCL_VERSION__
+typedef uchar map_t;
+#else
+typedef unsigned char map_t;
+#endif
+
 
 inline int is_moving_init(const int cell_type)
 {
@@ -42,7 +69,7 @@ inline int is_corner(const int cell_type)
 
 inline int is_boundary(const int cell_type)
 {
-    return (cell_type & (LEFT | RIGHT | BOTTOM | TOP | BACK | FRONT));
+    return (cell_type & BOUNDARY);
 }
 
 inline int is_moving(const int cell_type)
@@ -2,20 +2,48 @@
 
 #define SCRATCH_METHOD                  (1 << 0)
 #define SAILFISH_METHOD                 (1 << 1)
-#define SIMULATION_METHOD               SCRATCH_METHOD
+#define PULL_METHOD                     (1 << 2)
 
 #define CALCULATION_ORDER_SAILFISH      0
+#ifndef STREAMING_METHOD
 #define STREAMING_METHOD                SCRATCH_METHOD
+#endif
+
+#define BGK_COLLISION                   (1 << 0)
+#define TRT_COLLISION                   (1 << 1)
+#define MRT_COLLISION                   (1 << 2)
+#ifndef COLLISION
+#define COLLISION                       BGK_COLLISION
+#endif
 
 // The following definitions are provided at compile time
 //
 // FP_SINGLE or FP_DOUBLE   to set the simulation with float or double type
-// DIM                      the cube dimension of the simulation
+// DIM_X, DIM_Y, DIM_Z      the sizes of the lattice, of any value
 // LWS                      work_group_size
 // STRIDE_DIV               value used to calculate index of CSoA data layout
 // STRIDE_MOD               value used to calculate index of CSoA data layout
 // VELOCITY                 the moving wall velocity
 // VISCOSITY                the fluid viscosity
+//
+// and optionally
+//
+// STREAMING_METHOD         PULL_METHOD to gather the distributions from the
+//                          neighbours instead of scattering them (push), or
+//                          SAILFISH_METHOD to push them through local memory
+// STORAGE_FP32             store the distributions as float (FP_DOUBLE only)
+// STORAGE_FP16             store the distributions as half (FP_SINGLE only)
+// STORAGE_BF16             store the distributions as bfloat16 (FP_SINGLE only)
+// PROCEDURAL_GEOMETRY      compute the cell types from the coordinates instead
+//                          of reading the map
+// Z_CELLS                  cells updated along z by each work item of
+//                          compute_zmarch and compute_blocked, 1 by default
+// BLOCK_STEPS              iterations advanced by each launch of
+//                          compute_blocked, 1 by default
+// ENSEMBLE                 number of independent lattices stacked along z,
+//                          1 by default, see SELECT_MEMBER
+// COLLISION                TRT_COLLISION or MRT_COLLISION to replace the
+//                          single relaxation time BGK operator, see COLLIDE
 
 
 #if defined(FP_SINGLE)
@@ -28,8 +56,8 @@ typedef double real_t;
 #error "FP_SINGLE or FP_DOUBLE are not defined"
 #endif
 
-#ifndef DIM
-#error DIM is not defined
+#if !defined(DIM_X) || !defined(DIM_Y) || !defined(DIM_Z)
+#error DIM_X, DIM_Y or DIM_Z is not defined
 #endif
 
 #ifndef LWS
@@ -52,22 +80,81 @@ typedef double real_t;
 #error VISCOSITY is not defined
 #endif
 
+#ifndef Z_CELLS
+#define Z_CELLS                         1
+#endif
+
+#ifndef BLOCK_STEPS
+#define BLOCK_STEPS                     1
+#endif
+
+#ifndef ENSEMBLE
+#define ENSEMBLE                        1
+#endif
+
+#if (defined(STORAGE_FP32) && !defined(FP_DOUBLE)) || ((defined(STORAGE_FP16) || defined(STORAGE_BF16)) && !defined(FP_SINGLE))
+#error The storage of the distributions must be smaller than real_t
+#endif
+
+#if (ENSEMBLE > 1) && (STREAMING_METHOD == SAILFISH_METHOD)
+#error An ENSEMBLE of lattices requires SCRATCH_METHOD or PULL_METHOD streaming
+#endif
+
 
 #define INITIAL_DENSITY                 1.0
-#define INITIAL_VELOCITY_X              VELOCITY
 #define INITIAL_VELOCITY_Y              0.0
 #define INITIAL_VELOCITY_Z              0.0
 
+#if (ENSEMBLE > 1)
+// Parameters of the member, read by SELECT_MEMBER
+#define INITIAL_VELOCITY_X              velocity
+#define INV_TAU                         inv_tau
+#else
+#define INITIAL_VELOCITY_X              VELOCITY
 #define TAU                             ((3.0 * VISCOSITY) + 0.5)
 #define INV_TAU                         (1.0 / TAU) // 1.89861401177140698415
+#endif
 
 #define IDxyzq(id, q)                   ((((id) >> STRIDE_DIV) * Q + q) << STRIDE_DIV) + ((id) & STRIDE_MOD)
-#define IDXYZQ(x, y, z, q)              ((((((x) + ((y) * DIM) + ((z) * DIM * DIM)) >> STRIDE_DIV) * Q + q) << STRIDE_DIV) + (((x) + ((y) * DIM) + ((z) * DIM * DIM)) & STRIDE_MOD))
-
-#define IDxyz(x, y, z)                  ((x) + ((y) * (DIM)) + ((z) * (DIM) * (DIM)))
-#define UX(id)                          u[0 * DIM * DIM * DIM + id]
-#define UY(id)                          u[1 * DIM * DIM * DIM + id]
-#define UZ(id)                          u[2 * DIM * DIM * DIM + id]
+#define IDXYZQ(x, y, z, q)              IDxyzq(IDxyz(x, y, z), q)
+
+#define CELLS                           (DIM_X * DIM_Y * DIM_Z)
+#define IDxyz(x, y, z)                  ((x) + ((y) * (DIM_X)) + ((z) * (DIM_X) * (DIM_Y)))
+#define PLANE                           ((DIM_X) * (DIM_Y))
+// Difference between the index of the neighbour in the direction i and the
+// index of the cell
+#define OFFSET(i)                       (E##i##_X + (E##i##_Y * (DIM_X)) + (E##i##_Z * PLANE))
+#define UX(id)                          u[0 * CELLS + id]
+#define UY(id)                          u[1 * CELLS + id]
+#define UZ(id)                          u[2 * CELLS + id]
+
+// Work items past the lattice, launched when its sizes are not multiples of
+// the work group size.
+#define OUT_OF_LATTICE(x, y, z)         ((x) >= DIM_X || (y) >= DIM_Y || (z) >= DIM_Z)
+
+// The lattices of an ensemble are stacked along z: the range along z covers
+// ENSEMBLE * DIM_Z cells, and each member has its own distributions, rho and
+// u, at the offsets below, while the map is shared. params holds the moving
+// wall velocity and the inverse of tau of each member.
+#if (ENSEMBLE > 1)
+#define MEMBER_F                        (((((CELLS) + STRIDE_MOD) >> STRIDE_DIV) * Q) << STRIDE_DIV)
+#define MEMBER()                        ((int)get_global_id(2) / DIM_Z)
+#define MEMBER_Z()                      ((int)get_global_id(2) % DIM_Z)
+#define ENSEMBLE_PARAMS                 , __global const real_t * restrict params
+#define SELECT_MEMBER(member)                       \
+    f_stream += (member) * MEMBER_F;                \
+    f_collide += (member) * MEMBER_F;               \
+    density += (member) * CELLS;                    \
+    u += (member) * CELLS * D;                      \
+    const real_t velocity = params[2 * (member)];   \
+    const real_t inv_tau = params[2 * (member) + 1];
+#else
+#define MEMBER()                        0
+#define MEMBER_Z()                      ((int)get_global_id(2))
+#define ENSEMBLE_PARAMS
+#define SELECT_MEMBER(member)
+#endif
+#define OUT_OF_ENSEMBLE(member)         ((member) >= ENSEMBLE)
 
 
 // MACRO UNROLL of 19.
@@ -233,23 +320,91 @@ typedef double real_t;
 #define F_S(i)              CAT(F, S(i))
 
 
-inline int get_cell_type(const int x, const int y, const int z)
+// Storage of the distributions. Reduced storage types keep the difference
+// between the distributions and their weights (the equilibrium at rest),
+// which is much smaller than the distributions themselves, so that less
+// significant digits are lost. The arithmetic is always done with real_t.
+//
+// LOAD_F(f, idx, i)            distribution i stored in f[idx]
+// STORE_F(f, idx, i, value)    stores the distribution i into f[idx]
+#if defined(STORAGE_FP32)
+typedef float store_t;
+#define LOAD_F(f, idx, i)           ((real_t)((f)[idx]) + OMEGA_##i)
+#define STORE_F(f, idx, i, value)   ((f)[idx] = (float)((value) - OMEGA_##i))
+#elif defined(STORAGE_FP16)
+typedef half store_t;
+#define LOAD_F(f, idx, i)           (vload_half((idx), (f)) + OMEGA_##i)
+#define STORE_F(f, idx, i, value)   vstore_half_rte((value) - OMEGA_##i, (idx), (f))
+#elif defined(STORAGE_BF16)
+typedef ushort store_t;
+#define LOAD_F(f, idx, i)           (bf16_to_float((f)[idx]) + OMEGA_##i)
+#define STORE_F(f, idx, i, value)   ((f)[idx] = float_to_bf16((value) - OMEGA_##i))
+#else
+typedef real_t store_t;
+#define LOAD_F(f, idx, i)           ((f)[idx])
+#define STORE_F(f, idx, i, value)   ((f)[idx] = (value))
+#endif
+
+
+// bfloat16 is the upper half of a float
+inline float bf16_to_float(const ushort value)
+{
+    return as_float(((uint)value) << 16);
+}
+
+// Rounds to the nearest bfloat16, ties to even. NaN are truncated instead,
+// with a mantissa bit set so that they stay NaN: rounding would carry into
+// the exponent, or past the sign.
+inline ushort float_to_bf16(const float value)
 {
-    int cell_type = NONE;
-
-    if (x == 1)         cell_type |= LEFT;
-    if (x == (DIM - 2)) cell_type |= RIGHT;
-    if (y == 1)         cell_type |= BOTTOM;
-    if (y == (DIM - 2)) cell_type |= TOP;
-    if (z == 1)         cell_type |= BACK;
-    if (z == (DIM - 2)) cell_type |= FRONT;
-
-    if (x == 0)         cell_type = WALL;
-    if (x == (DIM - 1)) cell_type = WALL;
-    if (y == 0)         cell_type = WALL;
-    if (y == (DIM - 1)) cell_type = WALL;
-    if (z == 0)         cell_type = WALL;
-    if (z == (DIM - 1)) cell_type = WALL;
+    const uint bits = as_uint(value);
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+        return (ushort)((bits >> 16) | 0x40);
+    }
+    return (ushort)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+
+// Faces of the boundary crossing the column x, y, or WALL.
+inline int get_column_faces(const int x, const int y)
+{
+    int faces = NONE;
+
+    if (x == 1)           faces |= LEFT;
+    if (x == (DIM_X - 2)) faces |= RIGHT;
+    if (y == 1)           faces |= BOTTOM;
+    if (y == (DIM_Y - 2)) faces |= TOP;
+
+    if (x == 0)           faces = WALL;
+    if (x == (DIM_X - 1)) faces = WALL;
+    if (y == 0)           faces = WALL;
+    if (y == (DIM_Y - 1)) faces = WALL;
+
+    return faces;
+}
+
+
+// Faces of the boundary crossing the plane z, or WALL.
+inline int get_plane_faces(const int z)
+{
+    int faces = NONE;
+
+    if (z == 1)           faces |= BACK;
+    if (z == (DIM_Z - 2)) faces |= FRONT;
+
+    if (z == 0)           faces = WALL;
+    if (z == (DIM_Z - 1)) faces = WALL;
+
+    return faces;
+}
+
+
+// Type of the cell crossed by the given faces.
+inline int classify_cell(const int faces)
+{
+    if (faces & WALL) return WALL;
+
+    int cell_type = faces;
 
     if (cell_type == (LEFT  | BACK | BOTTOM) ||
         cell_type == (RIGHT | BACK | BOTTOM) ||
@@ -260,34 +415,176 @@ inline int get_cell_type(const int x, const int y, const int z)
     }
 
     if (cell_type == MOVING_BOUNDARY) cell_type |= MOVING;
+    if (cell_type & FACES)            cell_type |= BOUNDARY;
     if (cell_type == NONE)            cell_type = FLUID;
 
     return cell_type;
 }
 
 
+inline int get_cell_type(const int x, const int y, const int z)
+{
+    return classify_cell(get_column_faces(x, y) | get_plane_faces(z));
+}
+
+
+// Type of the cell in x, y, z of index id: the analytic geometry of the cavity
+// saves the map read of each iteration.
+#ifdef PROCEDURAL_GEOMETRY
+#define CELL_TYPE(map, id, x, y, z)             get_cell_type(x, y, z)
+#define COLUMN_CELL_TYPE(map, id, column, z)    classify_cell((column) | get_plane_faces(z))
+#else
+#define CELL_TYPE(map, id, x, y, z)             ((int)map[id])
+#define COLUMN_CELL_TYPE(map, id, column, z)    ((int)map[id])
+#endif
+
+
 // Bhatnagar-Gross-Kroop approximation collision operator
-inline real_t compute_bgk(const real_t f, const real_t f_eq)
+inline real_t compute_bgk(const real_t f, const real_t f_eq, const real_t inv_tau)
+{
+    return f + inv_tau * (f_eq - f);
+}
+
+
+// Collision of the distributions f0 ... f18 of a fluid cell, of density rho
+// and velocity ux, uy, uz, with the operator selected by COLLISION. eu and u2
+// are variables of the kernel, u2 holding the square of the velocity.
+#define BGK_X(i)                                                                                    \
+    eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                                       \
+    f##i = compute_bgk(f##i, (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2)), INV_TAU);
+
+#if (COLLISION == TRT_COLLISION)
+// Two relaxation times (Ginzburg 2008): the even and odd parts of each pair of
+// opposite directions relax with INV_TAU and INV_TAU_MINUS, given by the
+// magic parameter (tau - 1/2) * (tau_minus - 1/2) = TRT_MAGIC. The usual 1/4
+// and 3/16 make tau_minus large at low viscosity, which diverges in the cavity
+// before BGK does: the default keeps it stable down to VISCOSITY 0.0005.
+#ifndef TRT_MAGIC
+#define TRT_MAGIC                       0.01
+#endif
+#define INV_TAU_MINUS                   (1.0 / ((TRT_MAGIC / ((1.0 / INV_TAU) - 0.5)) + 0.5))
+#define TRT_X(i, s)                                                                                 \
+    {                                                                                               \
+        eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                                   \
+        const real_t even = INV_TAU * ((0.5 * (f##i + f##s)) - ((rho * OMEGA_##i) * (1.0 + (4.5 * eu * eu) - (1.5 * u2)))); \
+        const real_t odd = inv_tau_minus * ((0.5 * (f##i - f##s)) - ((rho * OMEGA_##i) * (3.0 * eu))); \
+        f##i -= even + odd;                                                                         \
+        f##s -= even - odd;                                                                         \
+    }
+#define COLLIDE()                                                                                   \
+    {                                                                                               \
+        const real_t inv_tau_minus = INV_TAU_MINUS;                                                 \
+        BGK_X(0)                                                                                    \
+        TRT_X(1, 3)   TRT_X(2, 4)   TRT_X(5, 6)   TRT_X(7, 9)   TRT_X(8, 10)                        \
+        TRT_X(11, 17) TRT_X(12, 18) TRT_X(13, 15) TRT_X(14, 16)                                     \
+    }
+#elif (COLLISION == MRT_COLLISION)
+// Multiple relaxation times in the orthogonal moment space of d'Humieres et
+// al. 2002: the deviation d_ of each moment from its equilibrium, scaled by
+// its relaxation rate and the inverse of its squared norm, is taken back to
+// the distributions with the transpose of the moment matrix. The density and
+// the momentum are conserved, the stresses relax with INV_TAU to keep the
+// viscosity, the other moments with the rates below.
+#ifndef MRT_S_E
+#define MRT_S_E                         1.19    // energy
+#endif
+#ifndef MRT_S_EPS
+#define MRT_S_EPS                       1.4     // square of the energy
+#endif
+#ifndef MRT_S_Q
+#define MRT_S_Q                         1.2     // energy flux
+#endif
+#ifndef MRT_S_PI
+#define MRT_S_PI                        1.4     // fourth order stresses
+#endif
+#ifndef MRT_S_M
+#define MRT_S_M                         1.98    // third order moments
+#endif
+#define COLLIDE()                                                                                                                                                                                                                                        \
+{                                                                                                                                                                                                                                                        \
+    const real_t d_e = (MRT_S_E / 2394.0) * ((-30.0 * f0 - 11.0 * (f1 + f2 + f3 + f4 + f5 + f6) + 8.0 * (f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18)) - (rho * (-11.0 + 19.0 * u2)));                                        \
+    const real_t d_eps = (MRT_S_EPS / 252.0) * ((12.0 * f0 - 4.0 * (f1 + f2 + f3 + f4 + f5 + f6) + (f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18)) - (rho * (3.0 - 5.5 * u2)));                                                \
+    const real_t d_qx = (MRT_S_Q / 40.0) * ((-4.0 * f1 + 4.0 * f3 + (f7 + f10 + f11 + f15) - (f8 + f9 + f13 + f17)) - ((-2.0 / 3.0) * rho * ux));                                                                                                    \
+    const real_t d_qy = (MRT_S_Q / 40.0) * ((-4.0 * f2 + 4.0 * f4 + (f7 + f8 + f12 + f16) - (f9 + f10 + f14 + f18)) - ((-2.0 / 3.0) * rho * uy));                                                                                                    \
+    const real_t d_qz = (MRT_S_Q / 40.0) * ((4.0 * f5 - 4.0 * f6 - (f11 + f12 + f13 + f14) + (f15 + f16 + f17 + f18)) - ((-2.0 / 3.0) * rho * uz));                                                                                                  \
+    const real_t d_pxx = (INV_TAU / 36.0) * ((2.0 * (f1 + f3) - (f2 + f4 + f5 + f6) + (f7 + f8 + f9 + f10 + f11 + f13 + f15 + f17) - 2.0 * (f12 + f14 + f16 + f18)) - (rho * ((2.0 * ux * ux) - (uy * uy) - (uz * uz))));                            \
+    const real_t d_pixx = (MRT_S_PI / 72.0) * ((-4.0 * (f1 + f3) + 2.0 * (f2 + f4 + f5 + f6) + (f7 + f8 + f9 + f10 + f11 + f13 + f15 + f17) - 2.0 * (f12 + f14 + f16 + f18)) - ((-0.5) * (rho * ((2.0 * ux * ux) - (uy * uy) - (uz * uz)))));        \
+    const real_t d_pww = (INV_TAU / 12.0) * (((f2 + f4 + f7 + f8 + f9 + f10) - (f5 + f6 + f11 + f13 + f15 + f17)) - (rho * ((uy * uy) - (uz * uz))));                                                                                                \
+    const real_t d_piww = (MRT_S_PI / 24.0) * ((-2.0 * (f2 + f4) + 2.0 * (f5 + f6) + (f7 + f8 + f9 + f10) - (f11 + f13 + f15 + f17)) - ((-0.5) * (rho * ((uy * uy) - (uz * uz)))));                                                                  \
+    const real_t d_pxy = (INV_TAU / 4.0) * (((f7 + f9) - (f8 + f10)) - (rho * ux * uy));                                                                                                                                                             \
+    const real_t d_pyz = (INV_TAU / 4.0) * (((f14 + f16) - (f12 + f18)) - (rho * uy * uz));                                                                                                                                                          \
+    const real_t d_pxz = (INV_TAU / 4.0) * (((f13 + f15) - (f11 + f17)) - (rho * ux * uz));                                                                                                                                                          \
+    const real_t d_mx = (MRT_S_M / 8.0) * ((f7 + f10 + f13 + f17) - (f8 + f9 + f11 + f15));                                                                                                                                                          \
+    const real_t d_my = (MRT_S_M / 8.0) * ((f9 + f10 + f12 + f16) - (f7 + f8 + f14 + f18));                                                                                                                                                          \
+    const real_t d_mz = (MRT_S_M / 8.0) * ((f12 + f14 + f15 + f17) - (f11 + f13 + f16 + f18));                                                                                                                                                       \
+    f0 -= 12.0 * d_eps - 30.0 * d_e;                                                                                                                                                                                                                 \
+    f1 -= -11.0 * d_e - 4.0 * (d_eps + d_qx + d_pixx) + 2.0 * d_pxx;                                                                                                                                                                                 \
+    f2 -= -11.0 * d_e - 4.0 * (d_eps + d_qy) - d_pxx + 2.0 * d_pixx + d_pww - 2.0 * d_piww;                                                                                                                                                          \
+    f3 -= -11.0 * d_e - 4.0 * (d_eps + d_pixx) + 4.0 * d_qx + 2.0 * d_pxx;                                                                                                                                                                           \
+    f4 -= -11.0 * d_e - 4.0 * d_eps + 4.0 * d_qy - d_pxx + 2.0 * d_pixx + d_pww - 2.0 * d_piww;                                                                                                                                                      \
+    f5 -= -11.0 * d_e - 4.0 * d_eps + 4.0 * d_qz - (d_pxx + d_pww) + 2.0 * (d_pixx + d_piww);                                                                                                                                                        \
+    f6 -= -11.0 * d_e - 4.0 * (d_eps + d_qz) - (d_pxx + d_pww) + 2.0 * (d_pixx + d_piww);                                                                                                                                                            \
+    f7 -= 8.0 * d_e + (d_eps + d_qx + d_qy + d_pxx + d_pixx + d_pww + d_piww + d_pxy + d_mx) - d_my;                                                                                                                                                 \
+    f8 -= 8.0 * d_e + (d_eps + d_qy + d_pxx + d_pixx + d_pww + d_piww) - (d_qx + d_pxy + d_mx + d_my);                                                                                                                                               \
+    f9 -= 8.0 * d_e + (d_eps + d_pxx + d_pixx + d_pww + d_piww + d_pxy + d_my) - (d_qx + d_qy + d_mx);                                                                                                                                               \
+    f10 -= 8.0 * d_e + (d_eps + d_qx + d_pxx + d_pixx + d_pww + d_piww + d_mx + d_my) - (d_qy + d_pxy);                                                                                                                                              \
+    f11 -= 8.0 * d_e + (d_eps + d_qx + d_pxx + d_pixx) - (d_qz + d_pww + d_piww + d_pxz + d_mx + d_mz);                                                                                                                                              \
+    f12 -= 8.0 * d_e + (d_eps + d_qy + d_my + d_mz) - (d_qz + d_pyz) - 2.0 * (d_pxx + d_pixx);                                                                                                                                                       \
+    f13 -= 8.0 * d_e + (d_eps + d_pxx + d_pixx + d_pxz + d_mx) - (d_qx + d_qz + d_pww + d_piww + d_mz);                                                                                                                                              \
+    f14 -= 8.0 * d_e + (d_eps + d_pyz + d_mz) - (d_qy + d_qz + d_my) - 2.0 * (d_pxx + d_pixx);                                                                                                                                                       \
+    f15 -= 8.0 * d_e + (d_eps + d_qx + d_qz + d_pxx + d_pixx + d_pxz + d_mz) - (d_pww + d_piww + d_mx);                                                                                                                                              \
+    f16 -= 8.0 * d_e + (d_eps + d_qy + d_qz + d_pyz + d_my) - 2.0 * (d_pxx + d_pixx) - d_mz;                                                                                                                                                         \
+    f17 -= 8.0 * d_e + (d_eps + d_qz + d_pxx + d_pixx + d_mx + d_mz) - (d_qx + d_pww + d_piww + d_pxz);                                                                                                                                              \
+    f18 -= 8.0 * d_e + (d_eps + d_qz) - (d_qy + d_pyz + d_my + d_mz) - 2.0 * (d_pxx + d_pixx);                                                                                                                                                       \
+}
+#else
+#define COLLIDE()                                                                                   \
+    BGK_X(0)  BGK_X(1)  BGK_X(2)  BGK_X(3)  BGK_X(4)  BGK_X(5)  BGK_X(6)                           \
+    BGK_X(7)  BGK_X(8)  BGK_X(9)  BGK_X(10) BGK_X(11) BGK_X(12)                                     \
+    BGK_X(13) BGK_X(14) BGK_X(15) BGK_X(16) BGK_X(17) BGK_X(18)
+#endif
+
+
+// Initial distribution, in the direction (ex, ey, ez) of weight omega, of
+// the cell in x, y, z, with the moving wall velocity moving_ux. NAN for walls
+// and cells out of the lattice.
+inline real_t initial_f(const int x, const int y, const int z, const real_t moving_ux,
+                        const real_t omega, const int ex, const int ey, const int ez)
 {
-    return f + INV_TAU * (f_eq - f);
+    if (x < 0 || x >= DIM_X || y < 0 || y >= DIM_Y || z < 0 || z >= DIM_Z) return NAN;
+
+    const int cell_type = get_cell_type(x, y, z);
+    if (is_wall(cell_type)) return NAN;
+
+    const real_t rho = INITIAL_DENSITY;
+    const real_t ux  = (is_moving_init(cell_type) ? moving_ux : 0.0);
+    const real_t uy  = (is_moving_init(cell_type) ? INITIAL_VELOCITY_Y : 0.0);
+    const real_t uz  = (is_moving_init(cell_type) ? INITIAL_VELOCITY_Z : 0.0);
+
+    const real_t eu = (ux * ex) + (uy * ey) + (uz * ez);
+    const real_t u2 = (ux * ux) + (uy * uy) + (uz * uz);
+    return (rho * omega) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2));
 }
 
 
-#if (SIMULATION_METHOD == SCRATCH_METHOD)
 __kernel
-void initialize(__global real_t * restrict f_stream,
-                __global real_t * restrict f_collide,
+void initialize(__global store_t * f_stream,
+                __global store_t * f_collide,
                 __global real_t * restrict density,
                 __global real_t * restrict u,
-                __global int * restrict map)
+                __global map_t * restrict map
+                ENSEMBLE_PARAMS)
 {
     const int x = get_global_id(0);
     const int y = get_global_id(1);
-    const int z = get_global_id(2);
+    const int z = MEMBER_Z();
+    const int member = MEMBER();
+    if (OUT_OF_LATTICE(x, y, z) || OUT_OF_ENSEMBLE(member)) return;
     const int id = IDxyz(x, y, z);
     const int cell_type = get_cell_type(x, y, z);
+    SELECT_MEMBER(member);
 
-    map[id] = cell_type;
+    if (member == 0) map[id] = (map_t)(cell_type & MAP_MASK);
 
     const real_t rho = INITIAL_DENSITY;
     const real_t ux  = (is_moving_init(cell_type) ? INITIAL_VELOCITY_X : 0.0);
@@ -299,6 +596,23 @@ void initialize(__global real_t * restrict f_stream,
     UY(id)      = (is_store_macro(cell_type) ? uy : NAN);
     UZ(id)      = (is_store_macro(cell_type) ? uz : NAN);
 
+#if (STREAMING_METHOD == PULL_METHOD)
+    // Each cell holds the distributions moving to its neighbours, so that
+    // the first iteration pulls the initial distributions of the cell itself
+    // as the push streaming does. The walls never update them.
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                                     \
+    const real_t f##i = initial_f(x + E##i##_X, y + E##i##_Y, z + E##i##_Z, INITIAL_VELOCITY_X, OMEGA_##i, E##i##_X, E##i##_Y, E##i##_Z);
+    UNROLL_19();
+
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_collide, IDxyzq(id, i), i, f##i);
+    UNROLL_19();
+
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id, i), i, f##i);
+    UNROLL_19();
+#else
 
     real_t eu = 0.0;
     const real_t u2 = (ux * ux) + (uy * uy) + (uz * uz);
@@ -309,36 +623,57 @@ void initialize(__global real_t * restrict f_stream,
     UNROLL_19();
 
 #undef  UNROLL_X
-#define UNROLL_X(i) f_collide[IDxyzq(id, i)] = (is_wall(cell_type) ? NAN : f##i);
+#define UNROLL_X(i) STORE_F(f_collide, IDxyzq(id, i), i, (is_wall(cell_type) ? NAN : f##i));
     UNROLL_19();
 
 #undef  UNROLL_X
-#define UNROLL_X(i) f_stream[IDxyzq(id, i)] = (is_wall(cell_type) ? NAN : f##i);
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id, i), i, (is_wall(cell_type) ? NAN : f##i));
     UNROLL_19();
+#endif
 }
 
 
 __kernel
-void compute(__global real_t * restrict f_stream,
-             __global const real_t * restrict f_collide,
+void compute(__global store_t * restrict f_stream,
+             __global const store_t * restrict f_collide,
              __global real_t * restrict density,
              __global real_t * restrict u,
-             __global const int * restrict map,
-             const int update_macro)
+             __global const map_t * restrict map,
+             const int update_macro
+             ENSEMBLE_PARAMS)
 {
     const int x = get_global_id(0);
     const int y = get_global_id(1);
-    const int z = get_global_id(2);
+    const int z = MEMBER_Z();
+    const int member = MEMBER();
+#if (STREAMING_METHOD == SAILFISH_METHOD)
+    // Every work item of the group takes part in the streaming through local
+    // memory: the ones out of the lattice are walls, and read the cell 0.
+    const int outside = OUT_OF_LATTICE(x, y, z) || OUT_OF_ENSEMBLE(member);
+    const int id = (outside ? 0 : IDxyz(x, y, z));
+    const int cell_type = (outside ? WALL : CELL_TYPE(map, id, x, y, z));
+#else
+    if (OUT_OF_LATTICE(x, y, z) || OUT_OF_ENSEMBLE(member)) return;
     const int id = IDxyz(x, y, z);
-    const int cell_type = map[id];
+    const int cell_type = CELL_TYPE(map, id, x, y, z);
+#endif
+    SELECT_MEMBER(member);
 
     real_t eu = 0.0;
     real_t u2 = 0.0;
 #define tmp eu
 
+#if (STREAMING_METHOD == PULL_METHOD)
+    // Walls have no neighbours to pull from
+    if (is_wall(cell_type)) return;
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDXYZQ(x - E##i##_X, y - E##i##_Y, z - E##i##_Z, i), i);
+    UNROLL_19();
+#else
 #undef  UNROLL_X
-#define UNROLL_X(i) real_t f##i = f_collide[IDxyzq(id, i)];
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDxyzq(id, i), i);
     UNROLL_19();
+#endif
 
     if (is_moving(cell_type)) {
         f5  = F_S( 5);
@@ -410,27 +745,31 @@ void compute(__global real_t * restrict f_stream,
 
     /***   Collision   ***/
     if (is_collision(cell_type)) {
-#undef  UNROLL_X
-#define UNROLL_X(i)                                                                                     \
-        eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                                       \
-        f##i = compute_bgk(f##i, (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2)));
-        UNROLL_19();
+        COLLIDE();
     }
 
 #if (STREAMING_METHOD == SCRATCH_METHOD)
     if (is_wall(cell_type)) return;
 #undef  UNROLL_X
-#define UNROLL_X(i) f_stream[IDXYZQ(x + E##i##_X, y + E##i##_Y, z + E##i##_Z, i)] = f##i;
+#define UNROLL_X(i) STORE_F(f_stream, IDXYZQ(x + E##i##_X, y + E##i##_Y, z + E##i##_Z, i), i, f##i);
+    UNROLL_19();
+#endif
+
+#if (STREAMING_METHOD == PULL_METHOD)
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id, i), i, f##i);
     UNROLL_19();
 #endif
 
 #if (STREAMING_METHOD == SAILFISH_METHOD)
+    // Push streaming with the distributions moving along x shifted by one
+    // work item in local memory (Sailfish, Januszewski and Kostur 2014), so
+    // that each work item stores them in its own column x, as the ones moving
+    // along y and z, and the stores of a row are coalesced. Only the first
+    // and the last work item of the group store them to the next column. The
+    // work groups must be LWS x 1 x 1 items.
     const int lx = get_local_id(0);
-
-    bool alive = true;
-    if (is_wall(cell_type) || is_corner(cell_type)) {
-        alive = false;
-    }
+    const int alive = !is_wall(cell_type);
 
     __local real_t  _f1[LWS];
     __local real_t  _f7[LWS];
@@ -443,143 +782,499 @@ void compute(__global real_t * restrict f_stream,
 #define _f13 _f15
 #define _f17 _f11
 
+    if (alive) {
+        STORE_F(f_stream, IDxyzq(id, 0), 0, f0);                                        //  0  0  0
+        STORE_F(f_stream, IDXYZQ(x, y + 1, z,     2),  2,  f2);                          //  0 +1  0
+        STORE_F(f_stream, IDXYZQ(x, y - 1, z,     4),  4,  f4);                          //  0 -1  0
+        STORE_F(f_stream, IDXYZQ(x, y,     z - 1, 5),  5,  f5);                          //  0  0 -1
+        STORE_F(f_stream, IDXYZQ(x, y,     z + 1, 6),  6,  f6);                          //  0  0 +1
+        STORE_F(f_stream, IDXYZQ(x, y + 1, z - 1, 12), 12, f12);                         //  0 +1 -1
+        STORE_F(f_stream, IDXYZQ(x, y - 1, z - 1, 14), 14, f14);                         //  0 -1 -1
+        STORE_F(f_stream, IDXYZQ(x, y + 1, z + 1, 16), 16, f16);                         //  0 +1 +1
+        STORE_F(f_stream, IDXYZQ(x, y - 1, z + 1, 18), 18, f18);                         //  0 -1 +1
+    }
+
     _f1[lx] = -1.0; // Fill the propagation buffer with sentinel values.
     barrier(CLK_LOCAL_MEM_FENCE);
 
+    // E propagation in local memory, in global memory at the right block boundary
     if (alive) {
-        f_stream[IDxyzq(id, 0)] = f0;                                                   //  0  0  0
-        // Propagation in directions orthogonal to the X axis (global memory)
-        if (y < (DIM-1)) f_stream[IDXYZQ(   x, y+1,   z,  2)] = f2;                     //  0 +1  0
-        if (y > 0      ) f_stream[IDXYZQ(   x, y-1,   z,  4)] = f4;                     //  0 -1  0
-        if (z > 0      ) f_stream[IDXYZQ(   x,   y, z-1,  5)] = f5;                     //  0  0 -1
-        if (z < (DIM-1)) f_stream[IDXYZQ(   x,   y, z+1,  6)] = f6;                     //  0  0 +1
-
-        if (y < (DIM-1) && z > 0      ) f_stream[IDXYZQ(   x, y+1, z-1, 12)] = f12;     //  0 +1 -1
-        if (y > 0       && z > 0      ) f_stream[IDXYZQ(   x, y-1, z-1, 14)] = f14;     //  0 -1 -1
-        if (y < (DIM-1) && z < (DIM-1)) f_stream[IDXYZQ(   x, y+1, z+1, 16)] = f16;     //  0 +1 +1
-        if (y > 0       && z < (DIM-1)) f_stream[IDXYZQ(   x, y-1, z+1, 18)] = f18;     //  0 -1 +1
-
-        // E propagation in shared memory
-        if (x < (DIM-1) && lx < (LWS-1) && x != (DIM-2)) {
+        if (lx < (LWS - 1)) {
              _f1[lx + 1] =  f1;
              _f7[lx + 1] =  f7;
             _f10[lx + 1] = f10;
             _f11[lx + 1] = f11;
             _f15[lx + 1] = f15;
+        } else {
+            STORE_F(f_stream, IDXYZQ(x + 1, y,     z,     1),  1,  f1);                  // +1  0  0
+            STORE_F(f_stream, IDXYZQ(x + 1, y + 1, z,     7),  7,  f7);                  // +1 +1  0
+            STORE_F(f_stream, IDXYZQ(x + 1, y - 1, z,     10), 10, f10);                 // +1 -1  0
+            STORE_F(f_stream, IDXYZQ(x + 1, y,     z - 1, 11), 11, f11);                 // +1  0 -1
+            STORE_F(f_stream, IDXYZQ(x + 1, y,     z + 1, 15), 15, f15);                 // +1  0 +1
         }
     }
 
     barrier(CLK_LOCAL_MEM_FENCE);
-    // Save locally propagated distributions into global memory.
-    // The leftmost thread is not updated in this block.
-    if (alive && lx > 0 && x < DIM) {
-        if (_f1[lx] != -1.0) {
-                             f_stream[IDXYZQ( x,   y,   z,  1)] =  _f1[lx];             //  0  0  0
-            if (y < (DIM-1)) f_stream[IDXYZQ( x, y+1,   z,  7)] =  _f7[lx];             //  0 +1  0
-            if (y > 0      ) f_stream[IDXYZQ( x, y-1,   z, 10)] = _f10[lx];             //  0 -1  0
-            if (z < (DIM-1)) f_stream[IDXYZQ( x,   y, z+1, 15)] = _f15[lx];             //  0  0 +1
-            if (z > 0      ) f_stream[IDXYZQ( x,   y, z-1, 11)] = _f11[lx];             //  0  0 -1
-        }
+    // Save the distributions of the left work item, if it was not a wall
+    if (lx > 0 && _f1[lx] != -1.0) {
+        STORE_F(f_stream, IDXYZQ(x, y,     z,     1),  1,   _f1[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y + 1, z,     7),  7,   _f7[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y - 1, z,     10), 10, _f10[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y,     z - 1, 11), 11, _f11[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y,     z + 1, 15), 15, _f15[lx]);
     }
 
     barrier(CLK_LOCAL_MEM_FENCE);
     _f1[lx] = -1.0; // Refill the propagation buffer with sentinel values.
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    // W propagation in shared memory
-    if (alive && (lx > 1 || (lx > 0 && x >= LWS))) {
-         _f3[lx - 1] = f3;
-         _f8[lx - 1] = f8;
-         _f9[lx - 1] = f9;
-        _f13[lx - 1] = f13;
-        _f17[lx - 1] = f17;
+    // W propagation in local memory, in global memory at the left block boundary
+    if (alive) {
+        if (lx > 0) {
+             _f3[lx - 1] =  f3;
+             _f8[lx - 1] =  f8;
+             _f9[lx - 1] =  f9;
+            _f13[lx - 1] = f13;
+            _f17[lx - 1] = f17;
+        } else {
+            STORE_F(f_stream, IDXYZQ(x - 1, y,     z,     3),  3,  f3);                  // -1  0  0
+            STORE_F(f_stream, IDXYZQ(x - 1, y + 1, z,     8),  8,  f8);                  // -1 +1  0
+            STORE_F(f_stream, IDXYZQ(x - 1, y - 1, z,     9),  9,  f9);                  // -1 -1  0
+            STORE_F(f_stream, IDXYZQ(x - 1, y,     z - 1, 13), 13, f13);                 // -1  0 -1
+            STORE_F(f_stream, IDXYZQ(x - 1, y,     z + 1, 17), 17, f17);                 // -1  0 +1
+        }
     }
 
     barrier(CLK_LOCAL_MEM_FENCE);
-    // The rightmost thread is not updated in this block.
-    if (alive && lx < (LWS-1) && x < (DIM-1) && _f1[lx] != -1.0) {
-                         f_stream[IDXYZQ( x,   y,   z,  3)] =  _f3[lx];             //  0  0  0
-        if (y < (DIM-1)) f_stream[IDXYZQ( x, y+1,   z,  8)] =  _f8[lx];             //  0 +1  0
-        if (y > 0      ) f_stream[IDXYZQ( x, y-1,   z,  9)] =  _f9[lx];             //  0 -1  0
-        if (z > 0      ) f_stream[IDXYZQ( x,   y, z-1, 13)] = _f13[lx];             //  0  0 -1
-        if (z < (DIM-1)) f_stream[IDXYZQ( x,   y, z+1, 17)] = _f17[lx];             //  0  0 +1
+    // Save the distributions of the right work item, if it was not a wall
+    if (lx < (LWS - 1) && _f3[lx] != -1.0) {
+        STORE_F(f_stream, IDXYZQ(x, y,     z,     3),  3,   _f3[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y + 1, z,     8),  8,   _f8[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y - 1, z,     9),  9,   _f9[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y,     z - 1, 13), 13, _f13[lx]);
+        STORE_F(f_stream, IDXYZQ(x, y,     z + 1, 17), 17, _f17[lx]);
     }
 #endif
 }
 
-#else
+
+
+// The kernels below, up to the diagnostics, update a single lattice.
+#if (ENSEMBLE == 1)
+// In place streaming on a single buffer (AA pattern, Bailey et al. 2009).
+//
+// The iterations alternate two steps, both reading and writing the same
+// locations of a cell, so that cells never race with each other:
+//
+//  step 0: reads the distributions of the cell, collides them and stores
+//          them back into the cell, in the slots of the opposite directions.
+//  step 1: reads the distributions from the opposite slots of the
+//          neighbours they come from, collides them and stores them into the
+//          neighbours they move to.
+//
+// After step 1 the lattice has the same layout of f_stream in the push
+// kernels, which is also the one written by initialize.
+//
+// The push kernels never write the distributions coming out of the walls,
+// so they keep their initial (rest equilibrium) value. Here the same slots
+// are overwritten by the steps, then the corners, that propagate these
+// values to their neighbours, restore them explicitly.
+inline int is_wall_at(const int x, const int y, const int z)
+{
+    return (x == 0 || x == (DIM_X - 1) || y == 0 || y == (DIM_Y - 1) || z == 0 || z == (DIM_Z - 1));
+}
+
 
 __kernel
-void initialize(__global real_t * restrict f_stream,
-                __global real_t * restrict f_collide,
+void compute_aa(__global store_t * restrict f,
                 __global real_t * restrict density,
                 __global real_t * restrict u,
-                __global int * restrict map)
+                __global const map_t * restrict map,
+                const int update_macro,
+                const int step)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int z = get_global_id(2);
+    if (OUT_OF_LATTICE(x, y, z)) return;
+    const int id = IDxyz(x, y, z);
+    const int cell_type = CELL_TYPE(map, id, x, y, z);
+
+    if (is_wall(cell_type)) return;
+
+    real_t eu = 0.0;
+    real_t u2 = 0.0;
+#define tmp eu
+
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = (step ? LOAD_F(f, IDXYZQ(x - E##i##_X, y - E##i##_Y, z - E##i##_Z, S(i)), i) : LOAD_F(f, IDxyzq(id, i), i));
+    UNROLL_19();
+
+    if (is_corner(cell_type)) {
+#undef  UNROLL_X
+#define UNROLL_X(i) if (is_wall_at(x - E##i##_X, y - E##i##_Y, z - E##i##_Z)) f##i = INITIAL_DENSITY * OMEGA_##i;
+        UNROLL_19();
+    }
+
+    if (is_moving(cell_type)) {
+        f5  = F_S( 5);
+        f11 = F_S(11);
+        f12 = F_S(12);
+        f13 = F_S(13);
+        f14 = F_S(14);
+    }
+
+    /***   Compute Macro quantities (rho & u)   ***/
+    const real_t rho = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
+
+    real_t ux = NAN;
+    real_t uy = NAN;
+    real_t uz = NAN;
+
+    if (is_moving(cell_type)) {
+        ux = INITIAL_VELOCITY_X;
+        uy = INITIAL_VELOCITY_Y;
+        uz = INITIAL_VELOCITY_Z;
+    } else {
+        ux = (( f1 +  f7 + f10 + f11 + f15) - ( f3 +  f8 +  f9 + f13 + f17)) / rho;
+        uy = (( f2 +  f7 +  f8 + f12 + f16) - ( f4 +  f9 + f10 + f14 + f18)) / rho;
+        uz = (( f6 + f15 + f16 + f17 + f18) - ( f5 + f11 + f12 + f13 + f14)) / rho;
+    }
+
+    /***   Store macro quantities (rho & u)   ***/
+    if (update_macro && is_store_macro(cell_type)) {
+        density[id] = rho;
+        UX(id) = ux;
+        UY(id) = uy;
+        UZ(id) = uz;
+    }
+
+    u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+    /***   Boundary Conditions   ***/
+    if (is_moving(cell_type)) {
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                  \
+        eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                    \
+        f##i = (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2));
+        UNROLL_19();
+
+    } else if (is_bounceback(cell_type)) {
+
+#undef  UNROLL_X
+#define UNROLL_X(i)     \
+        tmp = f##i;     \
+        f##i = F_S(i);  \
+        F_S(i) = tmp;
+        UNROLL_HALF_19();
+    }
+
+
+    /***   Collision   ***/
+    if (is_collision(cell_type)) {
+        COLLIDE();
+    }
+
+    /***   Streaming   ***/
+    if (step) {
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f, IDXYZQ(x + E##i##_X, y + E##i##_Y, z + E##i##_Z, i), i, f##i);
+        UNROLL_19();
+    } else {
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f, IDxyzq(id, S(i)), i, f##i);
+        UNROLL_19();
+    }
+}
+
+
+#if (STREAMING_METHOD != SAILFISH_METHOD)
+// Thread coarsened compute: each work item updates Z_CELLS cells of the
+// column x, y, marching along z from z = get_global_id(2) * Z_CELLS, with
+// push or pull streaming as compute does.
+//
+// The index of the cell advances by a plane at each step and the neighbours
+// are found at constant offsets from it, instead of computing the index of
+// every neighbour from its coordinates. The faces of the column along x and
+// y are classified once: columns in the walls are skipped as a whole, and the
+// procedural geometry only adds the faces of each plane.
+__kernel
+void compute_zmarch(__global store_t * restrict f_stream,
+                    __global const store_t * restrict f_collide,
+                    __global real_t * restrict density,
+                    __global real_t * restrict u,
+                    __global const map_t * restrict map,
+                    const int update_macro)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int z_begin = get_global_id(2) * Z_CELLS;
+    if (OUT_OF_LATTICE(x, y, z_begin)) return;
+    const int z_end = min(z_begin + Z_CELLS, DIM_Z);
+
+    const int column = get_column_faces(x, y);
+    if (is_wall(column)) return;
+
+    real_t eu = 0.0;
+    real_t u2 = 0.0;
+#define tmp eu
+
+    int id = IDxyz(x, y, z_begin);
+    for (int z = z_begin; z < z_end; ++z, id += PLANE) {
+        const int cell_type = COLUMN_CELL_TYPE(map, id, column, z);
+
+        // Walls have no neighbours to pull from, nor to push to
+        if (is_wall(cell_type)) continue;
+
+#if (STREAMING_METHOD == PULL_METHOD)
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDxyzq(id - OFFSET(i), i), i);
+        UNROLL_19();
+#else
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDxyzq(id, i), i);
+        UNROLL_19();
+#endif
+
+        if (is_moving(cell_type)) {
+            f5  = F_S( 5);
+            f11 = F_S(11);
+            f12 = F_S(12);
+            f13 = F_S(13);
+            f14 = F_S(14);
+        }
+
+        /***   Compute Macro quantities (rho & u)   ***/
+        const real_t rho = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
+
+        real_t ux = NAN;
+        real_t uy = NAN;
+        real_t uz = NAN;
+
+        if (is_moving(cell_type)) {
+            ux = INITIAL_VELOCITY_X;
+            uy = INITIAL_VELOCITY_Y;
+            uz = INITIAL_VELOCITY_Z;
+        } else {
+            ux = (( f1 +  f7 + f10 + f11 + f15) - ( f3 +  f8 +  f9 + f13 + f17)) / rho;
+            uy = (( f2 +  f7 +  f8 + f12 + f16) - ( f4 +  f9 + f10 + f14 + f18)) / rho;
+            uz = (( f6 + f15 + f16 + f17 + f18) - ( f5 + f11 + f12 + f13 + f14)) / rho;
+        }
+
+        /***   Store macro quantities (rho & u)   ***/
+        if (update_macro && is_store_macro(cell_type)) {
+            density[id] = rho;
+            UX(id) = ux;
+            UY(id) = uy;
+            UZ(id) = uz;
+        }
+
+        u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+        /***   Boundary Conditions   ***/
+        if (is_moving(cell_type)) {
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                  \
+            eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                \
+            f##i = (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2));
+            UNROLL_19();
+
+        } else if (is_bounceback(cell_type)) {
+
+#undef  UNROLL_X
+#define UNROLL_X(i)         \
+            tmp = f##i;     \
+            f##i = F_S(i);  \
+            F_S(i) = tmp;
+            UNROLL_HALF_19();
+        }
+
+
+        /***   Collision   ***/
+        if (is_collision(cell_type)) {
+            COLLIDE();
+        }
+
+        /***   Streaming   ***/
+#if (STREAMING_METHOD == PULL_METHOD)
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id, i), i, f##i);
+        UNROLL_19();
+#else
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id + OFFSET(i), i), i, f##i);
+        UNROLL_19();
+#endif
+    }
+}
+#endif
+
+
+#if (STREAMING_METHOD != SAILFISH_METHOD)
+// Interior of the cavity: the box of the cells at least 2 cells away from
+// the faces of the lattice, whose cells and neighbours are all FLUID, so that
+// the map is not read and no branch depends on the cell type. The range
+// starts at the global offset 2, 2, 2 and is rounded up to the work group
+// size, the work items past the box do nothing. The shell around the box is
+// updated by compute, launched on thin boxes around it, with push or pull
+// streaming as here.
+__kernel
+void compute_interior(__global store_t * restrict f_stream,
+                      __global const store_t * restrict f_collide,
+                      __global real_t * restrict density,
+                      __global real_t * restrict u,
+                      __global const map_t * restrict map,
+                      const int update_macro)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int z = get_global_id(2);
+    if (x > (DIM_X - 3) || y > (DIM_Y - 3) || z > (DIM_Z - 3)) return;
+    const int id = IDxyz(x, y, z);
+
+    real_t eu = 0.0;
+    real_t u2 = 0.0;
+
+#if (STREAMING_METHOD == PULL_METHOD)
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDxyzq(id - OFFSET(i), i), i);
+    UNROLL_19();
+#else
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDxyzq(id, i), i);
+    UNROLL_19();
+#endif
+
+    /***   Compute Macro quantities (rho & u)   ***/
+    const real_t rho = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
+    const real_t ux = (( f1 +  f7 + f10 + f11 + f15) - ( f3 +  f8 +  f9 + f13 + f17)) / rho;
+    const real_t uy = (( f2 +  f7 +  f8 + f12 + f16) - ( f4 +  f9 + f10 + f14 + f18)) / rho;
+    const real_t uz = (( f6 + f15 + f16 + f17 + f18) - ( f5 + f11 + f12 + f13 + f14)) / rho;
+
+    /***   Store macro quantities (rho & u)   ***/
+    if (update_macro) {
+        density[id] = rho;
+        UX(id) = ux;
+        UY(id) = uy;
+        UZ(id) = uz;
+    }
+
+    u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+    /***   Collision   ***/
+    COLLIDE();
+
+    /***   Streaming   ***/
+#if (STREAMING_METHOD == PULL_METHOD)
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id, i), i, f##i);
+    UNROLL_19();
+#else
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id + OFFSET(i), i), i, f##i);
+    UNROLL_19();
+#endif
+}
+#endif
+
+
+// Sparse execution: only the cells that are not walls are updated, one work
+// item each, and their distributions are stored in the CSoA layout of the
+// compacted index a of the cell, instead of the lattice index id.
+//
+// cells[a]                 lattice index id of the cell a
+// neighbours[IDxyzq(a, i)] compacted index of the cell in x + e_i, or -1 if
+//                          it is a wall
+//
+// Both tables are built by the host from the map written by initialize_map.
+// The macro quantities and the map keep the layout of the whole lattice.
+// Streaming is push only: the distributions coming out of the walls are
+// never written, and keep their initial value as in the compute kernel.
+__kernel
+void initialize_map(__global real_t * restrict density,
+                    __global real_t * restrict u,
+                    __global map_t * restrict map)
 {
     const int x = get_global_id(0);
     const int y = get_global_id(1);
     const int z = get_global_id(2);
+    if (OUT_OF_LATTICE(x, y, z)) return;
     const int id = IDxyz(x, y, z);
     const int cell_type = get_cell_type(x, y, z);
 
-    map[id] = cell_type;
+    map[id] = (map_t)(cell_type & MAP_MASK);
+
+    density[id] = (is_store_macro(cell_type) ? INITIAL_DENSITY : NAN);
+    UX(id)      = (is_store_macro(cell_type) ? (is_moving_init(cell_type) ? INITIAL_VELOCITY_X : 0.0) : NAN);
+    UY(id)      = (is_store_macro(cell_type) ? (is_moving_init(cell_type) ? INITIAL_VELOCITY_Y : 0.0) : NAN);
+    UZ(id)      = (is_store_macro(cell_type) ? (is_moving_init(cell_type) ? INITIAL_VELOCITY_Z : 0.0) : NAN);
+}
+
+
+__kernel
+void initialize_sparse(__global store_t * restrict f_stream,
+                       __global store_t * restrict f_collide,
+                       __global const int * restrict cells,
+                       const int num_cells)
+{
+    const int a = get_global_id(0);
+    if (a >= num_cells) return;
 
+    const int id = cells[a];
+    const int x = id % DIM_X;
+    const int y = (id / DIM_X) % DIM_Y;
+    const int z = id / (DIM_X * DIM_Y);
+    const int cell_type = get_cell_type(x, y, z);
 
     const real_t rho = INITIAL_DENSITY;
     const real_t ux  = (is_moving_init(cell_type) ? INITIAL_VELOCITY_X : 0.0);
     const real_t uy  = (is_moving_init(cell_type) ? INITIAL_VELOCITY_Y : 0.0);
     const real_t uz  = (is_moving_init(cell_type) ? INITIAL_VELOCITY_Z : 0.0);
 
-    density[id] = (is_store_macro(cell_type) ? rho : NAN);
-    UX(id)      = (is_store_macro(cell_type) ? ux : NAN);
-    UY(id)      = (is_store_macro(cell_type) ? uy : NAN);
-    UZ(id)      = (is_store_macro(cell_type) ? uz : NAN);
+    real_t eu = 0.0;
+    const real_t u2 = (ux * ux) + (uy * uy) + (uz * uz);
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                           \
+    eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                                 \
+    const real_t f##i = (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2));
+    UNROLL_19();
 
-    const real_t f0  = (OMEGA_0  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                        + (OMEGA_0  * rho);
-    const real_t f1  = (OMEGA_1  * rho) * (ux * (3.0 * ux + 3.0) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                   + (OMEGA_1  * rho);
-    const real_t f2  = (OMEGA_2  * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))                  + (OMEGA_2  * rho);
-    const real_t f3  = (OMEGA_3  * rho) * (ux * (3.0 * ux - 3.0) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                   + (OMEGA_3  * rho);
-    const real_t f4  = (OMEGA_4  * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))                  + (OMEGA_4  * rho);
-    const real_t f5  = (OMEGA_5  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))                  + (OMEGA_5  * rho);
-    const real_t f6  = (OMEGA_6  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))                  + (OMEGA_6  * rho);
-    const real_t f7  = (OMEGA_7  * rho) * (ux * (3.0 * ux + 9.0 * uy + 3.0) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))  + (OMEGA_7  * rho);
-    const real_t f8  = (OMEGA_8  * rho) * (ux * (3.0 * ux - 9.0 * uy - 3.0) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))  + (OMEGA_8  * rho);
-    const real_t f9  = (OMEGA_9  * rho) * (ux * (3.0 * ux + 9.0 * uy - 3.0) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))  + (OMEGA_9  * rho);
-    const real_t f10 = (OMEGA_10 * rho) * (ux * (3.0 * ux - 9.0 * uy + 3.0) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))  + (OMEGA_10 * rho);
-    const real_t f11 = (OMEGA_11 * rho) * (ux * (3.0 * ux - 9.0 * uz + 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))  + (OMEGA_11 * rho);
-    const real_t f12 = (OMEGA_12 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 9.0 * uz + 3.0) + uz * (3.0 * uz - 3.0)) + (OMEGA_12 * rho);
-    const real_t f13 = (OMEGA_13 * rho) * (ux * (3.0 * ux + 9.0 * uz - 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))  + (OMEGA_13 * rho);
-    const real_t f14 = (OMEGA_14 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 9.0 * uz - 3.0) + uz * (3.0 * uz - 3.0)) + (OMEGA_14 * rho);
-    const real_t f15 = (OMEGA_15 * rho) * (ux * (3.0 * ux + 9.0 * uz + 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))  + (OMEGA_15 * rho);
-    const real_t f16 = (OMEGA_16 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 9.0 * uz + 3.0) + uz * (3.0 * uz + 3.0)) + (OMEGA_16 * rho);
-    const real_t f17 = (OMEGA_17 * rho) * (ux * (3.0 * ux - 9.0 * uz - 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))  + (OMEGA_17 * rho);
-    const real_t f18 = (OMEGA_18 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 9.0 * uz - 3.0) + uz * (3.0 * uz + 3.0)) + (OMEGA_18 * rho);
-
-#undef  UNROLL_X
-#define UNROLL_X(i) f_collide[IDxyzq(id, i)] = (is_wall(cell_type) ? NAN : f##i);
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_collide, IDxyzq(a, i), i, f##i);
     UNROLL_19();
 
 #undef  UNROLL_X
-#define UNROLL_X(i) f_stream[IDxyzq(id, i)] = (is_wall(cell_type) ? NAN : f##i);
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(a, i), i, f##i);
     UNROLL_19();
 }
 
 
 __kernel
-void compute(__global real_t * restrict f_stream,
-             __global const real_t * restrict f_collide,
-             __global real_t * restrict density,
-             __global real_t * restrict u,
-             __global const int * restrict map)
+void compute_sparse(__global store_t * restrict f_stream,
+                    __global const store_t * restrict f_collide,
+                    __global real_t * restrict density,
+                    __global real_t * restrict u,
+                    __global const map_t * restrict map,
+                    const int update_macro,
+                    __global const int * restrict cells,
+                    __global const int * restrict neighbours,
+                    const int num_cells)
 {
-    const int x = get_global_id(0);
-    const int y = get_global_id(1);
-    const int z = get_global_id(2);
-    const int id = IDxyz(x, y, z);
-    const int cell_type = map[id];
+    const int a = get_global_id(0);
+    if (a >= num_cells) return;
+
+    const int id = cells[a];
+    const int x = id % DIM_X;
+    const int y = (id / DIM_X) % DIM_Y;
+    const int z = id / (DIM_X * DIM_Y);
+    const int cell_type = CELL_TYPE(map, id, x, y, z);
+
+    real_t eu = 0.0;
+    real_t u2 = 0.0;
+#define tmp eu
 
 #undef  UNROLL_X
-#define UNROLL_X(i) real_t f##i = f_collide[IDxyzq(id, i)];
+#define UNROLL_X(i) real_t f##i = LOAD_F(f_collide, IDxyzq(a, i), i);
     UNROLL_19();
 
     if (is_moving(cell_type)) {
@@ -591,7 +1286,7 @@ void compute(__global real_t * restrict f_stream,
     }
 
     /***   Compute Macro quantities (rho & u)   ***/
-    const real_t rho = f5 + f11 + f12 + f14 + f13 + f0 + f1 + f2 + f7 + f8 + f4 + f10 + f9 + f6 + f15 + f16 + f18 + f17 + f3;
+    const real_t rho = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
 
     real_t ux = NAN;
     real_t uy = NAN;
@@ -602,217 +1297,457 @@ void compute(__global real_t * restrict f_stream,
         uy = INITIAL_VELOCITY_Y;
         uz = INITIAL_VELOCITY_Z;
     } else {
-        ux = (f11 - f13 +  f1 +  f7 -  f8 + f10 -  f9 + f15 - f17 -  f3) / rho;
-        uy = (f12 - f14 +  f2 +  f7 +  f8 -  f4 - f10 -  f9 + f16 - f18) / rho;
-        uz = (-f5 - f11 - f12 - f14 - f13  + f6 + f15 + f16 + f18 + f17) / rho;
+        ux = (( f1 +  f7 + f10 + f11 + f15) - ( f3 +  f8 +  f9 + f13 + f17)) / rho;
+        uy = (( f2 +  f7 +  f8 + f12 + f16) - ( f4 +  f9 + f10 + f14 + f18)) / rho;
+        uz = (( f6 + f15 + f16 + f17 + f18) - ( f5 + f11 + f12 + f13 + f14)) / rho;
     }
 
     /***   Store macro quantities (rho & u)   ***/
-    if (is_store_macro(cell_type)) {
+    if (update_macro && is_store_macro(cell_type)) {
         density[id] = rho;
         UX(id) = ux;
         UY(id) = uy;
         UZ(id) = uz;
     }
 
+    u2 = (ux * ux) + (uy * uy) + (uz * uz);
 
     /***   Boundary Conditions   ***/
     if (is_moving(cell_type)) {
-        f0  = (OMEGA_0  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                        + (OMEGA_0  * rho);
-        f1  = (OMEGA_1  * rho) * (ux * (3.0 * ux + 3.0) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                   + (OMEGA_1  * rho);
-        f2  = (OMEGA_2  * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))                  + (OMEGA_2  * rho);
-        f3  = (OMEGA_3  * rho) * (ux * (3.0 * ux - 3.0) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                   + (OMEGA_3  * rho);
-        f4  = (OMEGA_4  * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))                  + (OMEGA_4  * rho);
-        f5  = (OMEGA_5  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))                  + (OMEGA_5  * rho);
-        f6  = (OMEGA_6  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))                  + (OMEGA_6  * rho);
-        f7  = (OMEGA_7  * rho) * (ux * (3.0 * ux + 9.0 * uy + 3.0) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))  + (OMEGA_7  * rho);
-        f8  = (OMEGA_8  * rho) * (ux * (3.0 * ux - 9.0 * uy - 3.0) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))  + (OMEGA_8  * rho);
-        f9  = (OMEGA_9  * rho) * (ux * (3.0 * ux + 9.0 * uy - 3.0) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))  + (OMEGA_9  * rho);
-        f10 = (OMEGA_10 * rho) * (ux * (3.0 * ux - 9.0 * uy + 3.0) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))  + (OMEGA_10 * rho);
-        f11 = (OMEGA_11 * rho) * (ux * (3.0 * ux - 9.0 * uz + 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))  + (OMEGA_11 * rho);
-        f12 = (OMEGA_12 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 9.0 * uz + 3.0) + uz * (3.0 * uz - 3.0)) + (OMEGA_12 * rho);
-        f13 = (OMEGA_13 * rho) * (ux * (3.0 * ux + 9.0 * uz - 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))  + (OMEGA_13 * rho);
-        f14 = (OMEGA_14 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 9.0 * uz - 3.0) + uz * (3.0 * uz - 3.0)) + (OMEGA_14 * rho);
-        f15 = (OMEGA_15 * rho) * (ux * (3.0 * ux + 9.0 * uz + 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))  + (OMEGA_15 * rho);
-        f16 = (OMEGA_16 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 9.0 * uz + 3.0) + uz * (3.0 * uz + 3.0)) + (OMEGA_16 * rho);
-        f17 = (OMEGA_17 * rho) * (ux * (3.0 * ux - 9.0 * uz - 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))  + (OMEGA_17 * rho);
-        f18 = (OMEGA_18 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 9.0 * uz - 3.0) + uz * (3.0 * uz + 3.0)) + (OMEGA_18 * rho);
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                  \
+        eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                    \
+        f##i = (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2));
+        UNROLL_19();
+
     } else if (is_bounceback(cell_type)) {
-        real_t tmp = f1;
-        f1 = f3;
-        f3 = tmp;
 
-        tmp = f2;
-        f2 = f4;
-        f4 = tmp;
+#undef  UNROLL_X
+#define UNROLL_X(i)     \
+        tmp = f##i;     \
+        f##i = F_S(i);  \
+        F_S(i) = tmp;
+        UNROLL_HALF_19();
+    }
 
-        tmp = f6;
-        f6 = f5;
-        f5 = tmp;
 
-        tmp = f7;
-        f7 = f9;
-        f9 = tmp;
+    /***   Collision   ***/
+    if (is_collision(cell_type)) {
+        COLLIDE();
+    }
 
-        tmp = f8;
-        f8 = f10;
-        f10 = tmp;
-        
-        tmp = f16;
-        f16 = f14;
-        f14 = tmp;
+    /***   Streaming   ***/
+    int n;
+#undef  UNROLL_X
+#define UNROLL_X(i)                                         \
+    n = neighbours[IDxyzq(a, i)];                           \
+    if (n >= 0) STORE_F(f_stream, IDxyzq(n, i), i, f##i);
+    UNROLL_19();
+}
 
-        tmp = f18;
-        f18 = f12;
-        f12 = tmp;
 
-        tmp = f15;
-        f15 = f13;
-        f13 = tmp;
+#if (STREAMING_METHOD == SCRATCH_METHOD)
+inline int in_tile(const int l, const int size)
+{
+    return (l >= 0 && l < size);
+}
 
-        tmp = f17;
-        f17 = f11;
-        f11 = tmp;
-    }
 
+// One iteration of the cells of a tile in local memory, tile[(i * cells) + c]
+// holding the distribution i of the cell c = x + (sx * (y + (sy * z))) of a
+// sx x sy x sz tile. Each work item updates the n cells from lx, ly, lz to
+// lx, ly, lz + n - 1, of index id[k] and type cell_type[k] in the lattice:
+// all of them are collided before any is streamed, as the distributions are
+// pushed in place to the neighbours in the tile only. The walls keep the
+// ones streaming from them. The cells with store_macro[k] set store rho and
+// u at id[k]. Every work item of the group must call it, n <= Z_CELLS.
+inline void tile_step(__local real_t * restrict tile, const int cells, const int n,
+                      const int lx, const int ly, const int lz,
+                      const int sx, const int sy, const int sz,
+                      const int * restrict id, const int * restrict cell_type, const int * restrict store_macro,
+                      __global real_t * restrict density, __global real_t * restrict u)
+{
+    real_t post[Z_CELLS * Q];
 
-    /***   Collision   ***/
-    if (is_collision(cell_type)) {
-        const real_t fnew0  = (OMEGA_0  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                        + (OMEGA_0  * rho);
-        const real_t fnew1  = (OMEGA_1  * rho) * (ux * (3.0 * ux + 3.0) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                   + (OMEGA_1  * rho);
-        const real_t fnew2  = (OMEGA_2  * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))                  + (OMEGA_2  * rho);
-        const real_t fnew3  = (OMEGA_3  * rho) * (ux * (3.0 * ux - 3.0) - 1.5 * (uy * uy) - 1.5 * (uz * uz))                   + (OMEGA_3  * rho);
-        const real_t fnew4  = (OMEGA_4  * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))                  + (OMEGA_4  * rho);
-        const real_t fnew5  = (OMEGA_5  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))                  + (OMEGA_5  * rho);
-        const real_t fnew6  = (OMEGA_6  * rho) * (-1.5 * (ux * ux) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))                  + (OMEGA_6  * rho);
-        const real_t fnew7  = (OMEGA_7  * rho) * (ux * (3.0 * ux + 9.0 * uy + 3.0) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))  + (OMEGA_7  * rho);
-        const real_t fnew8  = (OMEGA_8  * rho) * (ux * (3.0 * ux - 9.0 * uy - 3.0) + uy * (3.0 * uy + 3.0) - 1.5 * (uz * uz))  + (OMEGA_8  * rho);
-        const real_t fnew9  = (OMEGA_9  * rho) * (ux * (3.0 * ux + 9.0 * uy - 3.0) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))  + (OMEGA_9  * rho);
-        const real_t fnew10 = (OMEGA_10 * rho) * (ux * (3.0 * ux - 9.0 * uy + 3.0) + uy * (3.0 * uy - 3.0) - 1.5 * (uz * uz))  + (OMEGA_10 * rho);
-        const real_t fnew11 = (OMEGA_11 * rho) * (ux * (3.0 * ux - 9.0 * uz + 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))  + (OMEGA_11 * rho);
-        const real_t fnew12 = (OMEGA_12 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 9.0 * uz + 3.0) + uz * (3.0 * uz - 3.0)) + (OMEGA_12 * rho);
-        const real_t fnew13 = (OMEGA_13 * rho) * (ux * (3.0 * ux + 9.0 * uz - 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz - 3.0))  + (OMEGA_13 * rho);
-        const real_t fnew14 = (OMEGA_14 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 9.0 * uz - 3.0) + uz * (3.0 * uz - 3.0)) + (OMEGA_14 * rho);
-        const real_t fnew15 = (OMEGA_15 * rho) * (ux * (3.0 * ux + 9.0 * uz + 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))  + (OMEGA_15 * rho);
-        const real_t fnew16 = (OMEGA_16 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy + 9.0 * uz + 3.0) + uz * (3.0 * uz + 3.0)) + (OMEGA_16 * rho);
-        const real_t fnew17 = (OMEGA_17 * rho) * (ux * (3.0 * ux - 9.0 * uz - 3.0) - 1.5 * (uy * uy) + uz * (3.0 * uz + 3.0))  + (OMEGA_17 * rho);
-        const real_t fnew18 = (OMEGA_18 * rho) * (-1.5 * (ux * ux) + uy * (3.0 * uy - 9.0 * uz - 3.0) + uz * (3.0 * uz + 3.0)) + (OMEGA_18 * rho);
-
-#undef  UNROLL_X
-#define UNROLL_X(i) f##i = compute_bgk(f##i, fnew##i);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int k = 0; k < n; ++k) {
+        const int lid = lx + (sx * (ly + (sy * (lz + k))));
+        real_t eu = 0.0;
+        real_t u2 = 0.0;
+#define tmp eu
+
+#undef  UNROLL_X
+#define UNROLL_X(i) real_t f##i = tile[(i * cells) + lid];
         UNROLL_19();
-    }
 
-    const int lx = get_local_id(0);
+        if (is_moving(cell_type[k])) {
+            f5  = F_S( 5);
+            f11 = F_S(11);
+            f12 = F_S(12);
+            f13 = F_S(13);
+            f14 = F_S(14);
+        }
 
-    bool alive = true;
-    if (is_wall(cell_type)) {
-        alive = false;
-    }
+        /***   Compute Macro quantities (rho & u)   ***/
+        const real_t rho = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
+
+        real_t ux = NAN;
+        real_t uy = NAN;
+        real_t uz = NAN;
+
+        if (is_moving(cell_type[k])) {
+            ux = INITIAL_VELOCITY_X;
+            uy = INITIAL_VELOCITY_Y;
+            uz = INITIAL_VELOCITY_Z;
+        } else {
+            ux = (( f1 +  f7 + f10 + f11 + f15) - ( f3 +  f8 +  f9 + f13 + f17)) / rho;
+            uy = (( f2 +  f7 +  f8 + f12 + f16) - ( f4 +  f9 + f10 + f14 + f18)) / rho;
+            uz = (( f6 + f15 + f16 + f17 + f18) - ( f5 + f11 + f12 + f13 + f14)) / rho;
+        }
 
-    bool propagation_only = false;
-    if (is_corner(cell_type)) {
-        propagation_only = true;
+        /***   Store macro quantities (rho & u)   ***/
+        if (store_macro[k] && is_store_macro(cell_type[k])) {
+            density[id[k]] = rho;
+            UX(id[k]) = ux;
+            UY(id[k]) = uy;
+            UZ(id[k]) = uz;
+        }
+
+        u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+        /***   Boundary Conditions   ***/
+        if (is_moving(cell_type[k])) {
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                  \
+            eu = (ux * E##i##_X) + (uy * E##i##_Y) + (uz * E##i##_Z);                \
+            f##i = (rho * OMEGA_##i) * (1.0 + (3.0 * eu) + (4.5 * eu * eu) - (1.5 * u2));
+            UNROLL_19();
+
+        } else if (is_bounceback(cell_type[k])) {
+
+#undef  UNROLL_X
+#define UNROLL_X(i)     \
+            tmp = f##i;     \
+            f##i = F_S(i);  \
+            F_S(i) = tmp;
+            UNROLL_HALF_19();
+        }
+
+
+        /***   Collision   ***/
+        if (is_collision(cell_type[k])) {
+            COLLIDE();
+        }
+
+#undef  UNROLL_X
+#define UNROLL_X(i) post[(k * Q) + i] = f##i;
+        UNROLL_19();
     }
 
-    __local real_t  _f1[LWS];
-    __local real_t  _f7[LWS];
-    __local real_t _f10[LWS];
-    __local real_t _f11[LWS];
-    __local real_t _f15[LWS];
-#define  _f3  _f1
-#define  _f8 _f10
-#define  _f9  _f7
-#define _f13 _f15
-#define _f17 _f11
-    _f1[lx] = -1.0;
+    /***   Streaming in the tile   ***/
     barrier(CLK_LOCAL_MEM_FENCE);
-    if (!propagation_only && alive)
-    {
-        // Update the 0-th direction distribution
-        f_stream[IDxyzq(id, 0)] = f0;                                                   //  0  0  0
-        // Propagation in directions orthogonal to the X axis (global memory)
-        if (y < (DIM-1)) f_stream[IDXYZQ(   x, y+1,   z,  2)] = f2;                     //  0 +1  0
-        if (y > 0      ) f_stream[IDXYZQ(   x, y-1,   z,  4)] = f4;                     //  0 -1  0
-        if (z < (DIM-1)) f_stream[IDXYZQ(   x,   y, z+1,  6)] = f6;                     //  0  0 +1
-        if (z > 0      ) f_stream[IDXYZQ(   x,   y, z-1,  5)] = f5;                     //  0  0 -1
-
-        if (y < (DIM-1) && z < (DIM-1)) f_stream[IDXYZQ(   x, y+1, z+1, 16)] = f16;     //  0 +1 +1
-        if (y > 0       && z < (DIM-1)) f_stream[IDXYZQ(   x, y-1, z+1, 18)] = f18;     //  0 -1 +1
-        if (y < (DIM-1) && z > 0      ) f_stream[IDXYZQ(   x, y+1, z-1, 12)] = f12;     //  0 +1 -1
-        if (y > 0       && z > 0      ) f_stream[IDXYZQ(   x, y-1, z-1, 14)] = f14;     //  0 -1 -1
-
-        // E propagation in shared memory
-        if (x < (DIM-1)) {
-            // Note: propagation to ghost nodes is done directly in global memory as there
-            // are no threads running for the ghost nodes.
-            if (lx < (LWS-1) && x != (DIM-2)) {
-                 _f1[lx + 1] =  f1;
-                 _f7[lx + 1] =  f7;
-                _f10[lx + 1] = f10;
-                _f11[lx + 1] = f11;
-                _f15[lx + 1] = f15;
-                // E propagation in global memory (at right block boundary)
-            } else {
-                                 f_stream[IDXYZQ( x+1,   y,   z,  1)] =  f1;            // +1  0  0
-                if (y < (DIM-1)) f_stream[IDXYZQ( x+1, y+1,   z,  7)] =  f7;            // +1 +1  0
-                if (y > 0      ) f_stream[IDXYZQ( x+1, y-1,   z, 10)] = f10;            // +1 -1  0
-                if (z < (DIM-1)) f_stream[IDXYZQ( x+1,   y, z+1, 15)] = f15;            // +1  0 +1
-                if (z > 0      ) f_stream[IDXYZQ( x+1,   y, z-1, 11)] = f11;            // +1  0 -1
+    for (int k = 0; k < n; ++k) {
+        if (!is_wall(cell_type[k])) {
+            const int lid = lx + (sx * (ly + (sy * (lz + k))));
+#undef  UNROLL_X
+#define UNROLL_X(i)                                                                                         \
+            if (in_tile(lx + E##i##_X, sx) && in_tile(ly + E##i##_Y, sy) && in_tile(lz + k + E##i##_Z, sz)) {  \
+                tile[(i * cells) + lid + E##i##_X + (sx * (E##i##_Y + (sy * E##i##_Z)))] = post[(k * Q) + i];  \
             }
+            UNROLL_19();
         }
     }
+}
 
-    barrier(CLK_LOCAL_MEM_FENCE);
-    // Save locally propagated distributions into global memory.
-    // The leftmost thread is not updated in this block.
-    if (lx > 0 && x < DIM && !propagation_only && alive)
-    {
-        if (_f1[lx] != -1.0) {
-                             f_stream[IDXYZQ( x,   y,   z,  1)] =  _f1[lx];             //  0  0  0
-            if (y < (DIM-1)) f_stream[IDXYZQ( x, y+1,   z,  7)] =  _f7[lx];             //  0 +1  0
-            if (y > 0      ) f_stream[IDXYZQ( x, y-1,   z, 10)] = _f10[lx];             //  0 -1  0
-            if (z < (DIM-1)) f_stream[IDXYZQ( x,   y, z+1, 15)] = _f15[lx];             //  0  0 +1
-            if (z > 0      ) f_stream[IDXYZQ( x,   y, z-1, 11)] = _f11[lx];             //  0  0 -1
+
+// Temporal blocking: each work group loads a tile into local memory, of
+// Z_CELLS cells along z for each work item, advances it BLOCK_STEPS
+// iterations with push streaming between the cells of the tile, and stores
+// only its interior, BLOCK_STEPS cells away from its faces: the distributions
+// of the outer cells miss the ones streaming from outside the tile, and the
+// cells they spoil grow by one at each step. The tiles of the work groups
+// overlap by 2 * BLOCK_STEPS cells along each axis, so the tiles must be
+// larger than that, and the range covers the lattice with their interiors.
+// The distributions are read and written once every BLOCK_STEPS iterations.
+//
+// The tiles are get_local_size(0) x get_local_size(1) x get_local_size(2) *
+// Z_CELLS cells: larger than the work group along z, so that their interiors
+// are most of their cells. tile holds Q real_t for each cell. rho and u are
+// stored by the last step, as the distributions of its streaming are.
+__kernel
+void compute_blocked(__global store_t * restrict f_stream,
+                     __global const store_t * restrict f_collide,
+                     __global real_t * restrict density,
+                     __global real_t * restrict u,
+                     __global const map_t * restrict map,
+                     const int update_macro,
+                     __local real_t * restrict tile)
+{
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int lz = get_local_id(2) * Z_CELLS;
+    const int sx = get_local_size(0);
+    const int sy = get_local_size(1);
+    const int sz = get_local_size(2) * Z_CELLS;
+    const int x = ((int)get_group_id(0) * (sx - (2 * BLOCK_STEPS))) + lx - BLOCK_STEPS;
+    const int y = ((int)get_group_id(1) * (sy - (2 * BLOCK_STEPS))) + ly - BLOCK_STEPS;
+    const int z_begin = ((int)get_group_id(2) * (sz - (2 * BLOCK_STEPS))) + lz - BLOCK_STEPS;
+
+    const int cells = sx * sy * sz;
+    const int interior_xy = (lx >= BLOCK_STEPS && lx < (sx - BLOCK_STEPS) &&
+                             ly >= BLOCK_STEPS && ly < (sy - BLOCK_STEPS));
+
+    // Every work item of the group takes part in the steps: the cells out of
+    // the lattice are walls, and read the cell 0. The distributions streaming
+    // from the walls are never written, in the tile as in the buffers, and
+    // keep the values read here.
+    int id[Z_CELLS];
+    int cell_type[Z_CELLS];
+    int interior[Z_CELLS];
+    int store_macro[Z_CELLS];
+    for (int k = 0; k < Z_CELLS; ++k) {
+        const int z = z_begin + k;
+        const int outside = (x < 0 || y < 0 || z < 0 || OUT_OF_LATTICE(x, y, z));
+        id[k] = (outside ? 0 : IDxyz(x, y, z));
+        cell_type[k] = (outside ? WALL : CELL_TYPE(map, id[k], x, y, z));
+        interior[k] = (interior_xy && !outside && (lz + k) >= BLOCK_STEPS && (lz + k) < (sz - BLOCK_STEPS));
+
+        const int lid = lx + (sx * (ly + (sy * (lz + k))));
+#undef  UNROLL_X
+#define UNROLL_X(i) tile[(i * cells) + lid] = LOAD_F(f_collide, IDxyzq(id[k], i), i);
+        UNROLL_19();
+    }
+
+    for (int step = 1; step <= BLOCK_STEPS; ++step) {
+        for (int k = 0; k < Z_CELLS; ++k) {
+            store_macro[k] = (update_macro && step == BLOCK_STEPS && interior[k]);
         }
+        tile_step(tile, cells, Z_CELLS, lx, ly, lz, sx, sy, sz, id, cell_type, store_macro, density, u);
     }
 
+    // The walls store the distributions streamed into them too, as push does
     barrier(CLK_LOCAL_MEM_FENCE);
-    // Refill the propagation buffer with sentinel values.
-    _f1[lx] = -1.0;
-    barrier(CLK_LOCAL_MEM_FENCE);
-    if (!propagation_only && alive)
-    {
-        // W propagation in shared memory
-        // Note: propagation to ghost nodes is done directly in global memory as there
-        // are no threads running for the ghost nodes.
-        if ((lx > 1 || (lx > 0 && x >= LWS)) && !propagation_only) {
-             _f3[lx - 1] = f3;
-             _f8[lx - 1] = f8;
-             _f9[lx - 1] = f9;
-            _f13[lx - 1] = f13;
-            _f17[lx - 1] = f17;
-            // W propagation in global memory (at left block boundary)
-        } else if (x > 0) {
-                             f_stream[IDXYZQ( x-1,   y,   z,  3)] =  f3;                // -1  0  0
-            if (y < (DIM-1)) f_stream[IDXYZQ( x-1, y+1,   z,  8)] =  f8;                // -1 +1  0
-            if (y > 0      ) f_stream[IDXYZQ( x-1, y-1,   z,  9)] =  f9;                // -1 -1  0
-            if (z < (DIM-1)) f_stream[IDXYZQ( x-1,   y, z+1, 17)] = f17;                // -1  0 +1
-            if (z > 0      ) f_stream[IDXYZQ( x-1,   y, z-1, 13)] = f13;                // -1  0 -1
+    for (int k = 0; k < Z_CELLS; ++k) {
+        if (interior[k]) {
+            const int lid = lx + (sx * (ly + (sy * (lz + k))));
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id[k], i), i, tile[(i * cells) + lid]);
+            UNROLL_19();
         }
     }
+}
+
+
+// Whole lattice in the local memory of a single work group of DIM_X x DIM_Y
+// x DIM_Z work items, one for each cell: the lattice is loaded once, advanced
+// steps iterations as the tiles of compute_blocked, and stored back. The
+// walls bound the lattice, so no cell misses the distributions streaming into
+// it, and small lattices run many iterations with a single launch.
+//
+// lattice holds Q real_t for each cell. rho and u are stored by the last step.
+__kernel
+void compute_local(__global store_t * restrict f_stream,
+                   __global const store_t * restrict f_collide,
+                   __global real_t * restrict density,
+                   __global real_t * restrict u,
+                   __global const map_t * restrict map,
+                   const int update_macro,
+                   __local real_t * restrict lattice,
+                   const int steps)
+{
+    const int x = get_local_id(0);
+    const int y = get_local_id(1);
+    const int z = get_local_id(2);
+    const int id = IDxyz(x, y, z);
+    const int cell_type = CELL_TYPE(map, id, x, y, z);
+    const int cells = DIM_X * DIM_Y * DIM_Z;
+
+#undef  UNROLL_X
+#define UNROLL_X(i) lattice[(i * cells) + id] = LOAD_F(f_collide, IDxyzq(id, i), i);
+    UNROLL_19();
+
+    for (int step = 1; step <= steps; ++step) {
+        const int store_macro = (update_macro && step == steps);
+        tile_step(lattice, cells, 1, x, y, z, DIM_X, DIM_Y, DIM_Z, &id, &cell_type, &store_macro, density, u);
+    }
 
     barrier(CLK_LOCAL_MEM_FENCE);
-    // The rightmost thread is not updated in this block.
-    if (lx < (LWS-1) && x < (DIM-1) && !propagation_only && alive)
-    {
-        if (_f1[lx] != -1.0) {
-                             f_stream[IDXYZQ( x,   y,   z,  3)] =  _f3[lx];             //  0  0  0
-            if (y < (DIM-1)) f_stream[IDXYZQ( x, y+1,   z,  8)] =  _f8[lx];             //  0 +1  0
-            if (y > 0      ) f_stream[IDXYZQ( x, y-1,   z,  9)] =  _f9[lx];             //  0 -1  0
-            if (z < (DIM-1)) f_stream[IDXYZQ( x,   y, z+1, 17)] = _f17[lx];             //  0  0 +1
-            if (z > 0      ) f_stream[IDXYZQ( x,   y, z-1, 13)] = _f13[lx];             //  0  0 -1
+#undef  UNROLL_X
+#define UNROLL_X(i) STORE_F(f_stream, IDxyzq(id, i), i, lattice[(i * cells) + id]);
+    UNROLL_19();
+}
+#endif
+#endif
+
+
+// In situ diagnostics of the macro quantities, reduced in two stages. The
+// kernels read rho and u of the last iteration that stored them.
+//
+// diagnostics:         each work group reduces its cells into partials,
+//                      DIAGNOSTICS values for each work group.
+// residual:            same as diagnostics, for the change of u since the
+//                      previous call, see RESIDUAL_DU2 in common.h.
+// reduce_diagnostics:  a single work group reduces the partials into result.
+//
+// The second dimension of the range selects the member of an ENSEMBLE, whose
+// partials and result follow the ones of the previous members. All need a
+// power of 2 work group size and DIAGNOSTICS values of local memory for each
+// work item. See computeDiagnostics() for the host version.
+inline void reduce_local(__local real_t * restrict scratch, const int lid, const int lsize)
+{
+    for (int s = lsize / 2; s > 0; s >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < s) {
+            scratch[DIAG_MASS * lsize + lid]           += scratch[DIAG_MASS * lsize + lid + s];
+            scratch[DIAG_KINETIC_ENERGY * lsize + lid] += scratch[DIAG_KINETIC_ENERGY * lsize + lid + s];
+            scratch[DIAG_MAX_VELOCITY * lsize + lid]    = fmax(scratch[DIAG_MAX_VELOCITY * lsize + lid], scratch[DIAG_MAX_VELOCITY * lsize + lid + s]);
+            scratch[DIAG_ENSTROPHY * lsize + lid]      += scratch[DIAG_ENSTROPHY * lsize + lid + s];
         }
     }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+
+__kernel
+void diagnostics(__global const real_t * restrict density,
+                 __global const real_t * restrict u,
+                 __global const map_t * restrict map,
+                 __global real_t * restrict partials,
+                 __local real_t * restrict scratch)
+{
+    const int id = get_global_id(0);
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+
+    real_t mass = 0.0;
+    real_t energy = 0.0;
+    real_t max_u = 0.0;
+    real_t enstrophy = 0.0;
+
+    const int member = get_global_id(1);
+    density += member * CELLS;
+    u += member * CELLS * D;
+
+    if (id < CELLS && is_store_macro(map[id])) {
+        const real_t ux = UX(id);
+        const real_t uy = UY(id);
+        const real_t uz = UZ(id);
+        const real_t u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+        // The velocity of the moving walls is imposed, not part of the flow
+        mass = density[id];
+        if (!is_moving(map[id])) {
+            energy = 0.5 * density[id] * u2;
+            max_u = sqrt(u2);
+        }
+
+        if (is_store_macro(map[id - 1])     && is_store_macro(map[id + 1])     &&
+            is_store_macro(map[id - DIM_X]) && is_store_macro(map[id + DIM_X]) &&
+            is_store_macro(map[id - PLANE]) && is_store_macro(map[id + PLANE]))
+        {
+            const real_t duy_dx = 0.5 * (UY(id + 1)     - UY(id - 1));
+            const real_t duz_dx = 0.5 * (UZ(id + 1)     - UZ(id - 1));
+            const real_t dux_dy = 0.5 * (UX(id + DIM_X) - UX(id - DIM_X));
+            const real_t duz_dy = 0.5 * (UZ(id + DIM_X) - UZ(id - DIM_X));
+            const real_t dux_dz = 0.5 * (UX(id + PLANE) - UX(id - PLANE));
+            const real_t duy_dz = 0.5 * (UY(id + PLANE) - UY(id - PLANE));
+
+            const real_t wx = duz_dy - duy_dz;
+            const real_t wy = dux_dz - duz_dx;
+            const real_t wz = duy_dx - dux_dy;
+            enstrophy = 0.5 * ((wx * wx) + (wy * wy) + (wz * wz));
+        }
+    }
+
+    scratch[DIAG_MASS * lsize + lid]           = mass;
+    scratch[DIAG_KINETIC_ENERGY * lsize + lid] = energy;
+    scratch[DIAG_MAX_VELOCITY * lsize + lid]   = max_u;
+    scratch[DIAG_ENSTROPHY * lsize + lid]      = enstrophy;
+    reduce_local(scratch, lid, lsize);
+
+    if (lid < DIAGNOSTICS) {
+        partials[(member * get_num_groups(0) + get_group_id(0)) * DIAGNOSTICS + lid] = scratch[lid * lsize];
+    }
+}
+
+
+__kernel
+void residual(__global const real_t * restrict u,
+              __global real_t * restrict u_prev,
+              __global const map_t * restrict map,
+              __global real_t * restrict partials,
+              __local real_t * restrict scratch)
+{
+    const int id = get_global_id(0);
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+
+    real_t du2 = 0.0;
+    real_t u2 = 0.0;
+
+    const int member = get_global_id(1);
+    u += member * CELLS * D;
+    u_prev += member * CELLS * D;
+
+    if (id < CELLS && is_store_macro(map[id])) {
+        const real_t ux = UX(id);
+        const real_t uy = UY(id);
+        const real_t uz = UZ(id);
+        const real_t dux = ux - u_prev[0 * CELLS + id];
+        const real_t duy = uy - u_prev[1 * CELLS + id];
+        const real_t duz = uz - u_prev[2 * CELLS + id];
+
+        du2 = (dux * dux) + (duy * duy) + (duz * duz);
+        u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+        u_prev[0 * CELLS + id] = ux;
+        u_prev[1 * CELLS + id] = uy;
+        u_prev[2 * CELLS + id] = uz;
+    }
+
+    scratch[RESIDUAL_DU2 * lsize + lid]    = du2;
+    scratch[RESIDUAL_U2 * lsize + lid]     = u2;
+    scratch[RESIDUAL_MAX_DU * lsize + lid] = sqrt(du2);
+    scratch[DIAG_ENSTROPHY * lsize + lid]  = 0.0;
+    reduce_local(scratch, lid, lsize);
+
+    if (lid < DIAGNOSTICS) {
+        partials[(member * get_num_groups(0) + get_group_id(0)) * DIAGNOSTICS + lid] = scratch[lid * lsize];
+    }
+}
+
+
+__kernel
+void reduce_diagnostics(__global const real_t * restrict partials,
+                        const int groups,
+                        __global real_t * restrict result,
+                        __local real_t * restrict scratch)
+{
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+
+    real_t mass = 0.0;
+    real_t energy = 0.0;
+    real_t max_u = 0.0;
+    real_t enstrophy = 0.0;
+
+    partials += get_global_id(1) * groups * DIAGNOSTICS;
+    result += get_global_id(1) * DIAGNOSTICS;
+
+    for (int g = lid; g < groups; g += lsize) {
+        mass      += partials[g * DIAGNOSTICS + DIAG_MASS];
+        energy    += partials[g * DIAGNOSTICS + DIAG_KINETIC_ENERGY];
+        max_u      = fmax(max_u, partials[g * DIAGNOSTICS + DIAG_MAX_VELOCITY]);
+        enstrophy += partials[g * DIAGNOSTICS + DIAG_ENSTROPHY];
+    }
+
+    scratch[DIAG_MASS * lsize + lid]           = mass;
+    scratch[DIAG_KINETIC_ENERGY * lsize + lid] = energy;
+    scratch[DIAG_MAX_VELOCITY * lsize + lid]   = max_u;
+    scratch[DIAG_ENSTROPHY * lsize + lid]      = enstrophy;
+    reduce_local(scratch, lid, lsize);
+
+    if (lid < DIAGNOSTICS) {
+        result[lid] = scratch[lid * lsize];
+    }
 }
-#endif
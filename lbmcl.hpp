@@ -1,34 +1,72 @@
 #pragma once
 
+#include <map>
+#include <deque>
+#include <atomic>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 #include <utility>
 #include <sstream>
+#include <algorithm>
+#include <functional>
 #include <type_traits>
 
 #include "common.h"
 #include "CLUtil.hpp"
+#include "timing_stats.hpp"
+#include "lbm_output.hpp"
+#include "lbm_checkpoint.hpp"
+#include "lbm_autotune.hpp"
+#include "lbm_options.hpp"
+#include "lbm_sparse.hpp"
+#include "lbm_diagnostics.hpp"
+#include "lbm_numa.hpp"
 
 
-#define DIGITS(val)         (((val) > 0) ? (size_t)log10((double)(val)) + 1 : 1)
+// Maximum number of profiled commands waiting to be retired. When exceeded,
+// the host waits for the oldest one before enqueuing more work.
+#define MAX_PENDING_EVENTS  256
 
-#define DUMP_PRECISION      6
-#define VTK_PRECISION       16
-
-
-#define IDxyzqDIM(id, q, dim, stride)   (((id) / (stride)) * (dim) + q) * (stride) + ((id) & ((stride) - 1))
-#define IDxyzDIM(x, y, z, dim)          ((x) + ((y) * (dim)) + ((z) * (dim) * (dim)))
-#define IDuxDIM(id, dim)                (0 * dim * dim * dim + id)
-#define IDuyDIM(id, dim)                (1 * dim * dim * dim + id)
-#define IDuzDIM(id, dim)                (2 * dim * dim * dim + id)
+// Compute iterations run by the autotuner for each configuration, before and
+// while measuring its time.
+#define AUTOTUNE_WARMUP_ITERATIONS  2
+#define AUTOTUNE_ITERATIONS         10
 
 
 #define INITIALIZE_KERNEL_NAME  "initialize"
 #define COMPUTE_KERNEL_NAME     "compute"
+#define COMPUTE_AA_KERNEL_NAME  "compute_aa"
+#define INITIALIZE_MAP_KERNEL_NAME      "initialize_map"
+#define INITIALIZE_SPARSE_KERNEL_NAME   "initialize_sparse"
+#define COMPUTE_SPARSE_KERNEL_NAME      "compute_sparse"
+#define COMPUTE_ZMARCH_KERNEL_NAME      "compute_zmarch"
+#define COMPUTE_BLOCKED_KERNEL_NAME     "compute_blocked"
+#define COMPUTE_LOCAL_KERNEL_NAME       "compute_local"
+#define COMPUTE_INTERIOR_KERNEL_NAME    "compute_interior"
+#define COMPUTE_SHELL_NAME              "compute_shell"
+#define DIAGNOSTICS_KERNEL_NAME         "diagnostics"
+#define REDUCE_DIAGNOSTICS_KERNEL_NAME  "reduce_diagnostics"
+#define RESIDUAL_KERNEL_NAME            "residual"
 #define READ_MAP_NAME           "read_map"
 #define READ_F_NAME             "read_f"
 #define READ_RHO_NAME           "read_rho"
 #define READ_U_NAME             "read_u"
+#define READ_CHECKPOINT_NAME    "read_checkpoint"
+#define WRITE_CHECKPOINT_NAME   "write_checkpoint"
+#define READ_DIAGNOSTICS_NAME   "read_diagnostics"
+#define READ_RESIDUAL_NAME      "read_residual"
+
+// Largest work group size of the diagnostics reductions.
+#define DIAGNOSTICS_LWS         256
+
+// Output slot backed by a pinned host buffer, receiving a device to host
+// transfer. The job is handed to the writers once the transfer completes.
+struct pinned_slot : output_slot {
+    cl::Buffer pinned;
+};
+
 
 template <typename T>
 class LBMCL
@@ -36,19 +74,51 @@ class LBMCL
     static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value,
                   "Only float or double data type is valid.");
 private:
-    size_t dim;
+    size_t nx;
+    size_t ny;
+    size_t nz;
     T viscosity;
     T velocity;
     size_t iterations;
     size_t every;
     std::string vtk_path;
     cl::NDRange lws;
-    cl::NDRange gws;
     size_t stride;
     bool optimize;
     std::string dump_path;
     bool dump_map;
     bool dump_f;
+    size_t profile_every;
+    size_t writer_threads;
+
+    vtk_format vtk_fmt = VTK_ASCII;
+    bool vtk_float32 = false;
+    size_t checkpoint_every = 0;
+    std::string restart_file;
+    size_t start_iteration = 0;
+    bool autotune = false;
+    bool use_autotune_cache = false;
+    std::string autotune_cache = AUTOTUNE_CACHE_FILE;
+    std::string kernel_cache = KERNEL_CACHE_DIR;
+    lbm_streaming streaming = STREAMING_PUSH;
+    lbm_storage storage = STORAGE_REAL;
+    lbm_collision collision = COLLISION_BGK;
+    bool procedural_geometry = false;
+    bool sparse = false;
+    size_t z_cells = 1;
+    size_t block_steps = 1;
+    size_t blocked_iterations = 0;  // computed by the blocked kernel
+    bool local_lattice = false;
+    bool interior_split = false;
+    bool pin_threads = false;
+    bool pinned = false;
+    bool host_ptr = false;      // CPU devices: lattice buffers in host_buffers
+    size_t diagnostics_every = 0;
+    double tolerance = 0.0;
+    size_t residual_every = 100;
+    size_t converged_iteration = 0;  // 0 until the residual gets below tolerance
+    bool has_reference = false;      // true once a check stored the velocity of an iteration
+    std::vector<ensemble_member> ensemble;  // empty for a single lattice
 
     bool dump_data = false;
 
@@ -58,35 +128,92 @@ private:
     cl::CommandQueue queue;
     cl::Program program;
 
+    // Host memory of the lattice buffers on CPU devices, released after them
+    std::deque<host_memory> host_buffers;
+
     cl::Buffer f_stream;
-    cl::Buffer f_collide;
+    cl::Buffer f_collide;   // not allocated with in place (AA) streaming
     cl::Buffer rho;
     cl::Buffer u;
     cl::Buffer map;
+    cl::Buffer cells;       // sparse lattice only
+    cl::Buffer neighbours;  // sparse lattice only
+    cl::Buffer params;      // ensemble only
 
-    int * map_values = nullptr;
-    T * f_values = nullptr;
-    T * rho_values = nullptr;
-    T * u_values = nullptr;
+    sparse_lattice sparse_cells;
+    cl::NDRange sparse_gws;
+    cl::NDRange sparse_lws;
 
-    cl::Kernel initialize_kernel;
-    std::vector<cl::Kernel> compute_kernels;
-    std::vector< std::pair<std::string, cl::Event> > events;
+    map_t * map_values = nullptr;
 
-    inline size_t f_dim()   const { return (dim * dim * dim * Q); }
-    inline size_t u_dim()   const { return (dim * dim * dim * D); }
-    inline size_t rho_dim() const { return (dim * dim * dim); }
-    inline size_t map_dim() const { return (dim * dim * dim); }
-    inline size_t wet_dim() const { return (dim - 2) * (dim - 2) * (dim - 2); }
+    std::unique_ptr<writer_pool> writers;
+    pinned_slot data_slots[OUTPUT_SLOTS];
+    pinned_slot f_slots[OUTPUT_SLOTS];
+    size_t next_data_slot = 0;
+    size_t next_f_slot = 0;
 
-    inline size_t f_size()   const { return f_dim()   * sizeof(T);  }
+    cl::Kernel initialize_kernel;
+    cl::Kernel compute_kernels[2][2]; // [is_swap][is_store_data]
+    cl::Kernel blocked_kernels[2][2]; // [is_swap][is_store_data], block_steps > 1 only
+    cl::Kernel local_kernels[2][2];   // [is_swap][is_store_data], local_lattice only
+    cl::Kernel interior_kernels[2][2];  // [is_swap][is_store_data], interior_split only
+
+    // Box of the shell around the interior, updated by the compute kernel
+    struct shell_box {
+        cl::NDRange offset;
+        cl::NDRange size;
+    };
+    std::vector<shell_box> shell_boxes;
+
+    // Diagnostics of an iteration, read back from the device, DIAGNOSTICS
+    // values for each member of the ensemble
+    struct diagnostics_read {
+        size_t iteration;
+        std::vector<T> values;
+        cl::Event event;
+    };
+
+    cl::Kernel diagnostics_kernel;
+    cl::Kernel reduce_diagnostics_kernel;
+    cl::Kernel residual_kernel;
+    cl::Buffer u_prev;      // velocity at the previous residual check
+    cl::Buffer diagnostics_partials;
+    cl::Buffer diagnostics_result;
+    size_t diagnostics_groups = 0;
+    size_t diagnostics_lws = 0;
+    std::deque<diagnostics_read> diagnostics_reads;
+    std::vector<diagnostics_log> diagnostics_out;    // one for each member
+    std::deque< std::pair<std::string, cl::Event> > events;
+    std::map<std::string, timing_stats> timings;
+    cl_ulong first_start = std::numeric_limits<cl_ulong>::max();
+    cl_ulong last_end = 0;
+
+    // The members of an ensemble have their own distributions, rho and u,
+    // one after the other, and share the map.
+    inline size_t members()   const { return (ensemble.empty() ? 1 : ensemble.size()); }
+    inline size_t cells_dim() const { return (nx * ny * nz); }
+    inline size_t f_dim()   const { return (sparse ? sparse_cells.padded_cells : paddedCells(cells_dim(), stride)) * Q * members(); }
+    inline size_t u_dim()   const { return (cells_dim() * D * members()); }
+    inline size_t rho_dim() const { return cells_dim() * members(); }
+    inline size_t map_dim() const { return cells_dim(); }
+    inline size_t wet_dim() const { return (nx - 2) * (ny - 2) * (nz - 2) * members(); }
+
+    inline size_t f_size()   const { return f_dim()   * storageBytes(storage, sizeof(T)); }
     inline size_t u_size()   const { return u_dim()   * sizeof(T);  }
     inline size_t rho_size() const { return rho_dim() * sizeof(T);  }
-    inline size_t map_size() const { return map_dim() * sizeof(int);}
+    inline size_t map_size() const { return map_dim() * sizeof(map_t);}
+
+    inline size_t sparse_size() const
+    {
+        return (sparse_cells.cells.size() + sparse_cells.neighbours.size()) * sizeof(cl_int);
+    }
+
+    // Number of lattice copies of the distributions on the device
+    inline size_t f_buffers() const { return (streaming == STREAMING_AA ? 1 : 2); }
 
     inline size_t device_memory_size_b() const
     {
-        return f_size() * 2 + u_size() + rho_size() + map_size();
+        return f_size() * f_buffers() + u_size() + rho_size() + map_size() + sparse_size();
     }
 
 
@@ -128,214 +255,1106 @@ private:
         return (x >> 1);
     }
 
-    std::string kernelOptionsStr()
-    {
-        std::stringstream optionsBuilder;
-        optionsBuilder << "-Werror ";
-        optionsBuilder << "-I. ";
-        optionsBuilder << "-DDIM=" << dim << " ";
-        optionsBuilder << "-DLWS=" << lws[0] << " ";
-        optionsBuilder << "-DSTRIDE_DIV=" << log2i(stride) << " ";
-        optionsBuilder << "-DSTRIDE_MOD=" << (stride - 1) << " ";
-        optionsBuilder << "-DVISCOSITY=" << viscosity << " ";
-        optionsBuilder << "-DVELOCITY=" << velocity << " ";
+    // Keeps track of a profiled command. Commands already completed are
+    // retired into the timing statistics, so that only a bounded number of
+    // events is kept alive during the simulation.
+    void recordEvent(const std::string & name, const cl::Event & event)
+    {
+        events.emplace_back(name, event);
+        retireEvents(events.size() > MAX_PENDING_EVENTS);
+    }
+
+
+    // Moves the profiling information of completed commands into the timing
+    // statistics. If wait is true, it waits for the oldest pending command
+    // and retires all the commands completed after it.
+    void retireEvents(bool wait)
+    {
+        try {
+            while (!events.empty()) {
+                const cl::Event & event = events.front().second;
+
+                if (wait) {
+                    event.wait();
+                    wait = false;
+                } else if (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+                    break;
+                }
+
+                const cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                const cl_ulong end   = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+                timings[events.front().first].add((end - start) / 1000000.0);
+                first_start = std::min(first_start, start);
+                last_end    = std::max(last_end, end);
+
+                events.pop_front();
+            }
+        } catch (cl::Error err) {
+            CLUErrorPrintExit(err);
+        }
+    }
+
+
+    // Retires all the pending commands, waiting for their completion.
+    void retireAllEvents()
+    {
+        while (!events.empty()) {
+            retireEvents(true);
+        }
+    }
+
+
+    // Allocates a pinned host buffer of the given size and maps it once for
+    // the whole simulation.
+    void createSlot(pinned_slot & slot, size_t size)
+    {
+        cl_int err;
+        slot.pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &err);
+        CLUCheckErrorExit(err, "cl::Buffer(pinned)");
+
+        slot.host_ptr = queue.enqueueMapBuffer(slot.pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, nullptr, nullptr, &err);
+        CLUCheckErrorExit(err, "enqueueMapBuffer(pinned)");
+
+        slot.writers = writers.get();
+    }
+
+
+    void releaseSlot(pinned_slot & slot)
+    {
+        if (slot.host_ptr != nullptr) {
+            queue.enqueueUnmapMemObject(slot.pinned, slot.host_ptr);
+            slot.host_ptr = nullptr;
+        }
+    }
+
+
+    // Returns the next slot of the ring, waiting for the writers if it is
+    // still in use. Pending commands are flushed first, so that the device
+    // keeps working and the transfers feeding the writers can complete.
+    pinned_slot & acquireSlot(pinned_slot * slots, size_t & next)
+    {
+        pinned_slot & slot = slots[next];
+        next = (next + 1) % OUTPUT_SLOTS;
+
+        if (slot.busy.load(std::memory_order_acquire)) {
+            queue.flush();
+        }
+        slot.acquire();
+        return slot;
+    }
+
+
+    // Called by the OpenCL runtime once the transfer into a slot completes.
+    static void CL_CALLBACK onTransferComplete(cl_event, cl_int status, void * user_data)
+    {
+        pinned_slot * slot = static_cast<pinned_slot *>(user_data);
+
+        if (status != CL_COMPLETE) {
+            CLUCheckError(status, "transfer to output slot");
+            slot->busy.store(false, std::memory_order_release);
+            return;
+        }
+
+        slot->submit();
+    }
+
+
+    // Number of iterations actually computed by this run.
+    inline size_t computed_iterations() const
+    {
+        return (converged_iteration != 0 ? converged_iteration : iterations) - start_iteration;
+    }
+
+
+    // Buffers saved in checkpoints, in the order they are stored.
+    std::vector< std::pair<cl::Buffer *, size_t> > checkpointBuffers()
+    {
+        if (streaming == STREAMING_AA) {
+            return {
+                {&f_stream,  f_size()},
+                {&rho,       rho_size()},
+                {&u,         u_size()},
+                {&map,       map_size()}
+            };
+        }
+        return {
+            {&f_stream,  f_size()},
+            {&f_collide, f_size()},
+            {&rho,       rho_size()},
+            {&u,         u_size()},
+            {&map,       map_size()}
+        };
+    }
+
+
+    // Reads the whole lattice state from the device and stores it in a
+    // binary checkpoint file.
+    void storeCheckpoint(size_t iteration)
+    {
+        std::vector< std::pair<cl::Buffer *, size_t> > buffers = checkpointBuffers();
+        std::vector< std::vector<char> > contents(buffers.size());
+        std::vector< std::pair<const void *, size_t> > sections;
+
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            contents[i].resize(buffers[i].second);
+
+            cl::Event read_evt;
+            CLUCheckErrorExit(
+                queue.enqueueReadBuffer(*buffers[i].first, CL_TRUE, 0, buffers[i].second, contents[i].data(), nullptr, &read_evt),
+                READ_CHECKPOINT_NAME
+            );
+            recordEvent(READ_CHECKPOINT_NAME, read_evt);
+            sections.emplace_back(contents[i].data(), contents[i].size());
+        }
+
+        checkpoint_header header;
+        header.real_size = sizeof(T);
+        header.nx = nx;
+        header.ny = ny;
+        header.nz = nz;
+        header.stride = stride;
+        header.iteration = iteration;
+        header.layout = lbmLayout(streaming, storage, sparse);
+
+        std::stringstream filenameBuilder;
+        filenameBuilder << dump_path << "/lbmcl." << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".ckp";
+        writeCheckpoint(filenameBuilder.str(), header, sections);
+    }
+
+
+    // Restores the whole lattice state from a checkpoint file, mapped in
+    // memory and copied straight to the device buffers.
+    void loadCheckpoint(const std::string & filename)
+    {
+        checkpoint_file checkpoint(filename);
+        std::vector< std::pair<cl::Buffer *, size_t> > buffers = checkpointBuffers();
+
+        std::vector<size_t> sizes;
+        for (const std::pair<cl::Buffer *, size_t> & b : buffers) sizes.push_back(b.second);
+        checkpoint.validate(sizeof(T), nx, ny, nz, stride, lbmLayout(streaming, storage, sparse), iterations, sizes);
+
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            cl::Event write_evt;
+            CLUCheckErrorExit(
+                queue.enqueueWriteBuffer(*buffers[i].first, CL_TRUE, 0, buffers[i].second, checkpoint.section(i), nullptr, &write_evt),
+                WRITE_CHECKPOINT_NAME
+            );
+            recordEvent(WRITE_CHECKPOINT_NAME, write_evt);
+        }
+
+        start_iteration = checkpoint.header().iteration;
+    }
+
+
+    std::string vtkFormatStr() const
+    {
+        switch (vtk_fmt) {
+            case VTK_BINARY: return "binary";
+            case VTK_ZLIB:   return "zlib";
+            default:         return "ascii";
+        }
+    }
+
+
+    std::string kernelOptionsStr()
+    {
+        return kernelOptionsStr(lws[0], stride);
+    }
+
+
+    std::string kernelOptionsStr(size_t lwx, size_t stride)
+    {
+        std::stringstream optionsBuilder;
+        optionsBuilder << "-Werror ";
+        optionsBuilder << "-I. ";
+        optionsBuilder << "-DDIM_X=" << nx << " ";
+        optionsBuilder << "-DDIM_Y=" << ny << " ";
+        optionsBuilder << "-DDIM_Z=" << nz << " ";
+        optionsBuilder << "-DLWS=" << lwx << " ";
+        optionsBuilder << "-DSTRIDE_DIV=" << log2i(stride) << " ";
+        optionsBuilder << "-DSTRIDE_MOD=" << (stride - 1) << " ";
+        optionsBuilder << "-DVISCOSITY=" << viscosity << " ";
+        optionsBuilder << "-DVELOCITY=" << velocity << " ";
+        optionsBuilder << kernelVariantStr();
+        return optionsBuilder.str();
+    }
+
+
+    // Build options selecting the code of the kernels, without the lattice
+    // size, the physical parameters and the launch configuration: part of the
+    // key of the autotune cache, so that a parameter sweep reuses its entries
+    std::string kernelVariantStr()
+    {
+        std::stringstream optionsBuilder;
+
+        if (streaming == STREAMING_PULL) {
+            optionsBuilder << "-DSTREAMING_METHOD=PULL_METHOD ";
+        } else if (streaming == STREAMING_SAILFISH) {
+            optionsBuilder << "-DSTREAMING_METHOD=SAILFISH_METHOD ";
+        }
+
+        if (procedural_geometry) {
+            optionsBuilder << "-DPROCEDURAL_GEOMETRY ";
+        }
+
+        if (z_cells > 1) {
+            optionsBuilder << "-DZ_CELLS=" << z_cells << " ";
+        }
+
+        if (block_steps > 1) {
+            optionsBuilder << "-DBLOCK_STEPS=" << block_steps << " ";
+        }
+
+        if (members() > 1) {
+            optionsBuilder << "-DENSEMBLE=" << members() << " ";
+        }
+
+        switch (collision) {
+            case COLLISION_TRT: optionsBuilder << "-DCOLLISION=TRT_COLLISION "; break;
+            case COLLISION_MRT: optionsBuilder << "-DCOLLISION=MRT_COLLISION "; break;
+            default: break;
+        }
+
+        switch (storage) {
+            case STORAGE_FP32: optionsBuilder << "-DSTORAGE_FP32 "; break;
+            case STORAGE_FP16: optionsBuilder << "-DSTORAGE_FP16 "; break;
+            case STORAGE_BF16: optionsBuilder << "-DSTORAGE_BF16 "; break;
+            default: break;
+        }
+
+        if (std::is_same<T, float>::value) {
+            optionsBuilder << "-DFP_SINGLE ";
+            optionsBuilder << "-cl-single-precision-constant ";
+        } else {
+            optionsBuilder << "-DFP_DOUBLE ";
+        }
+
+        if (optimize) {
+            optionsBuilder << "-cl-fast-relaxed-math ";
+        }
+
+        return optionsBuilder.str();
+    }
+
+
+    std::string autotuneKeyStr()
+    {
+        const std::string prec = (std::is_same<T, float>::value ? "single" : "double");
+        return autotuneKey(device.getInfo<CL_DEVICE_NAME>(), device.getInfo<CL_DRIVER_VERSION>(), nx, ny, nz, prec,
+                           lbmStreamingStr(streaming), kernelVariantStr());
+    }
+
+
+    const char * initializeKernelName() const
+    {
+        return (sparse ? INITIALIZE_SPARSE_KERNEL_NAME : INITIALIZE_KERNEL_NAME);
+    }
+
+
+    const char * computeKernelName() const
+    {
+        if (sparse) return COMPUTE_SPARSE_KERNEL_NAME;
+        if (z_cells > 1) return COMPUTE_ZMARCH_KERNEL_NAME;
+        return (streaming == STREAMING_AA ? COMPUTE_AA_KERNEL_NAME : COMPUTE_KERNEL_NAME);
+    }
+
+
+    // Range covering the whole lattice with work groups of the given size,
+    // each work item updating z_cells cells along z. Its sizes are rounded up
+    // to multiples of the work group size, the kernels skip the work items
+    // past the lattice. The lattices of an ensemble are stacked along z.
+    cl::NDRange latticeRange(const cl::NDRange & local, size_t z_cells = 1) const
+    {
+        const size_t columns_z = ((nz + z_cells - 1) / z_cells) * members();
+        return cl::NDRange(((nx + local[0] - 1) / local[0]) * local[0],
+                           ((ny + local[1] - 1) / local[1]) * local[1],
+                           ((columns_z + local[2] - 1) / local[2]) * local[2]);
+    }
+
+
+    // Launch ranges of the initialize and compute kernels: the whole lattice,
+    // or one work item for each cell of the sparse lattice. The z-marching
+    // compute kernel covers z_cells cells along z with each work item.
+    inline cl::NDRange globalRange()  const { return (sparse ? sparse_gws : latticeRange(lws)); }
+    inline cl::NDRange computeRange() const { return (sparse ? sparse_gws : latticeRange(lws, z_cells)); }
+    inline cl::NDRange localRange()   const { return (sparse ? sparse_lws : lws); }
+
+
+    // Range of the blocked compute kernel: one work group for each tile,
+    // whose interiors of tile - 2 * block_steps cells along each axis cover
+    // the lattice. See compute_blocked in kernels.cl.
+    cl::NDRange blockedRange() const
+    {
+        const size_t sizes[3] = {nx, ny, nz};
+        size_t range[3];
+        for (int d = 0; d < 3; ++d) {
+            const size_t interior = tile_cells(d) - (2 * block_steps);
+            range[d] = ((sizes[d] + interior - 1) / interior) * lws[d];
+        }
+        return cl::NDRange(range[0], range[1], range[2]);
+    }
+
+
+    // Range of the interior compute kernel, from the global offset 2, 2, 2
+    // to 2 cells away from the faces, rounded up to the work group size.
+    // See compute_interior in kernels.cl.
+    cl::NDRange interiorRange() const
+    {
+        return cl::NDRange(((nx - 4 + lws[0] - 1) / lws[0]) * lws[0],
+                           ((ny - 4 + lws[1] - 1) / lws[1]) * lws[1],
+                           ((nz - 4 + lws[2] - 1) / lws[2]) * lws[2]);
+    }
+
+
+    // The shell around the interior, 2 cells thick, as six boxes that do not
+    // overlap: the planes along z, the rows along y between them, and the
+    // columns along x between those. The compute kernel is launched on each
+    // box with its exact size, leaving the work group size to the runtime.
+    void setupShell()
+    {
+        shell_boxes = {
+            {cl::NDRange(0,      0,      0),      cl::NDRange(nx, ny,     2)},
+            {cl::NDRange(0,      0,      nz - 2), cl::NDRange(nx, ny,     2)},
+            {cl::NDRange(0,      0,      2),      cl::NDRange(nx, 2,      nz - 4)},
+            {cl::NDRange(0,      ny - 2, 2),      cl::NDRange(nx, 2,      nz - 4)},
+            {cl::NDRange(0,      2,      2),      cl::NDRange(2,  ny - 4, nz - 4)},
+            {cl::NDRange(nx - 2, 2,      2),      cl::NDRange(2,  ny - 4, nz - 4)}
+        };
+    }
+
+
+    // Enqueues an iteration as the interior kernel on the interior and the
+    // compute kernel on each box of the shell. All of them are profiled, or
+    // none.
+    void enqueueSplitIteration(bool is_swap, bool is_update_macro, bool is_profiled)
+    {
+        cl::Event interior_evt;
+        CLUCheckErrorExit(
+            queue.enqueueNDRangeKernel(interior_kernels[is_swap][is_update_macro], cl::NDRange(2, 2, 2), interiorRange(), lws, nullptr, (is_profiled ? &interior_evt : nullptr)),
+            COMPUTE_INTERIOR_KERNEL_NAME
+        );
+        if (is_profiled) recordEvent(COMPUTE_INTERIOR_KERNEL_NAME, interior_evt);
+
+        for (const shell_box & box : shell_boxes) {
+            cl::Event shell_evt;
+            CLUCheckErrorExit(
+                queue.enqueueNDRangeKernel(compute_kernels[is_swap][is_update_macro], box.offset, box.size, cl::NullRange, nullptr, (is_profiled ? &shell_evt : nullptr)),
+                COMPUTE_SHELL_NAME
+            );
+            if (is_profiled) recordEvent(COMPUTE_SHELL_NAME, shell_evt);
+        }
+    }
+
+
+    // Range of the local lattice compute kernel: a single work group of one
+    // work item for each cell. See compute_local in kernels.cl.
+    inline cl::NDRange localLatticeRange() const { return cl::NDRange(nx, ny, nz); }
+
+
+    // Cells along the axis d of the tile of a work group of the blocked
+    // compute kernel, whose work items update z_cells cells along z
+    inline size_t tile_cells(int d) const { return lws[d] * (d == 2 ? z_cells : 1); }
+
+
+    // Bytes of the tile of a work group of the blocked compute kernel, and
+    // of the lattice in the local memory of the local lattice one
+    inline size_t tile_size() const { return Q * tile_cells(0) * tile_cells(1) * tile_cells(2) * sizeof(T); }
+    inline size_t local_lattice_size() const { return Q * cells_dim() * sizeof(T); }
+
+
+    // First iteration from it to last that stores, reduces or checks
+    // anything, or last if none does.
+    size_t nextOutput(size_t it, size_t last) const
+    {
+        for (; it < last; ++it) {
+            if (dump_f ||
+                (dump_data && it % every == 0) ||
+                (diagnostics_every != 0 && it % diagnostics_every == 0) ||
+                (tolerance > 0.0 && it % residual_every == 0) ||
+                (checkpoint_every != 0 && it % checkpoint_every == 0))
+            {
+                return it;
+            }
+        }
+        return last;
+    }
+
+
+    // Last iteration computed by the launch starting at it. The local
+    // lattice kernel computes all the iterations up to the next one that
+    // stores, reduces or checks anything, the blocked kernel block_steps
+    // iterations if none of them but the last does and the block does not
+    // pass the last iteration, and the other kernels a single iteration.
+    size_t launchEnd(size_t it) const
+    {
+        if (local_lattice) return nextOutput(it, iterations);
+
+        if (block_steps > 1) {
+            const size_t last = it + block_steps - 1;
+            if (last <= iterations && nextOutput(it, last) == last) return last;
+        }
+        return it;
+    }
+
+
+    std::string sizeStr() const
+    {
+        std::stringstream size;
+        size << nx << "x" << ny << "x" << nz;
+        return size.str();
+    }
+
+
+    void setInitializeArgs(cl::Kernel & kernel)
+    {
+        if (sparse) {
+            kernel.setArg(0, f_stream);
+            kernel.setArg(1, f_collide);
+            kernel.setArg(2, cells);
+            kernel.setArg(3, static_cast<cl_int>(sparse_cells.cells.size()));
+            return;
+        }
+
+        // With in place streaming both copies are the single buffer
+        kernel.setArg(0, f_stream);
+        kernel.setArg(1, (streaming == STREAMING_AA ? f_stream : f_collide));
+        kernel.setArg(2, rho);
+        kernel.setArg(3, u);
+        kernel.setArg(4, map);
+        if (members() > 1) kernel.setArg(5, params);
+    }
+
+
+    // Sets the arguments of a compute kernel for the even (is_swap) or odd
+    // iterations. Push streaming swaps the two buffers, while in place
+    // streaming alternates its two steps on the single buffer: odd iterations
+    // run the step in the cell, even ones the step in the neighbours.
+    void setComputeArgs(cl::Kernel & kernel, bool is_swap, int is_store_data)
+    {
+        if (streaming == STREAMING_AA) {
+            kernel.setArg(0, f_stream);
+            kernel.setArg(1, rho);
+            kernel.setArg(2, u);
+            kernel.setArg(3, map);
+            kernel.setArg(4, is_store_data);
+            kernel.setArg(5, (is_swap ? 1 : 0));
+        } else {
+            kernel.setArg(0, (is_swap ? f_collide : f_stream ));
+            kernel.setArg(1, (is_swap ? f_stream :  f_collide));
+            kernel.setArg(2, rho);
+            kernel.setArg(3, u);
+            kernel.setArg(4, map);
+            kernel.setArg(5, is_store_data);
+            if (members() > 1) kernel.setArg(6, params);
+        }
+
+        if (sparse) {
+            kernel.setArg(6, cells);
+            kernel.setArg(7, neighbours);
+            kernel.setArg(8, static_cast<cl_int>(sparse_cells.cells.size()));
+        }
+    }
+
+
+    // Sets the arguments of all the compute kernels, after the two buffers of
+    // the distributions are created or swapped.
+    void setAllComputeArgs()
+    {
+        for (int is_swap = 0; is_swap < 2; ++is_swap) {
+            for (int is_store_data = 0; is_store_data < 2; ++is_store_data) {
+                setComputeArgs(compute_kernels[is_swap][is_store_data], is_swap, is_store_data);
+
+                if (block_steps > 1) {
+                    cl::Kernel & blocked_kernel = blocked_kernels[is_swap][is_store_data];
+                    setComputeArgs(blocked_kernel, is_swap, is_store_data);
+                    blocked_kernel.setArg(6, cl::Local(tile_size()));
+                }
+
+                if (interior_split) {
+                    setComputeArgs(interior_kernels[is_swap][is_store_data], is_swap, is_store_data);
+                }
+
+                // The iterations of a launch are set when it is enqueued
+                if (local_lattice) {
+                    cl::Kernel & local_kernel = local_kernels[is_swap][is_store_data];
+                    setComputeArgs(local_kernel, is_swap, is_store_data);
+                    local_kernel.setArg(6, cl::Local(local_lattice_size()));
+                    local_kernel.setArg(7, static_cast<cl_int>(1));
+                }
+            }
+        }
+    }
+
+
+    // Average time (in milliseconds) of a compute iteration with the given
+    // kernels and work group size, measured after a few warm up iterations.
+    double timeLaunch(cl::Kernel & init, cl::Kernel & compute, const cl::NDRange & local)
+    {
+        std::vector<cl::Event> timed;
+
+        queue.enqueueNDRangeKernel(init, cl::NullRange, latticeRange(local), local);
+        for (size_t it = 1; it <= AUTOTUNE_WARMUP_ITERATIONS + AUTOTUNE_ITERATIONS; ++it) {
+            setComputeArgs(compute, (it % 2 == 0), 0);
+
+            cl::Event compute_evt;
+            queue.enqueueNDRangeKernel(compute, cl::NullRange, latticeRange(local, z_cells), local, nullptr, &compute_evt);
+            if (it > AUTOTUNE_WARMUP_ITERATIONS) timed.push_back(compute_evt);
+        }
+        queue.finish();
+
+        double total = 0.0;
+        for (const cl::Event & event : timed) {
+            total += (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / 1000000.0;
+        }
+        return total / AUTOTUNE_ITERATIONS;
+    }
+
+
+    // Selects the work group size and the stride with the fastest compute
+    // kernel, among the candidates of benchmark.sh, and stores them in the
+    // cache. A program is built for each (lws[0], stride), as both are
+    // compile time constants. Configurations larger than the work group size
+    // allowed by the kernel, or whose build uses more private memory than the
+    // others (spilled registers), are rejected without running them. The
+    // Sailfish streaming tries only work groups of lws[0] x 1 x 1 items.
+    void autotuneLaunch()
+    {
+        struct variant {
+            size_t lwx;
+            size_t stride;
+            cl::Kernel init;
+            cl::Kernel compute;
+            size_t max_wgs;
+            cl_ulong private_mem;
+        };
+
+        const size_t lattice = cells_dim();
+        const size_t max_wgs = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        const std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+        std::vector<size_t> sizes;
+        for (size_t s = 1; s <= std::min<size_t>(nx, 128); s <<= 1) sizes.push_back(s);
+
+        // Strides must be powers of 2, the whole lattice is tried only if it is one
+        std::vector<size_t> strides;
+        for (size_t s : {(size_t)1, (size_t)8, (size_t)16, (size_t)32, (size_t)64, (size_t)128, lattice}) {
+            if (s <= lattice && is_power_of_two(s) && std::find(strides.begin(), strides.end(), s) == strides.end()) strides.push_back(s);
+        }
+
+        std::cout << "autotune: " << autotuneKeyStr() << std::endl;
+
+        // Distributions of the timed launches, padded to the largest stride,
+        // released once the stride is selected
+        const size_t max_stride = *std::max_element(strides.begin(), strides.end());
+        const size_t scratch_size = paddedCells(lattice, max_stride) * Q * members() * storageBytes(storage, sizeof(T));
+        cl_int err;
+
+        f_stream = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, scratch_size, nullptr, &err);
+        CLUCheckErrorExit(err, "cl::Buffer(f_stream)");
+        if (streaming != STREAMING_AA) {
+            f_collide = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, scratch_size, nullptr, &err);
+            CLUCheckErrorExit(err, "cl::Buffer(f_collide)");
+        }
+
+        // Build all the variants
+        std::vector<variant> variants;
+        cl_ulong min_private_mem = std::numeric_limits<cl_ulong>::max();
+        for (size_t lwx : sizes) {
+            if (max_items.size() > 0 && lwx > max_items[0]) continue;
+            for (size_t s : strides) {
+                try {
+                    cl::Program variant_program;
+                    CLUBuildProgramCached(variant_program, context, device, "kernels.cl", kernelOptionsStr(lwx, s), kernel_cache);
+
+                    variant v;
+                    v.lwx = lwx;
+                    v.stride = s;
+                    v.init = cl::Kernel(variant_program, INITIALIZE_KERNEL_NAME);
+                    v.compute = cl::Kernel(variant_program, computeKernelName());
+                    v.max_wgs = v.compute.template getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+                    v.private_mem = v.compute.template getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
+
+                    setInitializeArgs(v.init);
+
+                    min_private_mem = std::min(min_private_mem, v.private_mem);
+                    variants.push_back(v);
+                } catch (cl::Error err) {
+                    std::cout << "autotune: lws[0] " << lwx << ", stride " << s << " rejected: " << cl_get_error_string(err.err()) << std::endl;
+                }
+            }
+        }
+
+        // Time the configurations of each variant
+        double best_time = std::numeric_limits<double>::max();
+        autotune_entry best;
+        size_t rejected = 0;
+
+        for (variant & v : variants) {
+            if (v.private_mem > min_private_mem) {
+                std::cout << "autotune: lws[0] " << v.lwx << ", stride " << v.stride << " rejected: "
+                          << v.private_mem << " B of private memory" << std::endl;
+                continue;
+            }
+
+            for (size_t lwy : sizes) {
+                if (lwy > v.lwx || lwy > ny || (max_items.size() > 1 && lwy > max_items[1])) continue;
+                if (streaming == STREAMING_SAILFISH && lwy > 1) continue;
+                for (size_t lwz : sizes) {
+                    if (lwz > lwy || lwz > (nz + z_cells - 1) / z_cells || (max_items.size() > 2 && lwz > max_items[2])) continue;
+                    if ((v.lwx * lwy * lwz) > std::min(max_wgs, v.max_wgs)) {
+                        rejected++;
+                        continue;
+                    }
+
+                    try {
+                        const double time = timeLaunch(v.init, v.compute, cl::NDRange(v.lwx, lwy, lwz));
+                        std::cout << "autotune: lws (" << v.lwx << ", " << lwy << ", " << lwz << "), stride " << v.stride
+                                  << ": " << time << " ms" << std::endl;
+
+                        if (time < best_time) {
+                            best_time = time;
+                            best.lwx = v.lwx;
+                            best.lwy = lwy;
+                            best.lwz = lwz;
+                            best.stride = v.stride;
+                        }
+                    } catch (cl::Error err) {
+                        rejected++;
+                        std::cout << "autotune: lws (" << v.lwx << ", " << lwy << ", " << lwz << "), stride " << v.stride
+                                  << " rejected: " << cl_get_error_string(err.err()) << std::endl;
+                    }
+                }
+            }
+        }
+
+        if (best_time == std::numeric_limits<double>::max()) {
+            std::cerr << "autotune: no valid configuration found" << std::endl;
+            exit(1);
+        }
+
+        std::cout << "autotune: " << rejected << " configurations rejected by the work group size limits" << std::endl
+                  << "autotune: best lws (" << best.lwx << ", " << best.lwy << ", " << best.lwz << "), stride " << best.stride
+                  << ": " << best_time << " ms, " << (wet_dim() / (best_time * 1000)) << " MLUPS" << std::endl;
+
+        f_stream = cl::Buffer();
+        f_collide = cl::Buffer();
+
+        lws = cl::NDRange(best.lwx, best.lwy, best.lwz);
+        stride = best.stride;
+        storeAutotune(autotune_cache, autotuneKeyStr(), best);
+    }
+
+
+    // Uses the work group size and stride stored by a previous autotuning
+    // of the same device, driver, dimension, precision and kernel code, if
+    // any, and builds the program with them. The entry is ignored if its work
+    // group is larger than the compute kernel allows, as when the registers
+    // it uses changed. Returns true if the program is built.
+    bool loadTunedLaunch()
+    {
+        autotune_entry entry;
+        if (!loadAutotune(autotune_cache, autotuneKeyStr(), entry)) return false;
+
+        try {
+            cl::Program tuned_program;
+            CLUBuildProgramCached(tuned_program, context, device, "kernels.cl", kernelOptionsStr(entry.lwx, entry.stride), kernel_cache);
+
+            const cl::Kernel compute(tuned_program, computeKernelName());
+            const size_t max_wgs = compute.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+            if (entry.lwx * entry.lwy * entry.lwz > max_wgs) {
+                std::cout << "autotune: lws (" << entry.lwx << ", " << entry.lwy << ", " << entry.lwz << ") from "
+                          << autotune_cache << " rejected: the compute kernel allows " << max_wgs << " work items" << std::endl;
+                return false;
+            }
+            program = tuned_program;
+        } catch (cl::Error err) {
+            std::cout << "autotune: lws (" << entry.lwx << ", " << entry.lwy << ", " << entry.lwz << "), stride " << entry.stride
+                      << " from " << autotune_cache << " rejected: " << cl_get_error_string(err.err()) << std::endl;
+            return false;
+        }
+
+        lws = cl::NDRange(entry.lwx, entry.lwy, entry.lwz);
+        stride = entry.stride;
+        std::cout << "autotune: using lws (" << entry.lwx << ", " << entry.lwy << ", " << entry.lwz << "), stride "
+                  << entry.stride << " from " << autotune_cache << std::endl;
+        return true;
+    }
+
+
+    // Lattice buffer of size bytes. On CPU devices it uses host memory first
+    // touched by the OpenMP threads, spread over their NUMA nodes, instead
+    // of memory allocated by the runtime on the node of the first thread.
+    cl::Buffer createLatticeBuffer(cl_mem_flags flags, size_t size, const char * name)
+    {
+        cl_int err;
+        void * host = nullptr;
+
+        if (host_ptr) {
+            host_buffers.emplace_back(size);
+            host = host_buffers.back().data();
+            flags |= CL_MEM_USE_HOST_PTR;
+        }
+
+        cl::Buffer buffer(context, flags, size, host, &err);
+        CLUCheckErrorExit(err, name);
+        return buffer;
+    }
+
+
+    // NUMA nodes of the pages of a lattice buffer.
+    std::string placementStr(const cl::Buffer & buffer) const
+    {
+        if (!host_ptr || buffer() == nullptr) return "device";
+        return pagePlacement(buffer.getInfo<CL_MEM_HOST_PTR>(), buffer.getInfo<CL_MEM_SIZE>());
+    }
+
+
+    void createFBuffers(bool host_access)
+    {
+        f_stream = createLatticeBuffer(CL_MEM_READ_WRITE | (host_access ? 0 : CL_MEM_HOST_NO_ACCESS), f_size(), "cl::Buffer(f_stream)");
+
+        if (streaming != STREAMING_AA) {
+            f_collide = createLatticeBuffer(CL_MEM_READ_WRITE | (host_access ? 0 : CL_MEM_HOST_NO_ACCESS), f_size(), "cl::Buffer(f_collide)");
+        }
+    }
+
+
+    // Writes the map (and the initial macro quantities) of the whole lattice,
+    // then builds the cells and the neighbour table of the sparse lattice
+    // from it. The sparse kernels run in one dimension, with work groups of
+    // lws[0] * lws[1] * lws[2] items.
+    void setupSparse()
+    {
+        cl_int err;
+
+        cl::Kernel initialize_map_kernel(program, INITIALIZE_MAP_KERNEL_NAME, &err);
+        CLUCheckErrorExit(err, "cl::Kernel(initialize_map)");
+
+        std::vector<map_t> values(map_dim());
+        try {
+            initialize_map_kernel.setArg(0, rho);
+            initialize_map_kernel.setArg(1, u);
+            initialize_map_kernel.setArg(2, map);
+
+            cl::Event init_evt;
+            queue.enqueueNDRangeKernel(initialize_map_kernel, cl::NullRange, latticeRange(lws), lws, nullptr, &init_evt);
+            recordEvent(INITIALIZE_MAP_KERNEL_NAME, init_evt);
+
+            cl::Event read_evt;
+            queue.enqueueReadBuffer(map, CL_TRUE, 0, map_size(), values.data(), nullptr, &read_evt);
+            recordEvent(READ_MAP_NAME, read_evt);
+        } catch (cl::Error err) {
+            CLUErrorPrintExit(err);
+        }
+
+        buildSparseLattice(values.data(), nx, ny, nz, stride, sparse_cells);
+
+        cells = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+                           sparse_cells.cells.size() * sizeof(cl_int), sparse_cells.cells.data(), &err);
+        CLUCheckErrorExit(err, "cl::Buffer(cells)");
+
+        neighbours = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+                                sparse_cells.neighbours.size() * sizeof(cl_int), sparse_cells.neighbours.data(), &err);
+        CLUCheckErrorExit(err, "cl::Buffer(neighbours)");
+
+        const size_t local = lws[0] * lws[1] * lws[2];
+        sparse_lws = cl::NDRange(local);
+        sparse_gws = cl::NDRange(((sparse_cells.cells.size() + local - 1) / local) * local);
+    }
+
+
+    void storeMap()
+    {
+        // Read from Device
+        cl::Event read_evt;
+        CLUCheckErrorExit(
+            queue.enqueueReadBuffer(map, CL_TRUE, 0, map_size(), map_values, nullptr, &read_evt),
+            READ_MAP_NAME
+        );
+        recordEvent(READ_MAP_NAME, read_evt);
+
+        // Store to file
+        writeMap(dump_path + "/map.dump", map_values, nx, ny, nz);
+    }
+
+
+    void storeF(const cl::Buffer & f, size_t iteration)
+    {
+        pinned_slot & slot = acquireSlot(f_slots, next_f_slot);
+        void * f_values = slot.host_ptr;
+
+        std::stringstream filenameBuilder;
+        filenameBuilder << dump_path << "/f_" << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".dump";
+
+        const std::string filename = filenameBuilder.str();
+        const size_t nx = this->nx;
+        const size_t ny = this->ny;
+        const size_t nz = this->nz;
+        const size_t stride = this->stride;
+        const lbm_storage storage = this->storage;
+        const size_t f_dim = this->f_dim();
+        const sparse_lattice * lattice = (sparse ? &sparse_cells : nullptr);
+        slot.job = [filename, f_values, nx, ny, nz, stride, storage, f_dim, lattice]() {
+            const T * values = static_cast<const T *>(f_values);
+
+            std::vector<T> decoded;
+            if (storage != STORAGE_REAL) {
+                decoded.resize(f_dim);
+                decodeStorage(f_values, decoded.data(), f_dim, stride, storage);
+                values = decoded.data();
+            }
+
+            if (lattice != nullptr) {
+                std::vector<T> scattered(paddedCells(nx * ny * nz, stride) * Q);
+                scatterSparse(values, scattered.data(), *lattice, nx, ny, nz, stride);
+                writeF(filename, scattered.data(), nx, ny, nz, stride);
+            } else {
+                writeF(filename, values, nx, ny, nz, stride);
+            }
+        };
+
+        // Read from Device
+        cl::Event read_evt;
+        CLUCheckErrorExit(
+            queue.enqueueReadBuffer(f, CL_FALSE, 0, f_size(), f_values, nullptr, &read_evt),
+            READ_F_NAME
+        );
+        CLUCheckErrorExit(read_evt.setCallback(CL_COMPLETE, onTransferComplete, &slot), "setCallback(read_f)");
+        recordEvent(READ_F_NAME, read_evt);
+        queue.flush();
+    }
+
+
+    void storeData(size_t iteration)
+    {
+        pinned_slot & slot = acquireSlot(data_slots, next_data_slot);
+        T * rho_values = static_cast<T *>(slot.host_ptr);
+        T * u_values = rho_values + rho_dim();
+
+        // One file for each member of the ensemble
+        std::vector<std::string> filenames;
+        for (size_t member = 0; member < members(); ++member) {
+            std::stringstream filenameBuilder;
+            filenameBuilder << vtk_path << "/lbmcl" << memberTag(member, members()) << "."
+                            << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".vti";
+            filenames.push_back(filenameBuilder.str());
+        }
+
+        const size_t nx = this->nx;
+        const size_t ny = this->ny;
+        const size_t nz = this->nz;
+        const size_t cells = cells_dim();
+        const vtk_format format = vtk_fmt;
+        const bool float32 = vtk_float32;
+        slot.job = [filenames, rho_values, u_values, nx, ny, nz, cells, format, float32]() {
+            for (size_t member = 0; member < filenames.size(); ++member) {
+                writeVTI(filenames[member], rho_values + member * cells, u_values + member * cells * D,
+                         nx, ny, nz, format, float32);
+            }
+        };
+
+        // Read from Device. The queue is in order, so the callback on the
+        // last transfer is enough to know that the slot is filled.
+        cl::Event read_rho_evt;
+        cl::Event read_u_evt;
+
+        CLUCheckErrorExit(
+            queue.enqueueReadBuffer(rho, CL_FALSE, 0, rho_size(), rho_values, nullptr, &read_rho_evt),
+            READ_RHO_NAME
+        );
+        recordEvent(READ_RHO_NAME, read_rho_evt);
+
+        CLUCheckErrorExit(
+            queue.enqueueReadBuffer(u, CL_FALSE, 0, u_size(), u_values, nullptr, &read_u_evt),
+            READ_U_NAME
+        );
+        CLUCheckErrorExit(read_u_evt.setCallback(CL_COMPLETE, onTransferComplete, &slot), "setCallback(read_u)");
+        recordEvent(READ_U_NAME, read_u_evt);
+        queue.flush();
+    }
+
+
+    // Builds the kernels and the buffers of the diagnostics and of the
+    // residual, which share the second stage of the reduction. The work
+    // group size is the largest power of 2 accepted by all the reductions.
+    void setupReductions()
+    {
+        cl_int err;
+
+        diagnostics_kernel = cl::Kernel(program, DIAGNOSTICS_KERNEL_NAME, &err);
+        CLUCheckErrorExit(err, "cl::Kernel(diagnostics)");
+
+        residual_kernel = cl::Kernel(program, RESIDUAL_KERNEL_NAME, &err);
+        CLUCheckErrorExit(err, "cl::Kernel(residual)");
+
+        reduce_diagnostics_kernel = cl::Kernel(program, REDUCE_DIAGNOSTICS_KERNEL_NAME, &err);
+        CLUCheckErrorExit(err, "cl::Kernel(reduce_diagnostics)");
 
+        size_t local = std::min<size_t>(DIAGNOSTICS_LWS, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        local = std::min(local, diagnostics_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+        local = std::min(local, residual_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+        local = std::min(local, reduce_diagnostics_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+        diagnostics_lws = previous_power_of_two(local);
 
-        if (std::is_same<T, float>::value) {
-            optionsBuilder << "-DFP_SINGLE ";
-            optionsBuilder << "-cl-single-precision-constant ";
-        } else {
-            optionsBuilder << "-DFP_DOUBLE ";
+        if (diagnostics_lws < DIAGNOSTICS) {
+            std::cerr << "The device does not support work groups of " << DIAGNOSTICS << " items for the diagnostics" << std::endl;
+            exit(1);
         }
 
-        if (optimize) {
-            optionsBuilder << "-cl-fast-relaxed-math ";
-        }
+        diagnostics_groups = (cells_dim() + diagnostics_lws - 1) / diagnostics_lws;
 
-        return optionsBuilder.str();
-    }
+        diagnostics_partials = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, members() * diagnostics_groups * DIAGNOSTICS * sizeof(T), nullptr, &err);
+        CLUCheckErrorExit(err, "cl::Buffer(diagnostics_partials)");
 
+        diagnostics_result = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, members() * DIAGNOSTICS * sizeof(T), nullptr, &err);
+        CLUCheckErrorExit(err, "cl::Buffer(diagnostics_result)");
 
-    void storeMap()
-    {
-        // Read from Device
-        cl::Event read_evt;
-        CLUCheckErrorExit(
-            queue.enqueueReadBuffer(map, CL_TRUE, 0, map_size(), map_values, nullptr, &read_evt),
-            READ_MAP_NAME
-        );
-        events.emplace_back(READ_MAP_NAME, read_evt);
+        if (tolerance > 0.0) {
+            u_prev = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, u_size(), nullptr, &err);
+            CLUCheckErrorExit(err, "cl::Buffer(u_prev)");
+        }
 
-        // Store to file
-        std::stringstream filenameBuilder;
-        filenameBuilder << dump_path << "/map.dump";
-
-        std::ofstream dump;
-        dump.open(filenameBuilder.str());
-
-        dump << "# FLUID       1" << std::endl
-             << "# MOVING      2" << std::endl
-             << "# BOUNDARY    3" << std::endl
-             << "# WALL        4" << std::endl
-             << "# CORNER      5" << std::endl
-             << std::endl;
-
-        for (size_t z = 0; z < dim; ++z) {
-            for (size_t y = 0; y < dim; ++y) {
-                for (size_t x = 0; x < dim; ++x) {
-                    const size_t cell_type = map_values[IDxyzDIM(x, y, z, dim)];
-
-                    int val = 0;
-                    if (is_fluid(cell_type))    val = 1;
-                    if (is_moving(cell_type))   val = 2;
-                    if (is_boundary(cell_type)) val = 3;
-                    if (is_wall(cell_type))     val = 4;
-                    if (is_corner(cell_type))   val = 5;
-                    dump << val << " ";
-                }
-                dump << std::endl;
+        try {
+            diagnostics_kernel.setArg(0, rho);
+            diagnostics_kernel.setArg(1, u);
+            diagnostics_kernel.setArg(2, map);
+            diagnostics_kernel.setArg(3, diagnostics_partials);
+            diagnostics_kernel.setArg(4, cl::Local(DIAGNOSTICS * diagnostics_lws * sizeof(T)));
+
+            if (tolerance > 0.0) {
+                residual_kernel.setArg(0, u);
+                residual_kernel.setArg(1, u_prev);
+                residual_kernel.setArg(2, map);
+                residual_kernel.setArg(3, diagnostics_partials);
+                residual_kernel.setArg(4, cl::Local(DIAGNOSTICS * diagnostics_lws * sizeof(T)));
             }
-            dump << std::endl;
+
+            reduce_diagnostics_kernel.setArg(0, diagnostics_partials);
+            reduce_diagnostics_kernel.setArg(1, static_cast<cl_int>(diagnostics_groups));
+            reduce_diagnostics_kernel.setArg(2, diagnostics_result);
+            reduce_diagnostics_kernel.setArg(3, cl::Local(DIAGNOSTICS * diagnostics_lws * sizeof(T)));
+        } catch (cl::Error err) {
+            CLUErrorPrintExit(err);
         }
-        dump << std::endl;
 
-        dump.close();
+        if (diagnostics_every != 0) {
+            diagnostics_out.resize(members());
+            for (size_t member = 0; member < members(); ++member) {
+                diagnostics_out[member].open(dump_path + "/" + DIAGNOSTICS_FILE + memberTag(member, members()) + DIAGNOSTICS_EXTENSION);
+            }
+        }
     }
 
 
-    void storeF(const cl::Buffer & f, size_t iteration)
+    // Enqueues the first stage of a reduction, kernel, and the second stage
+    // reducing its partials into diagnostics_result, for all the members of
+    // the ensemble.
+    void enqueueReduction(cl::Kernel & kernel, const char * name)
     {
-        // Read from Device
-        cl::Event read_evt;
+        cl::Event kernel_evt;
         CLUCheckErrorExit(
-            queue.enqueueReadBuffer(f, CL_TRUE, 0, f_size(), f_values, nullptr, &read_evt),
-            READ_F_NAME
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(diagnostics_groups * diagnostics_lws, members()), cl::NDRange(diagnostics_lws, 1), nullptr, &kernel_evt),
+            name
         );
-        events.emplace_back(READ_F_NAME, read_evt);
+        recordEvent(name, kernel_evt);
 
+        cl::Event reduce_evt;
+        CLUCheckErrorExit(
+            queue.enqueueNDRangeKernel(reduce_diagnostics_kernel, cl::NullRange, cl::NDRange(diagnostics_lws, members()), cl::NDRange(diagnostics_lws, 1), nullptr, &reduce_evt),
+            REDUCE_DIAGNOSTICS_KERNEL_NAME
+        );
+        recordEvent(REDUCE_DIAGNOSTICS_KERNEL_NAME, reduce_evt);
+    }
 
-        // Store to file
-        std::stringstream filenameBuilder;
-        filenameBuilder << dump_path << "/f_" << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".dump";
 
-        // (xxx,yyy,zzz) 
-        // 1 + D + 1 + D + 1 + D + 1 + 1
-        const size_t dim_digits = DIGITS(dim);
-        const size_t coord_spaces = dim_digits * 3 + 5;
+    // Reduces the diagnostics of the macro quantities of the iteration on the
+    // device and reads them back without waiting: only DIAGNOSTICS values for
+    // each member are transferred.
+    void storeDiagnostics(size_t iteration)
+    {
+        enqueueReduction(diagnostics_kernel, DIAGNOSTICS_KERNEL_NAME);
 
-        std::ofstream dump;
-        dump.open(filenameBuilder.str());
+        diagnostics_reads.emplace_back();
+        diagnostics_read & read = diagnostics_reads.back();
+        read.iteration = iteration;
+        read.values.resize(members() * DIAGNOSTICS);
 
-        for (size_t z = 0; z < dim; ++z) {
-            for (size_t y = 0; y < dim; ++y) {
-                for (size_t s = 0; s < coord_spaces; ++s) {
-                    dump << " ";
-                }
-                for (size_t q = 0; q < Q; ++q) {
-                    dump << std::setw(DUMP_PRECISION + 2) << q << " ";
-                }
-                dump << std::endl;
-
-                for (size_t x = 0; x < dim; ++x) {
-                    const size_t index = IDxyzDIM(x, y, z, dim);
-                    dump << std::setw(dim_digits) << "(" << x << "," << y << "," << z << ") ";
-                    for (size_t q = 0; q < Q; ++q) {
-                        dump << std::fixed 
-                             << std::setw(DUMP_PRECISION + 2)
-                             << std::setprecision(DUMP_PRECISION)
-                             << f_values[IDxyzqDIM(index, q, Q, stride)]
-                             << " ";
-                    }
-                    dump << std::endl;
-                }
-                dump << std::endl;
-            }
-            dump << std::endl;
-        }
-        dump << std::endl;
+        CLUCheckErrorExit(
+            queue.enqueueReadBuffer(diagnostics_result, CL_FALSE, 0, read.values.size() * sizeof(T), read.values.data(), nullptr, &read.event),
+            READ_DIAGNOSTICS_NAME
+        );
+        recordEvent(READ_DIAGNOSTICS_NAME, read.event);
 
-        dump.close();
+        retireDiagnostics(false);
     }
 
 
-    void storeData(size_t iteration)
+    // Reduces the residual of the velocity since the previous check and
+    // waits for it. Returns true, and prints it, once it is below tolerance
+    // for all the members of the ensemble, never at the first check.
+    bool checkResidual(size_t iteration)
     {
-        // Read from Device
-        cl::Event read_rho_evt;
-        cl::Event read_u_evt;
-    
-        CLUCheckErrorExit(
-            queue.enqueueReadBuffer(rho, CL_TRUE, 0, rho_size(), rho_values, nullptr, &read_rho_evt),
-            READ_RHO_NAME
-        );
-        events.emplace_back(READ_RHO_NAME, read_rho_evt);
+        enqueueReduction(residual_kernel, RESIDUAL_KERNEL_NAME);
 
+        std::vector<T> values(members() * DIAGNOSTICS);
+        cl::Event read_evt;
         CLUCheckErrorExit(
-            queue.enqueueReadBuffer(u, CL_TRUE, 0, u_size(), u_values, nullptr, &read_u_evt),
-            READ_U_NAME
+            queue.enqueueReadBuffer(diagnostics_result, CL_TRUE, 0, values.size() * sizeof(T), values.data(), nullptr, &read_evt),
+            READ_RESIDUAL_NAME
         );
-        events.emplace_back(READ_U_NAME, read_u_evt);
+        recordEvent(READ_RESIDUAL_NAME, read_evt);
 
+        if (!has_reference) {
+            has_reference = true;
+            return false;
+        }
 
-        // Store to file
-        std::stringstream filenameBuilder;
-        filenameBuilder << vtk_path << "/lbmcl." << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".vti";
-
-        const size_t from = 1;
-        const size_t to = dim - 1;
-        const size_t extent = to - from - 1;
-        const std::string dataTypeString = (std::is_same<T, float>::value ? "Float32" : "Float64");
-
-        std::ofstream vtk;
-        vtk.open(filenameBuilder.str());
-
-        vtk << "<?xml version=\"1.0\"?>\n" 
-            << "<VTKFile type=\"ImageData\" version=\"0.1\" byte_order=\"LittleEndian\" header_type=\"UInt64\">\n" 
-            << "  <ImageData WholeExtent=\"0 " << extent << " 0 " << extent << " 0 " << extent << "\" Origin=\"0 0 0\" Spacing=\"1 1 1\">\n"
-            << "    <Piece Extent=\"0 " << extent << " 0 " << extent << " 0 " << extent << "\">\n"
-            << "      <PointData Scalars=\"rho\">\n"
-            << "        <DataArray type=\"" << dataTypeString << "\" Name=\"rho\" NumberOfComponents=\"1\" format=\"ascii\">\n";
-
-        for (size_t z = from; z < to; ++z) {
-            for (size_t y = from; y < to; ++y) {
-                for (size_t x = from; x < to; ++x) {
-                    const T val = rho_values[IDxyzDIM(x, y, z, dim)];
-                    vtk << std::scientific << std::setprecision(VTK_PRECISION) << val << " ";
-                }
-                vtk << "\n";
-            }
+        double residual = 0.0;
+        T max_du = T(0.0);
+        for (size_t member = 0; member < members(); ++member) {
+            residual = std::max(residual, relativeResidual(&values[member * DIAGNOSTICS]));
+            max_du = std::max(max_du, values[member * DIAGNOSTICS + RESIDUAL_MAX_DU]);
         }
+        if (!(residual < tolerance)) return false;
+
+        converged_iteration = iteration;
+        std::cout << "Converged at iteration " << iteration
+                  << ": residual " << residual
+                  << ", max |du| " << max_du << std::endl;
+        return true;
+    }
 
-        vtk << "        </DataArray>\n"
-            << "        <DataArray type=\"" << dataTypeString << "\" Name=\"v\" NumberOfComponents=\"3\" format=\"ascii\">\n";
 
-        for (size_t z = from; z < (to); ++z) {
-            for (size_t y = from; y < (to); ++y) {
-                for (size_t x = from; x < (to); ++x) {
-                    const size_t id = IDxyzDIM(x, y, z, dim);
-                    const T val_x = u_values[IDuxDIM(id, dim)];
-                    const T val_y = u_values[IDuyDIM(id, dim)];
-                    const T val_z = u_values[IDuzDIM(id, dim)];
-                    vtk << std::scientific << std::setprecision(VTK_PRECISION) << val_x << " "
-                        << std::scientific << std::setprecision(VTK_PRECISION) << val_y << " "
-                        << std::scientific << std::setprecision(VTK_PRECISION) << val_z << " ";
+    // Appends the diagnostics already read back to the log, in order of
+    // iteration. If wait is true, it waits for all of them.
+    void retireDiagnostics(bool wait)
+    {
+        try {
+            while (!diagnostics_reads.empty()) {
+                diagnostics_read & read = diagnostics_reads.front();
+
+                if (wait) {
+                    read.event.wait();
+                } else if (read.event.template getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+                    break;
+                }
+
+                for (size_t member = 0; member < diagnostics_out.size(); ++member) {
+                    diagnostics_out[member].append(read.iteration, &read.values[member * DIAGNOSTICS]);
                 }
-                vtk << "\n";
+                diagnostics_reads.pop_front();
             }
+        } catch (cl::Error err) {
+            CLUErrorPrintExit(err);
         }
-
-        vtk << "        </DataArray>\n"
-            << "      </PointData>\n"
-            << "    </Piece>\n"
-            << "  </ImageData>\n"
-            << "</VTKFile>\n";
-
-        vtk.close();
     }
 
 
 public:
-    LBMCL(size_t dim,
+    LBMCL(size_t nx,
+          size_t ny,
+          size_t nz,
           T viscosity,
           T velocity,
           size_t iterations,
@@ -348,8 +1367,12 @@ public:
           bool optimize = true,
           std::string dump_path = "",
           bool dump_map = false,
-          bool dump_f = false)
-        : dim(dim),
+          bool dump_f = false,
+          size_t profile_every = 1,
+          size_t writer_threads = 2)
+        : nx(nx),
+          ny(ny),
+          nz(nz),
           viscosity(viscosity),
           velocity(velocity),
           iterations(iterations),
@@ -359,28 +1382,25 @@ public:
           optimize(optimize),
           dump_path(dump_path),
           dump_map(dump_map),
-          dump_f(dump_f)
+          dump_f(dump_f),
+          profile_every(profile_every),
+          writer_threads(writer_threads)
     {
         dump_data = (every != 0);
 
-        if (!is_power_of_two(dim)) {
-            this->dim = previous_power_of_two(dim);
-            std::cout << "dim is rounded to the previous power of 2: " << this->dim << std::endl;
-        }
-
-        this->gws = cl::NDRange(this->dim, this->dim, this->dim);
-
         if (lwx == 0) lwx = 1;
         if (lwy == 0) lwy = 1;
         if (lwz == 0) lwz = 1;
 
-        if ((lwx * lwy * lwz) > (this->dim * this->dim * this->dim)) {
+        if ((lwx * lwy * lwz) > cells_dim()) {
             std::cerr << "Please enter a good work_group_size to run the simulation" << std::endl;
             exit(-1);
         }
 
         this->lws = cl::NDRange(lwx, lwy, lwz);
 
+        if (this->profile_every == 0) this->profile_every = 1;
+
         if (!is_power_of_two(this->stride)) {
             this->stride = previous_power_of_two(this->stride);
             std::cout << "stride is rounded to the previous power of 2: " << this->stride << std::endl;
@@ -388,6 +1408,216 @@ public:
     }
 
 
+    // Set the encoding of VTI files. If float32 is true, binary formats store
+    // Float32 values even for double precision simulations.
+    // Must be called before setupSimulation().
+    void setOutputFormat(vtk_format format, bool float32)
+    {
+        vtk_fmt = format;
+        vtk_float32 = float32;
+    }
+
+
+    // Store a checkpoint of the whole lattice state every N iterations
+    // (0 disables checkpoints) and optionally restart the simulation from a
+    // checkpoint file. Must be called before setupSimulation().
+    void setCheckpoint(size_t every, const std::string & restart)
+    {
+        checkpoint_every = every;
+        restart_file = restart;
+    }
+
+
+    // Select work group size and stride with the autotuner, storing them in
+    // the cache file. When use_cache is true and the autotuner is disabled,
+    // the configuration previously stored in the cache for the same device,
+    // driver, dimension and precision is used, if any.
+    // Must be called before setupSimulation().
+    void setAutotune(bool tune, const std::string & cache_file, bool use_cache)
+    {
+        autotune = tune;
+        autotune_cache = cache_file;
+        use_autotune_cache = use_cache;
+    }
+
+
+    // Directory where program binaries are cached between runs, an empty
+    // string disables the cache. Must be called before setupSimulation().
+    void setKernelCache(const std::string & cache_dir)
+    {
+        kernel_cache = cache_dir;
+    }
+
+
+    // Select how the distributions stream between iterations: push or pull
+    // streaming between two buffers, or in place (AA pattern) streaming on a
+    // single buffer, halving the memory of the distributions. The Sailfish
+    // streaming pushes the distributions moving along x through local memory,
+    // with work groups of lws[0] x 1 x 1 items. Checkpoints restart only with
+    // the streaming they were stored with, Sailfish and push are the same.
+    // Must be called before setupSimulation().
+    void setStreaming(lbm_streaming mode)
+    {
+        streaming = mode;
+    }
+
+
+    // Select the type storing the distributions on the device: the one of
+    // the simulation, or a smaller one (fp32 for double precision, fp16 or
+    // bf16 for single precision) with the same arithmetic.
+    // Must be called before setupSimulation().
+    void setStorage(lbm_storage type)
+    {
+        if (!storageFits(type, sizeof(T))) {
+            std::cerr << "The " << lbmStorageStr(type) << " storage is not smaller than the "
+                      << (std::is_same<T, float>::value ? "single" : "double") << " precision" << std::endl;
+            exit(1);
+        }
+        storage = type;
+    }
+
+
+    // Select the collision operator of the kernels. TRT and MRT relax the
+    // stresses with the same tau of BGK, so that the viscosity does not
+    // change, and the other moments with their own rates.
+    // Must be called before setupSimulation().
+    void setCollision(lbm_collision type)
+    {
+        collision = type;
+    }
+
+
+    // Compute the cell types of the cavity from their coordinates in the
+    // kernels, instead of reading them from the map each iteration. The map
+    // is still written at initialization for dumps and checkpoints.
+    // Must be called before setupSimulation().
+    void setProceduralGeometry(bool procedural)
+    {
+        procedural_geometry = procedural;
+    }
+
+
+    // Update only the cells that are not walls, storing only their
+    // distributions, so that memory and time scale with the cells of the
+    // fluid rather than with the whole lattice. Requires push streaming.
+    // Must be called before setupSimulation().
+    void setSparse(bool enable)
+    {
+        sparse = enable;
+    }
+
+
+    // Update count cells along z with each work item of the compute kernel,
+    // reusing the index and the classification of the column between them.
+    // The tiles of the blocked compute kernel are count cells deep along z
+    // for each work item. Requires push or pull streaming on the whole lattice.
+    // Must be called before setupSimulation().
+    void setZCells(size_t count)
+    {
+        z_cells = (count == 0 ? 1 : count);
+    }
+
+
+    // Advance tiles of the lattice count iterations with each launch of the
+    // compute kernel, in the local memory of the work groups, reading and
+    // writing the distributions once every count iterations instead of every
+    // iteration. The tiles overlap by 2 * count cells along each axis, which
+    // are computed again by the neighbouring work groups. Iterations that
+    // store, reduce or check anything end a block, the others are run one at
+    // a time. Requires push streaming on the whole lattice, a single member
+    // and tiles larger than 2 * count along each axis: lws, times z_cells
+    // along z, see setZCells().
+    // Must be called before setupSimulation().
+    void setBlockSteps(size_t count)
+    {
+        block_steps = (count == 0 ? 1 : count);
+    }
+
+
+    // Keep the whole lattice in the local memory of a single work group, one
+    // work item for each cell, and advance it with a single launch up to the
+    // next iteration that stores, reduces or checks anything, instead of one
+    // launch for each iteration. Meant for small lattices, whose launches
+    // cost more than their work: the cells must fit a work group and their
+    // distributions the local memory. Requires push streaming on the whole
+    // lattice, a single member and no temporal blocking.
+    // Must be called before setupSimulation().
+    void setLocalLattice(bool enable)
+    {
+        local_lattice = enable;
+    }
+
+
+    // Update the interior of the cavity, 2 cells away from its faces, with a
+    // kernel specialized for fluid cells, which neither reads the map nor
+    // branches on the cell type, and the shell around it with the compute
+    // kernel, launched on six thin boxes. Their timings are reported as
+    // compute_interior and compute_shell. Requires push or pull streaming on
+    // the whole lattice, a single member, no temporal blocking nor local
+    // lattice, and at least 5 cells on each axis.
+    // Must be called before setupSimulation().
+    void setInteriorSplit(bool enable)
+    {
+        interior_split = enable;
+    }
+
+
+    // Pin the OpenMP threads placing the lattice buffers of CPU devices, the
+    // threads of the OpenCL runtime are placed by the runtime.
+    // Must be called before setupSimulation().
+    void setPinThreads(bool enable)
+    {
+        pin_threads = enable;
+    }
+
+
+    // The OpenCL compiler vectorizes the kernels for the device.
+    void setSimd(lbm_simd simd)
+    {
+        if (simd != SIMD_AUTO) {
+            std::cerr << "The opencl engine does not select the CPU vectors, the OpenCL compiler vectorizes the kernels" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // Reduce total mass, kinetic energy, maximum velocity and enstrophy on
+    // the device every the given iterations, 0 disables them. They are
+    // appended to dump_path/diagnostics.csv as soon as they are read back.
+    // Must be called before setupSimulation().
+    void setDiagnostics(size_t every)
+    {
+        diagnostics_every = every;
+    }
+
+
+    // Advance an ensemble of independent lattices, one for each member, with
+    // the same kernel launches: each member has its own viscosity and moving
+    // wall velocity, its data are stored in files tagged with its index.
+    // An empty ensemble, or a single member, runs a single lattice with the
+    // parameters of the constructor.
+    // Must be called before setupSimulation().
+    void setEnsemble(const std::vector<ensemble_member> & members)
+    {
+        ensemble = (members.size() > 1 ? members : std::vector<ensemble_member>());
+        if (members.size() == 1) {
+            viscosity = T(members[0].viscosity);
+            velocity = T(members[0].velocity);
+        }
+    }
+
+
+    // Stop the simulation once the relative L2 norm of the change of the
+    // velocity, checked every the given iterations, is below tolerance. The
+    // last data are then stored. A tolerance of 0 disables the check.
+    // Must be called before setupSimulation().
+    void setTolerance(double tolerance, size_t every)
+    {
+        this->tolerance = tolerance;
+        residual_every = (every == 0 ? 1 : every);
+    }
+
+
     // Create all objects needed to perform the simulation.
     void setupSimulation(int platformID, int deviceID)
     {
@@ -396,88 +1626,222 @@ public:
         CLUCreateContext(context, device);
         CLUCreateQueue(queue, context, device);
 
-        CLUBuildProgram(program, context, device, "kernels.cl", kernelOptionsStr());
-
         cl_int err;
 
-        // Buffers
-        f_stream = cl::Buffer(context, CL_MEM_READ_WRITE | (dump_f ? 0 : CL_MEM_HOST_NO_ACCESS), f_size(), nullptr, &err);
-        CLUCheckErrorExit(err, "cl::Buffer(f_stream)");
+        // Checkpoints read and restarts write every buffer from the host
+        const bool checkpoints = (checkpoint_every != 0 || !restart_file.empty());
+
+        if (sparse && streaming != STREAMING_PUSH) {
+            std::cerr << "The sparse lattice supports only push streaming" << std::endl;
+            exit(1);
+        }
+        if (sparse && autotune) {
+            std::cerr << "The sparse lattice can not be autotuned" << std::endl;
+            exit(1);
+        }
+        if (z_cells > 1 && (sparse || streaming == STREAMING_AA || streaming == STREAMING_SAILFISH)) {
+            std::cerr << "The z-marching kernel supports only push and pull streaming on the whole lattice" << std::endl;
+            exit(1);
+        }
+        if (members() > 1 && (sparse || streaming == STREAMING_AA || streaming == STREAMING_SAILFISH || z_cells > 1)) {
+            std::cerr << "An ensemble supports only push and pull streaming on the whole lattice" << std::endl;
+            exit(1);
+        }
+        if (block_steps > 1 && (streaming != STREAMING_PUSH || sparse || members() > 1)) {
+            std::cerr << "Temporal blocking supports only push streaming on the whole lattice of a single member" << std::endl;
+            exit(1);
+        }
+        if (block_steps > 1 && autotune) {
+            std::cerr << "Temporal blocking can not be autotuned" << std::endl;
+            exit(1);
+        }
+        if (local_lattice && (streaming != STREAMING_PUSH || sparse || z_cells > 1 || members() > 1 || block_steps > 1)) {
+            std::cerr << "The local lattice supports only push streaming on the whole lattice of a single member, without temporal blocking" << std::endl;
+            exit(1);
+        }
+        if (local_lattice && autotune) {
+            std::cerr << "The local lattice can not be autotuned" << std::endl;
+            exit(1);
+        }
+        if (interior_split && ((streaming != STREAMING_PUSH && streaming != STREAMING_PULL) || sparse || z_cells > 1 ||
+                               members() > 1 || block_steps > 1 || local_lattice))
+        {
+            std::cerr << "The interior split supports only push and pull streaming on the whole lattice of a single member" << std::endl;
+            exit(1);
+        }
+        if (interior_split && (nx < 5 || ny < 5 || nz < 5)) {
+            std::cerr << "The interior split requires at least 5 cells on each axis" << std::endl;
+            exit(1);
+        }
+
+        // The threads of CPU devices share the memory of the host: the
+        // lattice buffers are placed by the OpenMP threads, pinned if asked.
+        host_ptr = ((device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0);
+        if (host_ptr && pin_threads) {
+            pinned = pinThreads();
+            if (!pinned) std::cerr << "Unable to pin the threads, they are placed by the system" << std::endl;
+        }
+
+        // Buffers. The distributions are padded to the stride, they are
+        // allocated once the launch configuration is final.
+        rho = createLatticeBuffer(CL_MEM_READ_WRITE | (checkpoints ? 0 : CL_MEM_HOST_READ_ONLY), rho_size(), "cl::Buffer(rho)");
+        u = createLatticeBuffer(CL_MEM_READ_WRITE | (checkpoints ? 0 : CL_MEM_HOST_READ_ONLY), u_size(), "cl::Buffer(u)");
+        map = createLatticeBuffer(CL_MEM_READ_WRITE | ((dump_map || checkpoints || sparse) ? 0 : CL_MEM_HOST_NO_ACCESS), map_size(), "cl::Buffer(map)");
+
+        // Moving wall velocity and inverse of tau of each member, see
+        // SELECT_MEMBER in kernels.cl
+        if (members() > 1) {
+            std::vector<T> values;
+            for (const ensemble_member & member : ensemble) {
+                values.push_back(T(member.velocity));
+                values.push_back(T(1.0 / ((3.0 * member.viscosity) + 0.5)));
+            }
+
+            params = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, values.size() * sizeof(T), values.data(), &err);
+            CLUCheckErrorExit(err, "cl::Buffer(params)");
+        }
+
+        // Launch configuration. The cached ones are tuned for the kernels
+        // without temporal blocking, nor the local lattice.
+        bool built = false;
+        if (autotune) {
+            autotuneLaunch();
+        } else if (use_autotune_cache && block_steps == 1 && !local_lattice) {
+            built = loadTunedLaunch();
+        }
+
+        if (streaming == STREAMING_SAILFISH && (lws[1] != 1 || lws[2] != 1)) {
+            std::cerr << "The Sailfish streaming requires a work_group_size of \"x,1,1\"" << std::endl;
+            exit(1);
+        }
+
+        if (block_steps > 1) {
+            if (tile_cells(0) <= 2 * block_steps || tile_cells(1) <= 2 * block_steps || tile_cells(2) <= 2 * block_steps) {
+                std::cerr << "Temporal blocking of " << block_steps << " iterations requires a tile larger than "
+                          << (2 * block_steps) << " along each axis: work_group_size, times z_cells along z" << std::endl;
+                exit(1);
+            }
+
+            const cl_ulong local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+            if (tile_size() > local_mem) {
+                std::cerr << "The tile of a work group needs " << tile_size() << " B of local memory, the device has "
+                          << local_mem << " B" << std::endl;
+                exit(1);
+            }
+        }
 
-        f_collide = cl::Buffer(context, CL_MEM_READ_WRITE | (dump_f ? 0 : CL_MEM_HOST_NO_ACCESS), f_size(), nullptr, &err);
-        CLUCheckErrorExit(err, "cl::Buffer(f_collide))");
+        if (local_lattice) {
+            const std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+            if (max_items.size() < 3 || nx > max_items[0] || ny > max_items[1] || nz > max_items[2]) {
+                std::cerr << "The local lattice of " << sizeStr() << " cells is larger than a work group of the device" << std::endl;
+                exit(1);
+            }
 
-        rho = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, rho_size(), nullptr, &err);
-        CLUCheckErrorExit(err, "cl::Buffer(rho)");
+            const cl_ulong local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+            if (local_lattice_size() > local_mem) {
+                std::cerr << "The local lattice needs " << local_lattice_size() << " B of local memory, the device has "
+                          << local_mem << " B" << std::endl;
+                exit(1);
+            }
+        }
 
-        u = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, u_size(), nullptr, &err);
-        CLUCheckErrorExit(err, "cl::Buffer(u)");
+        // The program of a cached launch configuration is already built
+        if (!built) {
+            CLUBuildProgramCached(program, context, device, "kernels.cl", kernelOptionsStr(), kernel_cache);
+        }
 
-        map = cl::Buffer(context, CL_MEM_READ_WRITE | (dump_map ? 0 : CL_MEM_HOST_NO_ACCESS), map_size(), nullptr, &err);
-        CLUCheckErrorExit(err, "cl::Buffer(map)");
+        // The distributions of the sparse lattice once the cells are known
+        if (sparse) setupSparse();
+        createFBuffers(dump_f || checkpoints);
 
+        if (diagnostics_every != 0 || tolerance > 0.0) {
+            setupReductions();
+        }
 
         // Kernels
-        initialize_kernel = cl::Kernel(program, INITIALIZE_KERNEL_NAME, &err);
+        initialize_kernel = cl::Kernel(program, initializeKernelName(), &err);
         CLUCheckErrorExit(err, "cl::Kernel(initialize)");
 
         // Set arguments to initialize kernel
         try {
-            initialize_kernel.setArg(0, f_stream);
-            initialize_kernel.setArg(1, f_collide);
-            initialize_kernel.setArg(2, rho);
-            initialize_kernel.setArg(3, u);
-            initialize_kernel.setArg(4, map);
+            setInitializeArgs(initialize_kernel);
         } catch (cl::Error err) {
             CLUErrorPrintExit(err);
         }
 
-        for (size_t iteration = 1; iteration <= iterations; ++iteration) {
-            const int is_store_data = (dump_data && (iteration != 0) && (iteration % every == 0)) ? 1 : 0;
-            const bool is_swap = (iteration % 2 == 0);
+        // One compute kernel for each combination of ping-pong direction and
+        // macro quantities update, so that the setup cost does not depend on
+        // the number of iterations.
+        for (int is_swap = 0; is_swap < 2; ++is_swap) {
+            for (int is_store_data = 0; is_store_data < 2; ++is_store_data) {
+                cl::Kernel & compute_kernel = compute_kernels[is_swap][is_store_data];
+
+                compute_kernel = cl::Kernel(program, computeKernelName(), &err);
+                CLUCheckErrorExit(err, "cl::Kernel(compute)");
 
-            cl::Kernel compute_kernel = cl::Kernel(program, COMPUTE_KERNEL_NAME, &err);
-            CLUCheckErrorExit(err, "cl::Kernel(compute)");
+                if (block_steps > 1) {
+                    blocked_kernels[is_swap][is_store_data] = cl::Kernel(program, COMPUTE_BLOCKED_KERNEL_NAME, &err);
+                    CLUCheckErrorExit(err, "cl::Kernel(compute_blocked)");
+                }
 
-            // size_t wgs = compute_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
-            // std::cout << "CL_KERNEL_WORK_GROUP_SIZE: " << wgs << std::endl;
+                if (interior_split) {
+                    interior_kernels[is_swap][is_store_data] = cl::Kernel(program, COMPUTE_INTERIOR_KERNEL_NAME, &err);
+                    CLUCheckErrorExit(err, "cl::Kernel(compute_interior)");
+                }
 
-            // cl_ulong lms = compute_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
-            // std::cout << "CL_KERNEL_LOCAL_MEM_SIZE: " << lms << std::endl;
+                if (local_lattice) {
+                    cl::Kernel & local_kernel = local_kernels[is_swap][is_store_data];
+                    local_kernel = cl::Kernel(program, COMPUTE_LOCAL_KERNEL_NAME, &err);
+                    CLUCheckErrorExit(err, "cl::Kernel(compute_local)");
 
-            // cl_ulong pms = compute_kernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
-            // std::cout << "CL_KERNEL_PRIVATE_MEM_SIZE: " << pms << std::endl;
+                    // The registers used by the kernel may limit its work groups
+                    if (cells_dim() > local_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) {
+                        std::cerr << "The local lattice of " << cells_dim() << " cells is larger than a work group of "
+                                  << local_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) << " items" << std::endl;
+                        exit(1);
+                    }
+                }
 
-            // size_t pwgsm = compute_kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
-            // std::cout << "CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE: " << pwgsm << std::endl;
+                // size_t wgs = compute_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+                // std::cout << "CL_KERNEL_WORK_GROUP_SIZE: " << wgs << std::endl;
 
-            // Set arguments to compute kernel
-            try {
-                compute_kernel.setArg(0, (is_swap ? f_collide : f_stream ));
-                compute_kernel.setArg(1, (is_swap ? f_stream :  f_collide));
-                compute_kernel.setArg(2, rho);
-                compute_kernel.setArg(3, u);
-                compute_kernel.setArg(4, map);
-                compute_kernel.setArg(5, is_store_data);
-            } catch (cl::Error err) {
-                CLUErrorPrintExit(err);
+                // cl_ulong lms = compute_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+                // std::cout << "CL_KERNEL_LOCAL_MEM_SIZE: " << lms << std::endl;
+
+                // cl_ulong pms = compute_kernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
+                // std::cout << "CL_KERNEL_PRIVATE_MEM_SIZE: " << pms << std::endl;
+
+                // size_t pwgsm = compute_kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+                // std::cout << "CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE: " << pwgsm << std::endl;
             }
+        }
+
+        // Set arguments to compute kernels
+        try {
+            setAllComputeArgs();
+        } catch (cl::Error err) {
+            CLUErrorPrintExit(err);
+        }
 
-            compute_kernels.push_back(compute_kernel);
+        if (interior_split) {
+            setupShell();
         }
 
         // Allocate memory for output and dumps if needed
         if (map_values == nullptr && dump_map) {
-            map_values = new int[map_dim()];
+            map_values = new map_t[map_dim()];
         }
 
-        if (f_values == nullptr && dump_f) {
-            f_values = new T[f_dim()];
+        if (dump_data || dump_f) {
+            writers.reset(new writer_pool(writer_threads, OUTPUT_SLOTS * 2));
+        }
+
+        if (dump_f) {
+            for (pinned_slot & slot : f_slots) createSlot(slot, f_size());
         }
 
         if (dump_data) {
-            if (rho_values == nullptr) rho_values = new T[rho_dim()];
-            if (u_values == nullptr) u_values = new T[u_dim()];
+            for (pinned_slot & slot : data_slots) createSlot(slot, rho_size() + u_size());
         }
     }
 
@@ -492,36 +1856,120 @@ public:
         // Initialize the simulation
         cl::Event init_evt;
         CLUCheckErrorExit(
-            queue.enqueueNDRangeKernel(initialize_kernel, cl::NullRange, gws, lws, nullptr, &init_evt),
+            queue.enqueueNDRangeKernel(initialize_kernel, cl::NullRange, globalRange(), localRange(), nullptr, &init_evt),
             INITIALIZE_KERNEL_NAME
         );
-        events.emplace_back(INITIALIZE_KERNEL_NAME, init_evt);
+        recordEvent(INITIALIZE_KERNEL_NAME, init_evt);
+
+        // Restore the lattice state of a previous run, continuing from the
+        // iteration it was saved at
+        if (!restart_file.empty()) {
+            loadCheckpoint(restart_file);
+        }
 
         // Dump data if needed
         if (dump_map) storeMap();
-        if (dump_data) storeData(0);
-        if (dump_f) storeF(f_collide, 0);
+        if (start_iteration == 0) {
+            if (dump_data) storeData(0);
+            if (diagnostics_every != 0) storeDiagnostics(0);
+            if (dump_f) storeF((streaming == STREAMING_AA ? f_stream : f_collide), 0);
+        }
+
+        // The initial velocity is also the one of the first iteration,
+        // computed from the same distributions: the first check only takes
+        // the velocity the next one is compared to.
+        if (tolerance > 0.0) {
+            has_reference = false;
+            CLUCheckErrorExit(queue.enqueueCopyBuffer(u, u_prev, 0, 0, u_size()), "enqueueCopyBuffer(u_prev)");
+        }
+
+        for (size_t it = start_iteration + 1; it <= iterations; ++it) {
+            // A launch of several iterations reads the buffer of its first
+            // one, and everything else is decided by its last one
+            const size_t first = it;
+            it = launchEnd(first);
+            const size_t steps = it - first + 1;
+
+            const bool is_store_data = (dump_data && (it % every == 0));
+            const bool is_diagnosed = (diagnostics_every != 0 && it % diagnostics_every == 0);
+            const bool is_checked = (tolerance > 0.0 && it % residual_every == 0);
+            const bool is_swap = (first % 2 == 0);
+            // The last iteration is always profiled to know when the
+            // simulation ends, and so are the ones that may be the last.
+            const bool is_profiled = ((first - 1) / profile_every != it / profile_every || it == iterations || is_checked);
+            const bool is_update_macro = (is_store_data || is_diagnosed || is_checked);
 
-        for (size_t it = 1; it <= iterations; ++it) {
             cl::Event compute_evt;
-            CLUCheckErrorExit(
-                queue.enqueueNDRangeKernel(compute_kernels[it - 1], cl::NullRange, gws, lws, nullptr, &compute_evt),
-                COMPUTE_KERNEL_NAME
-            );
-            events.emplace_back(COMPUTE_KERNEL_NAME, compute_evt);
+            if (local_lattice) {
+                // The launches of the local lattice are few, all are profiled
+                cl::Kernel & local_kernel = local_kernels[is_swap][is_update_macro];
+                try {
+                    local_kernel.setArg(7, static_cast<cl_int>(steps));
+                } catch (cl::Error err) {
+                    CLUErrorPrintExit(err);
+                }
+
+                CLUCheckErrorExit(
+                    queue.enqueueNDRangeKernel(local_kernel, cl::NullRange, localLatticeRange(), localLatticeRange(), nullptr, &compute_evt),
+                    COMPUTE_LOCAL_KERNEL_NAME
+                );
+                recordEvent(COMPUTE_LOCAL_KERNEL_NAME, compute_evt);
+            } else if (steps > 1) {
+                CLUCheckErrorExit(
+                    queue.enqueueNDRangeKernel(blocked_kernels[is_swap][is_update_macro], cl::NullRange, blockedRange(), lws, nullptr, (is_profiled ? &compute_evt : nullptr)),
+                    COMPUTE_BLOCKED_KERNEL_NAME
+                );
+                if (is_profiled) recordEvent(COMPUTE_BLOCKED_KERNEL_NAME, compute_evt);
+                blocked_iterations += steps;
+            } else if (interior_split) {
+                enqueueSplitIteration(is_swap, is_update_macro, is_profiled);
+            } else {
+                CLUCheckErrorExit(
+                    queue.enqueueNDRangeKernel(compute_kernels[is_swap][is_update_macro], cl::NullRange, computeRange(), localRange(), nullptr, (is_profiled ? &compute_evt : nullptr)),
+                    COMPUTE_KERNEL_NAME
+                );
+                if (is_profiled) recordEvent(COMPUTE_KERNEL_NAME, compute_evt);
+            }
+
+            // A launch writes the buffer its first iteration writes: after an
+            // even number of iterations, the buffers swap roles.
+            if (steps % 2 == 0) {
+                std::swap(f_stream, f_collide);
+                try {
+                    setAllComputeArgs();
+                } catch (cl::Error err) {
+                    CLUErrorPrintExit(err);
+                }
+            }
 
-            if (dump_data && (it != 0) && (it % every == 0)) {
+            if (is_store_data) {
                 storeData(it);
             }
 
+            if (is_diagnosed) {
+                storeDiagnostics(it);
+            }
+
+            // With in place streaming, after odd iterations the distributions
+            // are stored in the slots of the opposite directions
             if (dump_f) {
-                storeF(((it % 2 == 0) ? f_stream : f_collide), it);
+                storeF(((it % 2 == 0 || streaming == STREAMING_AA) ? f_stream : f_collide), it);
+            }
+
+            if (checkpoint_every != 0 && it % checkpoint_every == 0) {
+                storeCheckpoint(it);
+            }
+
+            if (is_checked && checkResidual(it)) {
+                if (dump_data && !is_store_data) storeData(it);
+                break;
             }
         }
     }
 
 
-    // Wait until the simulation completes.
+    // Wait until the simulation completes, including the output files still
+    // being written.
     void waitCompletion()
     {
         try {
@@ -529,6 +1977,14 @@ public:
         } catch (cl::Error err) {
             CLUErrorPrintExit(err);
         }
+
+        retireDiagnostics(true);
+
+        // The callbacks of completed transfers may not have run yet: their
+        // jobs are submitted to the writers only then
+        for (const pinned_slot & slot : data_slots) slot.wait();
+        for (const pinned_slot & slot : f_slots) slot.wait();
+        if (writers) writers->drain();
     }
 
 
@@ -548,48 +2004,103 @@ public:
     double totalTimeMS()
     {
         waitCompletion();
+        retireAllEvents();
 
-        const cl::Event start_evt = events.front().second;
-        const cl::Event end_evt = events.back().second;
-
-        return CLUEventsGetTime(start_evt, end_evt);
+        return (last_end - first_start) / 1000000.0;
     }
 
 
     // Awaits for the simulation completion and then return the time spent
     // (in milliseconds) by the simulation computation, including only the time
-    // experienced by initialize and compute kernels.
+    // experienced by compute kernels.
+    // When only a sample of the iterations is profiled, the time is estimated
+    // from the sampled ones.
     double kernelsTimeMS()
     {
         waitCompletion();
+        retireAllEvents();
 
-        double totalTime = 0.0;
-        for (const std::pair<std::string, cl::Event> & p : events) {
-            if (p.first == COMPUTE_KERNEL_NAME){
-                totalTime += CLUEventsGetTime(p.second, p.second);
-            }
+        // Every launch of the local lattice is profiled
+        if (local_lattice) {
+            return timings[COMPUTE_LOCAL_KERNEL_NAME].total;
+        }
+
+        // Each profiled iteration has an interior launch and the shell ones
+        if (interior_split) {
+            const timing_stats & interior = timings[COMPUTE_INTERIOR_KERNEL_NAME];
+            if (interior.count == 0) return 0.0;
+
+            return (interior.total + timings[COMPUTE_SHELL_NAME].total) * ((double)computed_iterations() / interior.count);
+        }
+
+        // Each launch of the blocked kernel computes block_steps iterations
+        const size_t blocked = std::min(blocked_iterations, computed_iterations());
+        double time = 0.0;
+
+        const timing_stats & compute = timings[COMPUTE_KERNEL_NAME];
+        if (compute.count != 0) {
+            time += compute.total * ((double)(computed_iterations() - blocked) / compute.count);
         }
 
-        return totalTime;
+        if (blocked != 0) {
+            const timing_stats & compute_blocked = timings[COMPUTE_BLOCKED_KERNEL_NAME];
+            if (compute_blocked.count != 0) {
+                time += compute_blocked.total * ((double)(blocked / block_steps) / compute_blocked.count);
+            }
+        }
+        return time;
     }
 
 
     // Awaits for the simulation completion and then return a vector of pairs
-    // containing the name of each kernel involved in the simulation and its
-    // time spent in the computation.
+    // containing the name of each kernel or transfer involved in the
+    // simulation and the total time spent by the profiled commands.
     std::vector< std::pair<std::string, double> > kernelsTimingsMS()
     {
         waitCompletion();
+        retireAllEvents();
+
+        std::vector< std::pair<std::string, double> > totals;
+        totals.reserve(timings.size());
+
+        for (const std::pair<const std::string, timing_stats> & p : timings) {
+            totals.emplace_back(p.first, p.second.total);
+        }
+        return totals;
+    }
 
-        std::vector< std::pair<std::string, double> > timings;
-        timings.reserve(events.size());
 
-        for (const std::pair<std::string, cl::Event> & p : events) {
-            const std::string name = p.first;
-            const double time = CLUEventsGetTime(p.second, p.second);
-            timings.emplace_back(name, time);
+    // Awaits for the simulation completion and then return a table with the
+    // statistics (in milliseconds) of each kernel or transfer involved in the
+    // simulation.
+    std::string timingsReport()
+    {
+        waitCompletion();
+        retireAllEvents();
+
+        std::stringstream report;
+        report << std::setw(12) << "name"   << " "
+               << std::setw(8)  << "count"  << " "
+               << std::setw(10) << "min"    << " "
+               << std::setw(10) << "max"    << " "
+               << std::setw(10) << "mean"   << " "
+               << std::setw(10) << "stddev" << " "
+               << std::setw(10) << "p50"    << " "
+               << std::setw(10) << "p99"    << "\n";
+
+        for (const std::pair<const std::string, timing_stats> & p : timings) {
+            const timing_stats & t = p.second;
+            report << std::setw(12) << p.first << " "
+                   << std::setw(8)  << t.count << " "
+                   << std::fixed << std::setprecision(4)
+                   << std::setw(10) << t.min              << " "
+                   << std::setw(10) << t.max              << " "
+                   << std::setw(10) << t.mean()           << " "
+                   << std::setw(10) << t.stddev()         << " "
+                   << std::setw(10) << t.percentile(50.0) << " "
+                   << std::setw(10) << t.percentile(99.0) << "\n";
         }
-        return timings;
+        return report.str();
     }
 
 
@@ -603,7 +2114,7 @@ public:
     //
     double MLUPS()
     {
-        return (wet_dim() * iterations) / (totalTimeMS() * 1000);
+        return (wet_dim() * computed_iterations()) / (totalTimeMS() * 1000);
     }
 
 
@@ -616,7 +2127,7 @@ public:
     //
     double kernelsMLUPS()
     {
-        return (wet_dim() * iterations) / (kernelsTimeMS() * 1000);
+        return (wet_dim() * computed_iterations()) / (kernelsTimeMS() * 1000);
     }
 
 
@@ -627,7 +2138,7 @@ public:
         std::cout << std::boolalpha
                   << "kernel options   = " << kernelOptionsStr()                          << "\n"
                   << "device           = " << dev_name                                    << "\n"
-                  << "dim              = " << dim                                         << "\n"
+                  << "size             = " << sizeStr()                                   << "\n"
                   << "viscosity        = " << viscosity                                   << "\n"
                   << "velocity         = " << velocity                                    << "\n"
                   << "Device Mem. (B)  = " << device_memory_size_b()                      << "\n"
@@ -639,9 +2150,41 @@ public:
                   << "precision        = " << prec                                        << "\n"
                   << "optimize         = " << optimize                                    << "\n"
                   << "every            = " << every                                       << "\n"
+                  << "profile every    = " << profile_every                               << "\n"
+                  << "writer threads   = " << writer_threads                              << "\n"
                   << "VTK PATH         = " << vtk_path                                    << "\n"
+                  << "VTK FORMAT       = " << vtkFormatStr()                              << "\n"
+                  << "VTK FLOAT32      = " << vtk_float32                                 << "\n"
                   << "DUMP F           = " << dump_f                                      << "\n"
-                  << "DUMP MAP         = " << dump_map                                    << "\n";
+                  << "DUMP MAP         = " << dump_map                                    << "\n"
+                  << "AUTOTUNE         = " << autotune                                    << "\n"
+                  << "AUTOTUNE CACHE   = " << autotune_cache                              << "\n"
+                  << "KERNEL CACHE     = " << kernel_cache                                << "\n"
+                  << "STREAMING        = " << lbmStreamingStr(streaming)                  << "\n"
+                  << "STORAGE          = " << lbmStorageStr(storage)                      << "\n"
+                  << "COLLISION        = " << lbmCollisionStr(collision)                  << "\n"
+                  << "GEOMETRY         = " << (procedural_geometry ? "procedural" : "map")  << "\n"
+                  << "SPARSE CELLS     = " << (sparse ? sparse_cells.cells.size() : 0)    << "\n"
+                  << "Z CELLS          = " << z_cells                                     << "\n"
+                  << "BLOCK STEPS      = " << block_steps                                 << "\n"
+                  << "LOCAL LATTICE    = " << local_lattice                               << "\n"
+                  << "INTERIOR SPLIT   = " << interior_split                              << "\n"
+                  << "DIAGNOSE EVERY   = " << diagnostics_every                           << "\n"
+                  << "TOLERANCE        = " << tolerance                                   << "\n"
+                  << "RESIDUAL EVERY   = " << residual_every                              << "\n"
+                  << "CHECKPOINT EVERY = " << checkpoint_every                            << "\n"
+                  << "RESTART FROM     = " << restart_file                                << "\n"
+                  << "ENSEMBLE         = " << members()                                   << "\n"
+                  << "HOST PTR         = " << host_ptr                                    << "\n"
+                  << "PIN THREADS      = " << pinned                                      << "\n"
+                  << "F_STREAM NODES   = " << placementStr(f_stream)                      << "\n"
+                  << "F_COLLIDE NODES  = " << placementStr(f_collide)                     << "\n";
+
+        for (size_t member = 0; member < ensemble.size(); ++member) {
+            std::cout << std::left << std::setw(17) << ("MEMBER " + std::to_string(member)) << std::right
+                      << "= viscosity " << ensemble[member].viscosity
+                      << ", velocity " << ensemble[member].velocity << "\n";
+        }
     }
 
 
@@ -653,7 +2196,7 @@ public:
         std::stringstream stat;
         stat << dev_name.c_str()                            << separator
              << prec                                        << separator
-             << dim                                         << separator
+             << sizeStr()                                   << separator
              << iterations                                  << separator
              << every                                       << separator
              << std::setw(3) << std::setfill('0') << lws[0] << ","
@@ -664,16 +2207,33 @@ public:
              << totalTimeMS()                               << separator
              << kernelsTimeMS()                             << separator
              << MLUPS()                                     << separator
-             << kernelsMLUPS()                              << "\n";
+             << kernelsMLUPS()                              << separator
+             << lbmStreamingStr(streaming)                  << separator
+             << lbmStorageStr(storage)                      << separator
+             << members()                                   << separator
+             << lbmCollisionStr(collision)                  << separator
+             << block_steps                                 << separator
+             << local_lattice                               << separator
+             << interior_split                              << "\n";
         return stat.str();
     }
 
 
     ~LBMCL()
     {
+        if (writers) {
+            waitCompletion();
+
+            for (pinned_slot & slot : data_slots) releaseSlot(slot);
+            for (pinned_slot & slot : f_slots) releaseSlot(slot);
+
+            try {
+                queue.finish();
+            } catch (cl::Error err) {
+                CLUErrorPrint(err);
+            }
+        }
+
         if (map_values != nullptr) delete[] map_values;
-        if (f_values   != nullptr) delete[] f_values;
-        if (rho_values != nullptr) delete[] rho_values;
-        if (u_values   != nullptr) delete[] u_values;
     }
 };
@@ -0,0 +1,1195 @@
+#pragma once
+
+#include <map>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common.h"
+#include "timing_stats.hpp"
+#include "lbm_output.hpp"
+#include "lbm_lattice.hpp"
+#include "lbm_checkpoint.hpp"
+#include "lbm_options.hpp"
+#include "lbm_diagnostics.hpp"
+#include "lbm_simd.hpp"
+#include "lbm_numa.hpp"
+
+
+#define CPU_INITIALIZE_NAME         "initialize"
+#define CPU_COMPUTE_NAME            "compute"
+#define CPU_COPY_F_NAME             "copy_f"
+#define CPU_COPY_DATA_NAME          "copy_data"
+#define CPU_STORE_CHECKPOINT_NAME   "store_checkpoint"
+#define CPU_LOAD_CHECKPOINT_NAME    "load_checkpoint"
+#define CPU_DIAGNOSTICS_NAME        "diagnostics"
+#define CPU_RESIDUAL_NAME           "residual"
+
+
+// Native engine running the simulation on the host CPU with OpenMP threads,
+// without an OpenCL runtime. It implements the same D3Q19 BGK lid driven
+// cavity of kernels.cl on the same CSoA layout, and exposes the same
+// interface of LBMCL.
+//
+// The lattice is processed one x row at a time: the row is loaded from the
+// CSoA buffer, collided in loops the compiler can vectorize, or with AVX2 or
+// AVX-512 vectors selected at run time (see lbm_simd.hpp), and then pushed
+// to the neighbouring rows.
+template <typename T>
+class LBMCPU
+{
+    static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value,
+                  "Only float or double data type is valid.");
+private:
+    typedef std::chrono::steady_clock clock;
+
+    size_t nx;
+    size_t ny;
+    size_t nz;
+    T viscosity;
+    T velocity;
+    size_t iterations;
+    size_t every;
+    std::string vtk_path;
+    size_t lws[3];
+    size_t stride;
+    bool optimize;
+    std::string dump_path;
+    bool dump_map;
+    bool dump_f;
+    size_t profile_every;
+    size_t writer_threads;
+
+    vtk_format vtk_fmt = VTK_ASCII;
+    bool vtk_float32 = false;
+    size_t checkpoint_every = 0;
+    size_t diagnostics_every = 0;
+    double tolerance = 0.0;
+    size_t residual_every = 100;
+    size_t converged_iteration = 0;  // 0 until the residual gets below tolerance
+    bool has_reference = false;      // true once a check stored the velocity of an iteration
+    std::string restart_file;
+    size_t start_iteration = 0;
+
+    bool dump_data = false;
+
+    size_t stride_div = 0;
+    size_t stride_mod = 0;
+    size_t num_threads = 1;
+    T inv_tau;
+    lbm_simd simd = SIMD_SCALAR;
+    bool pin_threads = false;
+    bool pinned = false;
+
+    // Placed on the NUMA nodes of the threads updating them, see firstTouch()
+    numa_vector<T> f_stream;
+    numa_vector<T> f_collide;
+    numa_vector<T> rho;
+    numa_vector<T> u;
+    numa_vector<T> u_prev;  // velocity at the previous residual check
+    numa_vector<map_t> map;
+
+    // Per thread buffers holding the row being computed
+    std::vector< std::vector<T> > row_buffers;
+
+    std::vector<T> data_buffers[OUTPUT_SLOTS];
+    std::vector<T> f_buffers[OUTPUT_SLOTS];
+    output_slot data_slots[OUTPUT_SLOTS];
+    output_slot f_slots[OUTPUT_SLOTS];
+    size_t next_data_slot = 0;
+    size_t next_f_slot = 0;
+    std::unique_ptr<writer_pool> writers;
+    diagnostics_log diagnostics_out;
+
+    std::map<std::string, timing_stats> timings;
+    clock::time_point first_start = clock::time_point::max();
+    clock::time_point last_end = clock::time_point::min();
+
+    inline size_t cells_dim() const { return (nx * ny * nz); }
+    inline size_t f_dim()   const { return (paddedCells(cells_dim(), stride) * Q); }
+    inline size_t u_dim()   const { return (cells_dim() * D); }
+    inline size_t rho_dim() const { return cells_dim(); }
+    inline size_t map_dim() const { return cells_dim(); }
+    inline size_t wet_dim() const { return (nx - 2) * (ny - 2) * (nz - 2); }
+
+    inline size_t f_size()   const { return f_dim()   * sizeof(T);  }
+    inline size_t u_size()   const { return u_dim()   * sizeof(T);  }
+    inline size_t rho_size() const { return rho_dim() * sizeof(T);  }
+    inline size_t map_size() const { return map_dim() * sizeof(map_t);}
+
+    // f, f_post, rho, ux, uy, uz and u2 of a row
+    inline size_t row_buffer_dim() const { return (2 * Q + 5) * nx; }
+
+    inline size_t memory_size_b() const
+    {
+        return f_size() * 2 + u_size() + rho_size() + map_size();
+    }
+
+
+    inline bool is_power_of_two(size_t x) const
+    {
+        return x && !(x & (x - 1));
+    }
+
+
+    inline size_t log2i(size_t x) const
+    {
+       size_t n;
+       for (n = 0; x > 1; x >>= 1, n++);
+       return n;
+    }
+
+
+    inline size_t previous_power_of_two(size_t x) const
+    {
+        x |= x >>  1;
+        x |= x >>  2;
+        x |= x >>  4;
+        x |= x >>  8;
+        x |= x >> 16;
+        x |= x >> 32;
+        x = x + 1;
+        return (x >> 1);
+    }
+
+
+    // Index of the q-th distribution of a cell in the CSoA layout.
+    inline size_t IDxyzq(size_t id, size_t q) const
+    {
+        return ((((id >> stride_div) * Q + q) << stride_div) + (id & stride_mod));
+    }
+
+
+    inline T equilibrium(T rho, T w, T eu, T u2) const
+    {
+        return (rho * w) * (T(1.0) + (T(3.0) * eu) + (T(4.5) * eu * eu) - (T(1.5) * u2));
+    }
+
+
+    // Same cell types of get_cell_type() in kernels.cl.
+    int cellType(size_t x, size_t y, size_t z) const
+    {
+        int cell_type = NONE;
+
+        if (x == 1)        cell_type |= LEFT;
+        if (x == (nx - 2)) cell_type |= RIGHT;
+        if (y == 1)        cell_type |= BOTTOM;
+        if (y == (ny - 2)) cell_type |= TOP;
+        if (z == 1)        cell_type |= BACK;
+        if (z == (nz - 2)) cell_type |= FRONT;
+
+        if (x == 0)        cell_type = WALL;
+        if (x == (nx - 1)) cell_type = WALL;
+        if (y == 0)        cell_type = WALL;
+        if (y == (ny - 1)) cell_type = WALL;
+        if (z == 0)        cell_type = WALL;
+        if (z == (nz - 1)) cell_type = WALL;
+
+        if (cell_type == (LEFT  | BACK | BOTTOM) ||
+            cell_type == (RIGHT | BACK | BOTTOM) ||
+            cell_type == (LEFT  | BACK | TOP   ) ||
+            cell_type == (RIGHT | BACK | TOP   ))
+        {
+            cell_type = CORNER;
+        }
+
+        if (cell_type == MOVING_BOUNDARY) cell_type |= MOVING;
+        if (cell_type & FACES)            cell_type |= BOUNDARY;
+        if (cell_type == NONE)            cell_type = FLUID;
+
+        return cell_type;
+    }
+
+
+    void recordTime(const std::string & name, clock::time_point start, clock::time_point end)
+    {
+        timings[name].add(std::chrono::duration<double, std::milli>(end - start).count());
+        first_start = std::min(first_start, start);
+        last_end    = std::max(last_end, end);
+    }
+
+
+    // Copies the q-th distribution of the cells of a row into values. The
+    // row is split in runs of cells contiguous in the CSoA layout.
+    void loadRow(const T * f, size_t row_id, size_t q, T * values) const
+    {
+        for (size_t x = 0; x < nx; ) {
+            const size_t id = row_id + x;
+            const size_t n = std::min(stride - (id & stride_mod), nx - x);
+            memcpy(values + x, f + IDxyzq(id, q), n * sizeof(T));
+            x += n;
+        }
+    }
+
+
+    // Copies count values into the q-th distribution of the cells of a row,
+    // starting from x_begin.
+    void storeRow(T * f, size_t row_id, size_t q, const T * values, size_t x_begin, size_t count) const
+    {
+        for (size_t k = 0; k < count; ) {
+            const size_t id = row_id + x_begin + k;
+            const size_t n = std::min(stride - (id & stride_mod), count - k);
+            memcpy(f + IDxyzq(id, q), values + k, n * sizeof(T));
+            k += n;
+        }
+    }
+
+
+    // Zeroes the lattice with the threads and the schedule of compute(), so
+    // that the pages of each row are placed on the NUMA node of the thread
+    // updating it. The rows of the walls and the padding of the last CSoA
+    // block are zeroed afterwards.
+    void firstTouch()
+    {
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (size_t z = 1; z < nz - 1; ++z) {
+            for (size_t y = 1; y < ny - 1; ++y) {
+                zeroCells(IDxyzDIM(0, y, z, nx, ny), nx);
+            }
+        }
+
+        for (size_t z = 0; z < nz; ++z) {
+            for (size_t y = 0; y < ny; ++y) {
+                if (z == 0 || z == nz - 1 || y == 0 || y == ny - 1) {
+                    zeroCells(IDxyzDIM(0, y, z, nx, ny), nx);
+                }
+            }
+        }
+
+        for (size_t id = cells_dim(); id < paddedCells(cells_dim(), stride); ++id) {
+            for (size_t q = 0; q < Q; ++q) {
+                f_stream[IDxyzq(id, q)]  = T(0.0);
+                f_collide[IDxyzq(id, q)] = T(0.0);
+            }
+        }
+    }
+
+
+    void zeroCells(size_t first, size_t count)
+    {
+        const size_t cells = cells_dim();
+        for (size_t id = first; id < first + count; ++id) {
+            for (size_t q = 0; q < Q; ++q) {
+                f_stream[IDxyzq(id, q)]  = T(0.0);
+                f_collide[IDxyzq(id, q)] = T(0.0);
+            }
+            rho[id]               = T(0.0);
+            u[IDuxDIM(id, cells)] = T(0.0);
+            u[IDuyDIM(id, cells)] = T(0.0);
+            u[IDuzDIM(id, cells)] = T(0.0);
+            map[id]               = NONE;
+        }
+    }
+
+
+    void initialize()
+    {
+        const T nan = std::numeric_limits<T>::quiet_NaN();
+        const size_t cells = cells_dim();
+
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (size_t z = 0; z < nz; ++z) {
+            for (size_t y = 0; y < ny; ++y) {
+                for (size_t x = 0; x < nx; ++x) {
+                    const size_t id = IDxyzDIM(x, y, z, nx, ny);
+                    const int cell_type = cellType(x, y, z);
+
+                    map[id] = static_cast<map_t>(cell_type & MAP_MASK);
+
+                    const T density = T(1.0);
+                    const T ux = (is_moving_init(cell_type) ? velocity : T(0.0));
+                    const T uy = T(0.0);
+                    const T uz = T(0.0);
+
+                    rho[id]               = (is_store_macro(cell_type) ? density : nan);
+                    u[IDuxDIM(id, cells)] = (is_store_macro(cell_type) ? ux : nan);
+                    u[IDuyDIM(id, cells)] = (is_store_macro(cell_type) ? uy : nan);
+                    u[IDuzDIM(id, cells)] = (is_store_macro(cell_type) ? uz : nan);
+
+                    const T u2 = (ux * ux) + (uy * uy) + (uz * uz);
+                    for (size_t q = 0; q < Q; ++q) {
+                        const T eu = (ux * d3q19_ex[q]) + (uy * d3q19_ey[q]) + (uz * d3q19_ez[q]);
+                        const T fq = (is_wall(cell_type) ? nan : equilibrium(density, T(d3q19_w[q]), eu, u2));
+                        f_collide[IDxyzq(id, q)] = fq;
+                        f_stream[IDxyzq(id, q)]  = fq;
+                    }
+                }
+            }
+        }
+    }
+
+
+    // Collides the cells of the row (y, z) read from f_in and pushes them
+    // into f_out, as the compute kernel does for each cell. The cells are
+    // first collided with the vectors of simd, the loops over the remaining
+    // ones are branch free, so that they are vectorized.
+    void computeRow(const T * f_in, T * f_out, size_t y, size_t z, bool update_macro, T * buffer)
+    {
+        const size_t n = nx;
+        const size_t cells = cells_dim();
+        const size_t row_id = IDxyzDIM(0, y, z, nx, ny);
+        const map_t * types = map.data() + row_id;
+        const T lid_velocity = velocity;
+        const T omega = inv_tau;
+
+        T * f      = buffer;
+        T * f_post = f + Q * n;
+        T * r      = f_post + Q * n;
+        T * ux     = r + n;
+        T * uy     = ux + n;
+        T * uz     = uy + n;
+        T * u2     = uz + n;
+
+        for (size_t q = 0; q < Q; ++q) {
+            loadRow(f_in, row_id, q, f + q * n);
+        }
+
+        const simd_row<T> vector_row = {types, f, f_post, r, ux, uy, uz, n, lid_velocity, omega};
+        const size_t x_begin = collideRowSimd(simd, vector_row);
+
+        for (int q : d3q19_moving_unknowns) {
+            T * fq = f + q * n;
+            const T * fs = f + d3q19_s[q] * n;
+            #pragma omp simd
+            for (size_t x = x_begin; x < n; ++x) {
+                const T unknown = fs[x];
+                fq[x] = (is_moving(types[x]) ? unknown : fq[x]);
+            }
+        }
+
+        /***   Compute Macro quantities (rho & u)   ***/
+        #pragma omp simd
+        for (size_t x = x_begin; x < n; ++x) {
+            r[x] = f[x];
+        }
+        for (size_t q = 1; q < Q; ++q) {
+            const T * fq = f + q * n;
+            #pragma omp simd
+            for (size_t x = x_begin; x < n; ++x) {
+                r[x] += fq[x];
+            }
+        }
+
+#define FQ(q) f[(q) * n + x]
+        #pragma omp simd
+        for (size_t x = x_begin; x < n; ++x) {
+            const bool moving = is_moving(types[x]);
+            const T vx = ((FQ( 1) + FQ( 7) + FQ(10) + FQ(11) + FQ(15)) - (FQ( 3) + FQ( 8) + FQ( 9) + FQ(13) + FQ(17))) / r[x];
+            const T vy = ((FQ( 2) + FQ( 7) + FQ( 8) + FQ(12) + FQ(16)) - (FQ( 4) + FQ( 9) + FQ(10) + FQ(14) + FQ(18))) / r[x];
+            const T vz = ((FQ( 6) + FQ(15) + FQ(16) + FQ(17) + FQ(18)) - (FQ( 5) + FQ(11) + FQ(12) + FQ(13) + FQ(14))) / r[x];
+            const T cell_ux = (moving ? lid_velocity : vx);
+            const T cell_uy = (moving ? T(0.0) : vy);
+            const T cell_uz = (moving ? T(0.0) : vz);
+            ux[x] = cell_ux;
+            uy[x] = cell_uy;
+            uz[x] = cell_uz;
+            u2[x] = (cell_ux * cell_ux) + (cell_uy * cell_uy) + (cell_uz * cell_uz);
+        }
+#undef FQ
+
+        /***   Store macro quantities (rho & u)   ***/
+        if (update_macro) {
+            T * rho_row = rho.data() + row_id;
+            T * ux_row  = u.data() + IDuxDIM(row_id, cells);
+            T * uy_row  = u.data() + IDuyDIM(row_id, cells);
+            T * uz_row  = u.data() + IDuzDIM(row_id, cells);
+            for (size_t x = 0; x < n; ++x) {
+                if (is_store_macro(types[x])) {
+                    rho_row[x] = r[x];
+                    ux_row[x]  = ux[x];
+                    uy_row[x]  = uy[x];
+                    uz_row[x]  = uz[x];
+                }
+            }
+        }
+
+        /***   Boundary Conditions & Collision   ***/
+        for (size_t q = 0; q < Q; ++q) {
+            const T ex = T(d3q19_ex[q]);
+            const T ey = T(d3q19_ey[q]);
+            const T ez = T(d3q19_ez[q]);
+            const T w  = T(d3q19_w[q]);
+            const T * fq = f + q * n;
+            const T * fs = f + d3q19_s[q] * n;
+            T * fp = f_post + q * n;
+
+            #pragma omp simd
+            for (size_t x = x_begin; x < n; ++x) {
+                const int cell_type = types[x];
+                const T eu = (ux[x] * ex) + (uy[x] * ey) + (uz[x] * ez);
+                const T f_eq = equilibrium(r[x], w, eu, u2[x]);
+                const T f_in_q = fq[x];
+                const T f_opposite = fs[x];
+
+                const T value = (is_bounceback(cell_type) ? f_opposite : f_in_q);
+                const T collided = (is_moving(cell_type) ? f_eq : value + omega * (f_eq - value));
+                fp[x] = (is_collision(cell_type) ? collided : value);
+            }
+        }
+
+        /***   Streaming (walls at x = 0 and x = nx - 1 are skipped)   ***/
+        for (size_t q = 0; q < Q; ++q) {
+            const size_t y_to = y + d3q19_ey[q];
+            const size_t z_to = z + d3q19_ez[q];
+            storeRow(f_out, IDxyzDIM(0, y_to, z_to, nx, ny), q, f_post + q * n + 1, 1 + d3q19_ex[q], n - 2);
+        }
+    }
+
+
+    // One iteration over the whole lattice. Rows made only of walls are
+    // skipped, as wall cells are never collided nor streamed.
+    void compute(const T * f_in, T * f_out, bool update_macro)
+    {
+        #pragma omp parallel
+        {
+#ifdef _OPENMP
+            T * buffer = row_buffers[omp_get_thread_num()].data();
+#else
+            T * buffer = row_buffers[0].data();
+#endif
+            #pragma omp for collapse(2) schedule(static)
+            for (size_t z = 1; z < nz - 1; ++z) {
+                for (size_t y = 1; y < ny - 1; ++y) {
+                    computeRow(f_in, f_out, y, z, update_macro, buffer);
+                }
+            }
+        }
+    }
+
+
+    // Number of iterations actually computed by this run.
+    inline size_t computed_iterations() const
+    {
+        return (converged_iteration != 0 ? converged_iteration : iterations) - start_iteration;
+    }
+
+
+    // Buffers saved in checkpoints, in the same order of LBMCL.
+    std::vector< std::pair<void *, size_t> > checkpointBuffers()
+    {
+        return {
+            {f_stream.data(),  f_size()},
+            {f_collide.data(), f_size()},
+            {rho.data(),       rho_size()},
+            {u.data(),         u_size()},
+            {map.data(),       map_size()}
+        };
+    }
+
+
+    void storeCheckpoint(size_t iteration)
+    {
+        const clock::time_point start = clock::now();
+
+        std::vector< std::pair<const void *, size_t> > sections;
+        for (const std::pair<void *, size_t> & b : checkpointBuffers()) {
+            sections.emplace_back(b.first, b.second);
+        }
+
+        checkpoint_header header;
+        header.real_size = sizeof(T);
+        header.nx = nx;
+        header.ny = ny;
+        header.nz = nz;
+        header.stride = stride;
+        header.iteration = iteration;
+        header.layout = lbmLayout(STREAMING_PUSH, STORAGE_REAL, false);
+
+        std::stringstream filenameBuilder;
+        filenameBuilder << dump_path << "/lbmcl." << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".ckp";
+        writeCheckpoint(filenameBuilder.str(), header, sections);
+
+        recordTime(CPU_STORE_CHECKPOINT_NAME, start, clock::now());
+    }
+
+
+    void loadCheckpoint(const std::string & filename)
+    {
+        const clock::time_point start = clock::now();
+
+        checkpoint_file checkpoint(filename);
+        std::vector< std::pair<void *, size_t> > buffers = checkpointBuffers();
+
+        std::vector<size_t> sizes;
+        for (const std::pair<void *, size_t> & b : buffers) sizes.push_back(b.second);
+        checkpoint.validate(sizeof(T), nx, ny, nz, stride, lbmLayout(STREAMING_PUSH, STORAGE_REAL, false), iterations, sizes);
+
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            memcpy(buffers[i].first, checkpoint.section(i), buffers[i].second);
+        }
+
+        start_iteration = checkpoint.header().iteration;
+        recordTime(CPU_LOAD_CHECKPOINT_NAME, start, clock::now());
+    }
+
+
+    std::string vtkFormatStr() const
+    {
+        switch (vtk_fmt) {
+            case VTK_BINARY: return "binary";
+            case VTK_ZLIB:   return "zlib";
+            default:         return "ascii";
+        }
+    }
+
+
+    std::string cpuName() const
+    {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 10, "model name") == 0) {
+                const size_t colon = line.find(':');
+                if (colon != std::string::npos && colon + 2 <= line.size()) {
+                    return line.substr(colon + 2);
+                }
+            }
+        }
+        return "CPU";
+    }
+
+
+    output_slot & acquireSlot(output_slot * slots, size_t & next)
+    {
+        output_slot & slot = slots[next];
+        next = (next + 1) % OUTPUT_SLOTS;
+        slot.acquire();
+        return slot;
+    }
+
+
+    void storeMap()
+    {
+        writeMap(dump_path + "/map.dump", map.data(), nx, ny, nz);
+    }
+
+
+    void storeF(const numa_vector<T> & f, size_t iteration)
+    {
+        output_slot & slot = acquireSlot(f_slots, next_f_slot);
+        T * f_values = static_cast<T *>(slot.host_ptr);
+
+        const clock::time_point start = clock::now();
+        std::copy(f.begin(), f.end(), f_values);
+        recordTime(CPU_COPY_F_NAME, start, clock::now());
+
+        std::stringstream filenameBuilder;
+        filenameBuilder << dump_path << "/f_" << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".dump";
+
+        const std::string filename = filenameBuilder.str();
+        const size_t nx = this->nx;
+        const size_t ny = this->ny;
+        const size_t nz = this->nz;
+        const size_t stride = this->stride;
+        slot.job = [filename, f_values, nx, ny, nz, stride]() {
+            writeF(filename, f_values, nx, ny, nz, stride);
+        };
+        slot.submit();
+    }
+
+
+    void storeData(size_t iteration)
+    {
+        output_slot & slot = acquireSlot(data_slots, next_data_slot);
+        T * rho_values = static_cast<T *>(slot.host_ptr);
+        T * u_values = rho_values + rho_dim();
+
+        const clock::time_point start = clock::now();
+        std::copy(rho.begin(), rho.end(), rho_values);
+        std::copy(u.begin(), u.end(), u_values);
+        recordTime(CPU_COPY_DATA_NAME, start, clock::now());
+
+        std::stringstream filenameBuilder;
+        filenameBuilder << vtk_path << "/lbmcl." << std::setw(DIGITS(iterations)) << std::setfill('0') << iteration << ".vti";
+
+        const std::string filename = filenameBuilder.str();
+        const size_t nx = this->nx;
+        const size_t ny = this->ny;
+        const size_t nz = this->nz;
+        const vtk_format format = vtk_fmt;
+        const bool float32 = vtk_float32;
+        slot.job = [filename, rho_values, u_values, nx, ny, nz, format, float32]() {
+            writeVTI(filename, rho_values, u_values, nx, ny, nz, format, float32);
+        };
+        slot.submit();
+    }
+
+
+    // Same diagnostics of the reductions of LBMCL, computed by the threads.
+    void storeDiagnostics(size_t iteration)
+    {
+        const clock::time_point start = clock::now();
+        T values[DIAGNOSTICS];
+        computeDiagnostics(rho.data(), u.data(), map.data(), nx, ny, nz, values);
+        recordTime(CPU_DIAGNOSTICS_NAME, start, clock::now());
+
+        diagnostics_out.append(iteration, values);
+    }
+
+
+    // Same residual check of LBMCL, computed by the threads.
+    bool checkResidual(size_t iteration)
+    {
+        const clock::time_point start = clock::now();
+        T values[DIAGNOSTICS];
+        computeResidual(u.data(), u_prev.data(), map.data(), cells_dim(), values);
+        recordTime(CPU_RESIDUAL_NAME, start, clock::now());
+
+        if (!has_reference) {
+            has_reference = true;
+            return false;
+        }
+
+        const double residual = relativeResidual(values);
+        if (!(residual < tolerance)) return false;
+
+        converged_iteration = iteration;
+        std::cout << "Converged at iteration " << iteration
+                  << ": residual " << residual
+                  << ", max |du| " << values[RESIDUAL_MAX_DU] << std::endl;
+        return true;
+    }
+
+
+public:
+    LBMCPU(size_t nx,
+           size_t ny,
+           size_t nz,
+           T viscosity,
+           T velocity,
+           size_t iterations,
+           size_t every,
+           std::string vtk_path = "",
+           size_t lwx = 1,
+           size_t lwy = 1,
+           size_t lwz = 1,
+           size_t stride = 32,
+           bool optimize = true,
+           std::string dump_path = "",
+           bool dump_map = false,
+           bool dump_f = false,
+           size_t profile_every = 1,
+           size_t writer_threads = 2)
+        : nx(nx),
+          ny(ny),
+          nz(nz),
+          viscosity(viscosity),
+          velocity(velocity),
+          iterations(iterations),
+          every(every),
+          vtk_path(vtk_path),
+          lws{lwx, lwy, lwz},
+          stride(stride),
+          optimize(optimize),
+          dump_path(dump_path),
+          dump_map(dump_map),
+          dump_f(dump_f),
+          profile_every(profile_every),
+          writer_threads(writer_threads)
+    {
+        dump_data = (every != 0);
+
+        if (this->profile_every == 0) this->profile_every = 1;
+
+        if (!is_power_of_two(this->stride)) {
+            this->stride = previous_power_of_two(this->stride);
+            std::cout << "stride is rounded to the previous power of 2: " << this->stride << std::endl;
+        }
+
+        stride_div = log2i(this->stride);
+        stride_mod = this->stride - 1;
+        inv_tau = T(1.0) / ((T(3.0) * this->viscosity) + T(0.5));
+    }
+
+
+    // Set the encoding of VTI files. If float32 is true, binary formats store
+    // Float32 values even for double precision simulations.
+    // Must be called before setupSimulation().
+    void setOutputFormat(vtk_format format, bool float32)
+    {
+        vtk_fmt = format;
+        vtk_float32 = float32;
+    }
+
+
+    // Store a checkpoint of the whole lattice state every N iterations
+    // (0 disables checkpoints) and optionally restart the simulation from a
+    // checkpoint file. Must be called before setupSimulation().
+    void setCheckpoint(size_t every, const std::string & restart)
+    {
+        checkpoint_every = every;
+        restart_file = restart;
+    }
+
+
+    // The launch configuration of OpenCL devices does not apply to the host
+    // threads: nothing to tune.
+    void setAutotune(bool, const std::string &, bool)
+    {
+    }
+
+
+    // No kernels are built at run time.
+    void setKernelCache(const std::string &)
+    {
+    }
+
+
+    // Rows are streamed from a lattice copy to the other one: in place
+    // streaming is not available.
+    void setStreaming(lbm_streaming mode)
+    {
+        if (mode != STREAMING_PUSH) {
+            std::cerr << "The cpu engine supports only push streaming" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // The rows read the types of their cells from the map.
+    void setProceduralGeometry(bool procedural)
+    {
+        if (procedural) {
+            std::cerr << "The cpu engine does not support the procedural geometry" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // Rows cover the whole lattice, the walls are skipped by their types.
+    void setSparse(bool sparse)
+    {
+        if (sparse) {
+            std::cerr << "The cpu engine does not support the sparse lattice" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // Rows already reuse the index of their cells: there is nothing to march.
+    void setZCells(size_t count)
+    {
+        if (count > 1) {
+            std::cerr << "The cpu engine does not support the z-marching kernel" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // The lattice of each thread stays in its caches only for a few rows:
+    // every iteration streams the whole lattice, as without blocking.
+    void setBlockSteps(size_t count)
+    {
+        if (count > 1) {
+            std::cerr << "The cpu engine does not support temporal blocking" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // There are no launches to save: the threads already run the iterations.
+    void setLocalLattice(bool enable)
+    {
+        if (enable) {
+            std::cerr << "The cpu engine does not support the local lattice" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // The rows are already branch free, each cell selects its boundary
+    // condition in the vectorized loops of computeRow().
+    void setInteriorSplit(bool enable)
+    {
+        if (enable) {
+            std::cerr << "The cpu engine does not support the interior split" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // Pin each thread to a CPU, so that it stays on the NUMA node of the rows
+    // it placed. Must be called before setupSimulation().
+    void setPinThreads(bool enable)
+    {
+        pin_threads = enable;
+    }
+
+
+    // Set the vectors colliding the rows, auto selects the widest ones the
+    // CPU supports. Must be called before setupSimulation().
+    void setSimd(lbm_simd requested)
+    {
+        if (!simdSupported(requested)) {
+            std::cerr << "The CPU does not support " << lbmSimdStr(requested) << " vectors" << std::endl;
+            exit(1);
+        }
+        simd = resolveSimd(requested);
+    }
+
+
+    // The lattice copies are stored with the precision of the simulation.
+    void setStorage(lbm_storage storage)
+    {
+        if (storage != STORAGE_REAL) {
+            std::cerr << "The cpu engine supports only real storage" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // The lattice is updated with the BGK operator only.
+    void setCollision(lbm_collision collision)
+    {
+        if (collision != COLLISION_BGK) {
+            std::cerr << "The cpu engine supports only the bgk collision" << std::endl;
+            exit(1);
+        }
+    }
+
+
+    // A single member sets the parameters of the lattice. Ensembles of
+    // several lattices run only on the OpenCL kernels.
+    // Must be called before setupSimulation().
+    void setEnsemble(const std::vector<ensemble_member> & members)
+    {
+        if (members.size() > 1) {
+            std::cerr << "The cpu engine supports only a single lattice" << std::endl;
+            exit(1);
+        }
+        if (members.size() == 1) {
+            viscosity = T(members[0].viscosity);
+            velocity = T(members[0].velocity);
+            inv_tau = T(1.0) / ((T(3.0) * viscosity) + T(0.5));
+        }
+    }
+
+
+    // Compute total mass, kinetic energy, maximum velocity and enstrophy
+    // every the given iterations, 0 disables them. They are appended to
+    // dump_path/diagnostics.csv.
+    // Must be called before setupSimulation().
+    void setDiagnostics(size_t every)
+    {
+        diagnostics_every = every;
+    }
+
+
+    // Stop the simulation once the relative L2 norm of the change of the
+    // velocity, checked every the given iterations, is below tolerance.
+    // Must be called before setupSimulation().
+    void setTolerance(double tolerance, size_t every)
+    {
+        this->tolerance = tolerance;
+        residual_every = (every == 0 ? 1 : every);
+    }
+
+
+    // Allocates the lattice and the buffers used for output. Platform and
+    // device are ignored: the simulation runs on the threads of the host.
+    void setupSimulation(int, int)
+    {
+#ifdef _OPENMP
+        num_threads = omp_get_max_threads();
+#endif
+
+        if (pin_threads) {
+            pinned = pinThreads();
+            if (!pinned) std::cerr << "Unable to pin the threads, they are placed by the system" << std::endl;
+        }
+
+        f_stream.resize(f_dim());
+        f_collide.resize(f_dim());
+        rho.resize(rho_dim());
+        u.resize(u_dim());
+        map.resize(map_dim());
+        firstTouch();
+
+        // Each thread allocates its own row buffer, on its NUMA node
+        row_buffers.resize(num_threads);
+        #pragma omp parallel
+        {
+#ifdef _OPENMP
+            row_buffers[omp_get_thread_num()].assign(row_buffer_dim(), T(0.0));
+#else
+            row_buffers[0].assign(row_buffer_dim(), T(0.0));
+#endif
+        }
+
+        if (dump_data || dump_f) {
+            writers.reset(new writer_pool(writer_threads, OUTPUT_SLOTS * 2));
+        }
+
+        for (size_t i = 0; i < OUTPUT_SLOTS; ++i) {
+            if (dump_f) {
+                f_buffers[i].resize(f_dim());
+                f_slots[i].host_ptr = f_buffers[i].data();
+                f_slots[i].writers = writers.get();
+            }
+
+            if (dump_data) {
+                data_buffers[i].resize(rho_dim() + u_dim());
+                data_slots[i].host_ptr = data_buffers[i].data();
+                data_slots[i].writers = writers.get();
+            }
+        }
+
+        if (diagnostics_every != 0) {
+            diagnostics_out.open(dump_path + "/" + DIAGNOSTICS_FILE + DIAGNOSTICS_EXTENSION);
+        }
+    }
+
+
+    // Performs the whole simulation. Output files may still be written by
+    // the writers once this function returns; see waitCompletion().
+    void performSimulation()
+    {
+        // Initialize the simulation
+        clock::time_point start = clock::now();
+        initialize();
+        recordTime(CPU_INITIALIZE_NAME, start, clock::now());
+
+        // Restore the lattice state of a previous run, continuing from the
+        // iteration it was saved at
+        if (!restart_file.empty()) {
+            loadCheckpoint(restart_file);
+        }
+
+        // Dump data if needed
+        if (dump_map) storeMap();
+        if (start_iteration == 0) {
+            if (dump_data) storeData(0);
+            if (diagnostics_every != 0) storeDiagnostics(0);
+            if (dump_f) storeF(f_collide, 0);
+        }
+
+        // The initial velocity is also the one of the first iteration,
+        // computed from the same distributions: the first check only takes
+        // the velocity the next one is compared to.
+        if (tolerance > 0.0) {
+            has_reference = false;
+            u_prev = u;
+        }
+
+        for (size_t it = start_iteration + 1; it <= iterations; ++it) {
+            const bool is_store_data = (dump_data && (it % every == 0));
+            const bool is_diagnosed = (diagnostics_every != 0 && it % diagnostics_every == 0);
+            const bool is_checked = (tolerance > 0.0 && it % residual_every == 0);
+            const bool is_swap = (it % 2 == 0);
+            // The last iteration is always profiled to know when the
+            // simulation ends, and so are the ones that may be the last.
+            const bool is_profiled = (it % profile_every == 0 || it == iterations || is_checked);
+
+            start = clock::now();
+            if (is_swap) {
+                compute(f_stream.data(), f_collide.data(), is_store_data || is_diagnosed || is_checked);
+            } else {
+                compute(f_collide.data(), f_stream.data(), is_store_data || is_diagnosed || is_checked);
+            }
+            if (is_profiled) recordTime(CPU_COMPUTE_NAME, start, clock::now());
+
+            if (is_store_data) {
+                storeData(it);
+            }
+
+            if (is_diagnosed) {
+                storeDiagnostics(it);
+            }
+
+            if (dump_f) {
+                storeF(((it % 2 == 0) ? f_stream : f_collide), it);
+            }
+
+            if (checkpoint_every != 0 && it % checkpoint_every == 0) {
+                storeCheckpoint(it);
+            }
+
+            if (is_checked && checkResidual(it)) {
+                if (dump_data && !is_store_data) storeData(it);
+                break;
+            }
+        }
+    }
+
+
+    // Wait until the output files still being written are stored.
+    void waitCompletion()
+    {
+        if (writers) writers->drain();
+    }
+
+
+    void performSimulationAndWait()
+    {
+        performSimulation();
+        waitCompletion();
+    }
+
+
+    // Time spent (in milliseconds) by the simulation, including
+    // initialization, computation and the copies of the output data.
+    double totalTimeMS()
+    {
+        waitCompletion();
+        if (timings.empty()) return 0.0;
+
+        return std::chrono::duration<double, std::milli>(last_end - first_start).count();
+    }
+
+
+    // Time spent (in milliseconds) by the computation only. When only a
+    // sample of the iterations is profiled, the time is estimated from the
+    // sampled ones.
+    double kernelsTimeMS()
+    {
+        waitCompletion();
+
+        const timing_stats & compute = timings[CPU_COMPUTE_NAME];
+        if (compute.count == 0) return 0.0;
+
+        return compute.total * ((double)computed_iterations() / compute.count);
+    }
+
+
+    std::vector< std::pair<std::string, double> > kernelsTimingsMS()
+    {
+        waitCompletion();
+
+        std::vector< std::pair<std::string, double> > totals;
+        totals.reserve(timings.size());
+
+        for (const std::pair<const std::string, timing_stats> & p : timings) {
+            totals.emplace_back(p.first, p.second.total);
+        }
+        return totals;
+    }
+
+
+    std::string timingsReport()
+    {
+        waitCompletion();
+
+        std::stringstream report;
+        report << std::setw(16) << "name"   << " "
+               << std::setw(8)  << "count"  << " "
+               << std::setw(10) << "min"    << " "
+               << std::setw(10) << "max"    << " "
+               << std::setw(10) << "mean"   << " "
+               << std::setw(10) << "stddev" << " "
+               << std::setw(10) << "p50"    << " "
+               << std::setw(10) << "p99"    << "\n";
+
+        for (const std::pair<const std::string, timing_stats> & p : timings) {
+            const timing_stats & t = p.second;
+            report << std::setw(16) << p.first << " "
+                   << std::setw(8)  << t.count << " "
+                   << std::fixed << std::setprecision(4)
+                   << std::setw(10) << t.min              << " "
+                   << std::setw(10) << t.max              << " "
+                   << std::setw(10) << t.mean()           << " "
+                   << std::setw(10) << t.stddev()         << " "
+                   << std::setw(10) << t.percentile(50.0) << " "
+                   << std::setw(10) << t.percentile(99.0) << "\n";
+        }
+        return report.str();
+    }
+
+
+    double MLUPS()
+    {
+        return (wet_dim() * computed_iterations()) / (totalTimeMS() * 1000);
+    }
+
+
+    double kernelsMLUPS()
+    {
+        return (wet_dim() * computed_iterations()) / (kernelsTimeMS() * 1000);
+    }
+
+
+    void printConfiguration()
+    {
+        const std::string prec = (std::is_same<T, float>::value ? "single" : "double");
+        std::cout << std::boolalpha
+                  << "engine           = cpu"                                             << "\n"
+                  << "device           = " << cpuName()                                   << "\n"
+                  << "threads          = " << num_threads                                 << "\n"
+                  << "size             = " << nx << "x" << ny << "x" << nz                << "\n"
+                  << "viscosity        = " << viscosity                                   << "\n"
+                  << "velocity         = " << velocity                                    << "\n"
+                  << "Host Mem. (B)    = " << memory_size_b()                             << "\n"
+                  << "Host Mem. (KB)   = " << memory_size_b() / (1 << 10)                 << "\n"
+                  << "Host Mem. (MB)   = " << memory_size_b() / (1 << 20)                 << "\n"
+                  << "iterations       = " << iterations                                  << "\n"
+                  << "stride           = " << stride                                      << "\n"
+                  << "precision        = " << prec                                        << "\n"
+                  << "SIMD             = " << lbmSimdStr(simd)                            << "\n"
+                  << "every            = " << every                                       << "\n"
+                  << "profile every    = " << profile_every                               << "\n"
+                  << "writer threads   = " << writer_threads                              << "\n"
+                  << "VTK PATH         = " << vtk_path                                    << "\n"
+                  << "VTK FORMAT       = " << vtkFormatStr()                              << "\n"
+                  << "VTK FLOAT32      = " << vtk_float32                                 << "\n"
+                  << "DUMP F           = " << dump_f                                      << "\n"
+                  << "DUMP MAP         = " << dump_map                                    << "\n"
+                  << "CHECKPOINT EVERY = " << checkpoint_every                            << "\n"
+                  << "DIAGNOSE EVERY   = " << diagnostics_every                           << "\n"
+                  << "TOLERANCE        = " << tolerance                                   << "\n"
+                  << "RESIDUAL EVERY   = " << residual_every                              << "\n"
+                  << "RESTART FROM     = " << restart_file                                << "\n"
+                  << "PIN THREADS      = " << pinned                                      << "\n"
+                  << "THREAD NODES     = " << threadPlacement()                           << "\n"
+                  << "F_STREAM NODES   = " << pagePlacement(f_stream.data(), f_size())    << "\n"
+                  << "F_COLLIDE NODES  = " << pagePlacement(f_collide.data(), f_size())   << "\n";
+    }
+
+
+    // Same columns of LBMCL::statistics(), the work group size is the one
+    // given to the constructor.
+    std::string statistics(char separator)
+    {
+        const std::string prec = (std::is_same<T, float>::value ? "single" : "double");
+
+        std::stringstream stat;
+        stat << cpuName()                                   << separator
+             << prec                                        << separator
+             << nx << "x" << ny << "x" << nz                << separator
+             << iterations                                  << separator
+             << every                                       << separator
+             << std::setw(3) << std::setfill('0') << lws[0] << ","
+             << std::setw(3) << std::setfill('0') << lws[1] << ","
+             << std::setw(3) << std::setfill('0') << lws[2] << separator
+             << stride                                      << separator
+             << optimize                                    << separator
+             << totalTimeMS()                               << separator
+             << kernelsTimeMS()                             << separator
+             << MLUPS()                                     << separator
+             << kernelsMLUPS()                              << separator
+             << lbmStreamingStr(STREAMING_PUSH)             << separator
+             << lbmStorageStr(STORAGE_REAL)                 << separator
+             << 1                                           << separator
+             << lbmCollisionStr(COLLISION_BGK)              << separator
+             << 1                                           << separator
+             << false                                       << separator
+             << false                                       << "\n";
+        return stat.str();
+    }
+
+
+    ~LBMCPU()
+    {
+        waitCompletion();
+    }
+};
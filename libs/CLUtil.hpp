@@ -12,7 +12,12 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
 #include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 static inline const char * cl_get_error_string(cl_int err) {
@@ -228,6 +233,118 @@ static inline void CLUBuildProgram(cl::Program & program,
     }
 }
 
+// 64 bit FNV-1a hash of data, starting from the given hash.
+static inline uint64_t CLUHash(const std::string & data,
+                               uint64_t hash = 14695981039346656037ULL)
+{
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Same as CLUBuildProgram, but the program binary is cached in cacheDir and
+// loaded from there when the kernel source (with the files it includes), the
+// build options, the device and the driver version did not change. Binaries
+// rejected by the driver are rebuilt from source. An empty cacheDir disables
+// the cache.
+static inline void CLUBuildProgramCached(cl::Program & program,
+                                         const cl::Context & context,
+                                         const cl::Device & device,
+                                         const std::string & filename,
+                                         const std::string & options,
+                                         const std::string & cacheDir,
+                                         const bool printBuildLog = false)
+{
+    if (cacheDir.empty()) {
+        CLUBuildProgram(program, context, device, filename, options, printBuildLog);
+        return;
+    }
+
+    std::string binary_filename;
+    try {
+        // Sources are included with "-I.", like common.h
+        std::ifstream streamSourcecode(filename);
+        std::string line;
+        uint64_t hash = CLUHash(options);
+        while (std::getline(streamSourcecode, line)) {
+            hash = CLUHash(line + "\n", hash);
+
+            const size_t begin = line.find('"');
+            const size_t end = line.rfind('"');
+            if (line.compare(0, 8, "#include") == 0 && begin != end) {
+                std::ifstream streamInclude(line.substr(begin + 1, end - begin - 1));
+                hash = CLUHash(std::string(std::istreambuf_iterator<char>(streamInclude),
+                                           (std::istreambuf_iterator<char>())), hash);
+            }
+        }
+        hash = CLUHash(device.getInfo<CL_DEVICE_NAME>(), hash);
+        hash = CLUHash(device.getInfo<CL_DEVICE_VERSION>(), hash);
+        hash = CLUHash(device.getInfo<CL_DRIVER_VERSION>(), hash);
+
+        std::stringstream name;
+        name << cacheDir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+        binary_filename = name.str();
+    } catch (cl::Error err) {
+        CLUErrorPrint(err);
+        CLUBuildProgram(program, context, device, filename, options, printBuildLog);
+        return;
+    }
+
+    std::ifstream streamBinary(binary_filename, std::ios::in | std::ios::binary);
+    if (streamBinary) {
+        const std::string binary(std::istreambuf_iterator<char>(streamBinary),
+                                 (std::istreambuf_iterator<char>()));
+        try {
+            const std::vector<cl::Device> devices(1, device);
+            const cl::Program::Binaries binaries(1, std::make_pair(binary.data(), binary.size()));
+            std::vector<cl_int> binary_status;
+
+            program = cl::Program(context, devices, binaries, &binary_status);
+            program.build(devices, options.c_str());
+
+            if (printBuildLog) {
+                std::string build_log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+                std::cout << "build log: " << build_log << std::endl;
+            }
+            return;
+        } catch (cl::Error err) {
+            std::cerr << "Cached binary " << binary_filename << " rejected ("
+                      << cl_get_error_string(err.err()) << "), building from source" << std::endl;
+        }
+    }
+
+    CLUBuildProgram(program, context, device, filename, options, printBuildLog);
+
+    // Store the binary, through a temporary file of the process so that
+    // concurrent runs never load a partial one nor write the same file.
+    // The context has a single device.
+    std::vector<char> binary;
+    try {
+        const std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+        if (sizes.size() != 1 || sizes[0] == 0) return;
+
+        binary.resize(sizes[0]);
+        std::vector<char *> binaries(1, binary.data());
+        program.getInfo(CL_PROGRAM_BINARIES, &binaries);
+    } catch (cl::Error err) {
+        // Failed build, or binaries not supported by the driver
+        return;
+    }
+
+    mkdir(cacheDir.c_str(), 0755);
+    const std::string tmp_filename = binary_filename + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(binary.data(), binary.size());
+    out.close();
+
+    if (!out || rename(tmp_filename.c_str(), binary_filename.c_str()) != 0) {
+        std::cerr << "Unable to write the cached binary " << binary_filename << std::endl;
+        remove(tmp_filename.c_str());
+    }
+}
+
 static inline double CLUEventsGetTime(const cl::Event & start_evt,
                                       const cl::Event & end_evt)
 {
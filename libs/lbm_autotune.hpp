@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <unistd.h>
+
+
+#define AUTOTUNE_CACHE_FILE     "./lbmcl.autotune"
+
+// Directory of the program binaries cached by CLUBuildProgramCached().
+#define KERNEL_CACHE_DIR        "./lbmcl.binaries"
+
+
+// Launch configuration selected by the autotuner.
+struct autotune_entry {
+    size_t lwx;
+    size_t lwy;
+    size_t lwz;
+    size_t stride;
+
+    autotune_entry() :
+        lwx(1),
+        lwy(1),
+        lwz(1),
+        stride(1)
+    {}
+};
+
+
+// Removes the field separators from a field of the cache.
+static inline std::string autotuneField(const std::string & field)
+{
+    std::string clean;
+    for (char c : field) {
+        if (c != ';' && c != '\n' && c != '\0') clean += c;
+    }
+    return clean;
+}
+
+
+// Key of an entry of the cache: one line for each device, driver version,
+// lattice size, precision, streaming and the build options selecting the
+// code of the kernels, as the collision, the storage or z_cells, but not
+// the physical parameters. Field separators are removed from the names and
+// the options.
+static inline std::string autotuneKey(const std::string & device,
+                                      const std::string & driver,
+                                      size_t nx, size_t ny, size_t nz,
+                                      const std::string & precision,
+                                      const std::string & streaming,
+                                      const std::string & options)
+{
+    std::stringstream key;
+    key << autotuneField(device) << ";" << autotuneField(driver) << ";";
+    key << nx << "x" << ny << "x" << nz << ";" << precision << ";" << streaming << ";" << autotuneField(options);
+    return key.str();
+}
+
+
+// Looks up the entry of key in the cache file. Returns false if the cache
+// does not exist or has no entry for key.
+//
+// Each line of the cache is: device;driver;nxxnyxnz;precision;streaming;options;lwx,lwy,lwz;stride
+static inline bool loadAutotune(const std::string & filename,
+                                const std::string & key,
+                                autotune_entry & entry)
+{
+    std::ifstream cache(filename);
+    std::string line;
+    bool found = false;
+
+    while (std::getline(cache, line)) {
+        const size_t stride_sep = line.rfind(';');
+        if (stride_sep == std::string::npos || stride_sep == 0) continue;
+        const size_t lws_sep = line.rfind(';', stride_sep - 1);
+        if (lws_sep == std::string::npos || line.compare(0, lws_sep, key) != 0) continue;
+
+        autotune_entry e;
+        const std::string lws = line.substr(lws_sep + 1, stride_sep - lws_sep - 1);
+        if (sscanf(lws.c_str(), "%zu,%zu,%zu", &e.lwx, &e.lwy, &e.lwz) == 3 &&
+            sscanf(line.c_str() + stride_sep + 1, "%zu", &e.stride) == 1)
+        {
+            entry = e;
+            found = true;
+        }
+    }
+    return found;
+}
+
+
+// Stores the entry of key in the cache file, replacing the previous one,
+// through a temporary file of the process, so that concurrent runs never
+// read a partial cache nor write the same file.
+static inline void storeAutotune(const std::string & filename,
+                                 const std::string & key,
+                                 const autotune_entry & entry)
+{
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(filename);
+        std::string line;
+        while (std::getline(cache, line)) {
+            if (line.compare(0, key.size() + 1, key + ";") != 0) lines.push_back(line);
+        }
+    }
+
+    std::stringstream line;
+    line << key << ";" << entry.lwx << "," << entry.lwy << "," << entry.lwz << ";" << entry.stride;
+    lines.push_back(line.str());
+
+    const std::string tmp_filename = filename + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::out | std::ios::trunc);
+    for (const std::string & l : lines) {
+        out << l << "\n";
+    }
+    out.close();
+
+    if (!out || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Unable to write the autotune cache " << filename << std::endl;
+        remove(tmp_filename.c_str());
+    }
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define CHECKPOINT_MAGIC        "LBMCLCKP"
+#define CHECKPOINT_VERSION      4
+#define CHECKPOINT_SECTIONS     8
+
+
+// Header of a checkpoint file. It is followed by the raw content of each
+// section (f_stream, f_collide, rho, u, map...), stored one after the other
+// in the same order and layout of the simulation buffers.
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size;         // sizeof(T) of the simulation
+    uint64_t nx;
+    uint64_t ny;
+    uint64_t nz;
+    uint64_t stride;
+    uint64_t iteration;         // last iteration completed
+    uint64_t layout;            // engine specific layout of the sections
+    uint64_t num_sections;
+    uint64_t section_size[CHECKPOINT_SECTIONS];
+
+    checkpoint_header() :
+        magic(),
+        version(CHECKPOINT_VERSION),
+        real_size(0),
+        nx(0),
+        ny(0),
+        nz(0),
+        stride(0),
+        iteration(0),
+        layout(0),
+        num_sections(0),
+        section_size()
+    {
+        memcpy(magic, CHECKPOINT_MAGIC, sizeof(magic));
+    }
+};
+
+
+// Writes a checkpoint file. The file is written with a temporary name and
+// then renamed, so that a run killed while writing never leaves a truncated
+// checkpoint behind.
+static inline void writeCheckpoint(const std::string & filename,
+                                   checkpoint_header header,
+                                   const std::vector< std::pair<const void *, size_t> > & sections)
+{
+    if (sections.size() > CHECKPOINT_SECTIONS) {
+        std::cerr << "Too many sections in checkpoint " << filename << std::endl;
+        exit(1);
+    }
+
+    header.num_sections = sections.size();
+    for (size_t i = 0; i < sections.size(); ++i) {
+        header.section_size[i] = sections[i].second;
+    }
+
+    const std::string tmp_filename = filename + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const std::pair<const void *, size_t> & s : sections) {
+        out.write(static_cast<const char *>(s.first), s.second);
+    }
+    out.close();
+
+    if (!out || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Unable to write checkpoint " << filename << std::endl;
+        exit(1);
+    }
+}
+
+
+// Read-only memory mapping of a checkpoint file.
+class checkpoint_file
+{
+private:
+    std::string filename;
+    int fd = -1;
+    void * data = MAP_FAILED;
+    size_t size = 0;
+    const checkpoint_header * header_ptr = nullptr;
+
+    static void fail(const std::string & filename, const std::string & what)
+    {
+        std::cerr << "Invalid checkpoint " << filename << ": " << what << std::endl;
+        exit(1);
+    }
+
+public:
+    explicit checkpoint_file(const std::string & filename)
+        : filename(filename)
+    {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) fail(filename, "unable to open the file");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) fail(filename, "unable to stat the file");
+        size = st.st_size;
+        if (size < sizeof(checkpoint_header)) fail(filename, "file too short");
+
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) fail(filename, "unable to map the file");
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        header_ptr = static_cast<const checkpoint_header *>(data);
+        if (memcmp(header_ptr->magic, CHECKPOINT_MAGIC, sizeof(header_ptr->magic)) != 0) {
+            fail(filename, "bad magic number");
+        }
+        if (header_ptr->version != CHECKPOINT_VERSION) {
+            fail(filename, "unsupported version");
+        }
+        if (header_ptr->num_sections > CHECKPOINT_SECTIONS) {
+            fail(filename, "too many sections");
+        }
+
+        size_t expected = sizeof(checkpoint_header);
+        for (size_t i = 0; i < header_ptr->num_sections; ++i) {
+            expected += header_ptr->section_size[i];
+        }
+        if (size != expected) fail(filename, "size does not match its header");
+    }
+
+    checkpoint_file(const checkpoint_file &) = delete;
+    checkpoint_file & operator=(const checkpoint_file &) = delete;
+
+    const checkpoint_header & header() const
+    {
+        return *header_ptr;
+    }
+
+    // Exits if the checkpoint does not belong to a simulation with the given
+    // precision, sizes, stride, layout and section sizes, or if it was saved
+    // after the last iteration.
+    void validate(size_t real_size, size_t nx, size_t ny, size_t nz, size_t stride, uint64_t layout, size_t iterations,
+                  const std::vector<size_t> & section_sizes) const
+    {
+        const checkpoint_header & h = *header_ptr;
+
+        if (h.real_size != real_size || h.nx != nx || h.ny != ny || h.nz != nz || h.stride != stride) {
+            std::cerr << "Checkpoint " << filename << " does not match the simulation: "
+                      << "size " << h.nx << "x" << h.ny << "x" << h.nz << ", stride " << h.stride << ", "
+                      << (h.real_size == sizeof(float) ? "single" : "double") << " precision" << std::endl;
+            exit(1);
+        }
+
+        if (h.layout != layout) {
+            std::cerr << "Checkpoint " << filename << " was stored with a different streaming or storage" << std::endl;
+            exit(1);
+        }
+
+        if (h.iteration > iterations) {
+            std::cerr << "Checkpoint " << filename << " is at iteration " << h.iteration
+                      << ", after the last one (" << iterations << ")" << std::endl;
+            exit(1);
+        }
+
+        bool sizes_match = (h.num_sections == section_sizes.size());
+        for (size_t i = 0; sizes_match && i < section_sizes.size(); ++i) {
+            sizes_match = (h.section_size[i] == section_sizes[i]);
+        }
+        if (!sizes_match) {
+            std::cerr << "Checkpoint " << filename << " has unexpected buffer sizes" << std::endl;
+            exit(1);
+        }
+    }
+
+    // Pointer to the content of the i-th section.
+    const void * section(size_t i) const
+    {
+        const char * ptr = static_cast<const char *>(data) + sizeof(checkpoint_header);
+        for (size_t s = 0; s < i; ++s) {
+            ptr += header_ptr->section_size[s];
+        }
+        return ptr;
+    }
+
+    ~checkpoint_file()
+    {
+        if (data != MAP_FAILED) munmap(data, size);
+        if (fd >= 0) close(fd);
+    }
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <algorithm>
+
+#include "common.h"
+#include "lbm_output.hpp"
+
+
+#define DIAGNOSTICS_FILE        "diagnostics"
+#define DIAGNOSTICS_EXTENSION   ".csv"
+#define DIAGNOSTICS_PRECISION   10
+
+
+// Diagnostics of the rho and u of a nx * ny * nz lattice, as reduced by the
+// diagnostics kernels. The kinetic energy and the maximum velocity leave out
+// the moving walls, whose velocity is imposed. The vorticity is computed with
+// central differences, only in the cells whose six neighbours store the
+// velocity too.
+template <typename T>
+void computeDiagnostics(const T * rho, const T * u, const map_t * map_values,
+                        size_t nx, size_t ny, size_t nz, T values[DIAGNOSTICS])
+{
+    const long cells = static_cast<long>(nx * ny * nz);
+    const long row = static_cast<long>(nx);
+    const long plane = static_cast<long>(nx * ny);
+
+    T mass = T(0.0);
+    T energy = T(0.0);
+    T max_u = T(0.0);
+    T enstrophy = T(0.0);
+
+    #pragma omp parallel for reduction(+:mass,energy,enstrophy) reduction(max:max_u) schedule(static)
+    for (long id = 0; id < cells; ++id) {
+        if (!is_store_macro(map_values[id])) continue;
+
+        const T ux = u[IDuxDIM(id, cells)];
+        const T uy = u[IDuyDIM(id, cells)];
+        const T uz = u[IDuzDIM(id, cells)];
+        const T u2 = (ux * ux) + (uy * uy) + (uz * uz);
+
+        mass += rho[id];
+        if (!is_moving(map_values[id])) {
+            energy += T(0.5) * rho[id] * u2;
+            max_u = std::max(max_u, std::sqrt(u2));
+        }
+
+        if (!is_store_macro(map_values[id - 1])     || !is_store_macro(map_values[id + 1])   ||
+            !is_store_macro(map_values[id - row])   || !is_store_macro(map_values[id + row]) ||
+            !is_store_macro(map_values[id - plane]) || !is_store_macro(map_values[id + plane]))
+        {
+            continue;
+        }
+
+        const T duy_dx = T(0.5) * (u[IDuyDIM(id + 1, cells)]     - u[IDuyDIM(id - 1, cells)]);
+        const T duz_dx = T(0.5) * (u[IDuzDIM(id + 1, cells)]     - u[IDuzDIM(id - 1, cells)]);
+        const T dux_dy = T(0.5) * (u[IDuxDIM(id + row, cells)]   - u[IDuxDIM(id - row, cells)]);
+        const T duz_dy = T(0.5) * (u[IDuzDIM(id + row, cells)]   - u[IDuzDIM(id - row, cells)]);
+        const T dux_dz = T(0.5) * (u[IDuxDIM(id + plane, cells)] - u[IDuxDIM(id - plane, cells)]);
+        const T duy_dz = T(0.5) * (u[IDuyDIM(id + plane, cells)] - u[IDuyDIM(id - plane, cells)]);
+
+        const T wx = duz_dy - duy_dz;
+        const T wy = dux_dz - duz_dx;
+        const T wz = duy_dx - dux_dy;
+        enstrophy += T(0.5) * ((wx * wx) + (wy * wy) + (wz * wz));
+    }
+
+    values[DIAG_MASS]           = mass;
+    values[DIAG_KINETIC_ENERGY] = energy;
+    values[DIAG_MAX_VELOCITY]   = max_u;
+    values[DIAG_ENSTROPHY]      = enstrophy;
+}
+
+
+// Residual of the velocity u of a lattice of the given cells since u_prev,
+// as reduced by the residual kernel. u_prev is then updated to u.
+template <typename T>
+void computeResidual(const T * u, T * u_prev, const map_t * map_values, size_t cells, T values[DIAGNOSTICS])
+{
+    const long n = static_cast<long>(cells);
+
+    T du2_sum = T(0.0);
+    T u2_sum = T(0.0);
+    T max_du = T(0.0);
+
+    #pragma omp parallel for reduction(+:du2_sum,u2_sum) reduction(max:max_du) schedule(static)
+    for (long id = 0; id < n; ++id) {
+        if (!is_store_macro(map_values[id])) continue;
+
+        T du2 = T(0.0);
+        T u2 = T(0.0);
+        for (long d = 0; d < D; ++d) {
+            const T ud = u[d * n + id];
+            const T dud = ud - u_prev[d * n + id];
+            du2 += dud * dud;
+            u2 += ud * ud;
+            u_prev[d * n + id] = ud;
+        }
+
+        du2_sum += du2;
+        u2_sum += u2;
+        max_du = std::max(max_du, std::sqrt(du2));
+    }
+
+    values[RESIDUAL_DU2]    = du2_sum;
+    values[RESIDUAL_U2]     = u2_sum;
+    values[RESIDUAL_MAX_DU] = max_du;
+    values[DIAG_ENSTROPHY]  = T(0.0);
+}
+
+
+// Relative L2 norm of the change of the velocity from the reduced residual.
+// A diverged lattice, whose velocity is no longer finite, is infinitely far
+// from a steady state.
+template <typename T>
+static inline double relativeResidual(const T values[DIAGNOSTICS])
+{
+    const double du2 = static_cast<double>(values[RESIDUAL_DU2]);
+    const double u2 = static_cast<double>(values[RESIDUAL_U2]);
+    if (!std::isfinite(du2) || !std::isfinite(u2)) {
+        return std::numeric_limits<double>::infinity();
+    }
+    if (u2 > 0.0) {
+        return std::sqrt(du2 / u2);
+    }
+    return (du2 > 0.0 ? std::numeric_limits<double>::infinity() : 0.0);
+}
+
+
+// CSV file of the diagnostics, with one line for each iteration. Lines are
+// flushed as they are appended, so that a running simulation can be followed.
+struct diagnostics_log {
+    std::ofstream out;
+
+    void open(const std::string & filename)
+    {
+        out.open(filename, std::ios::out | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Unable to write the diagnostics " << filename << std::endl;
+            return;
+        }
+        out << "iteration,mass,kinetic_energy,max_velocity,enstrophy" << std::endl;
+    }
+
+    template <typename T>
+    void append(size_t iteration, const T values[DIAGNOSTICS])
+    {
+        if (!out.is_open()) return;
+
+        out << iteration << std::setprecision(DIAGNOSTICS_PRECISION);
+        for (size_t i = 0; i < DIAGNOSTICS; ++i) {
+            out << "," << values[i];
+        }
+        out << std::endl;
+    }
+};
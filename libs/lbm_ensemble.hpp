@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <sstream>
+#include <iomanip>
+
+#include "lbm_output.hpp"
+
+
+// Parameters of a member of an ensemble of lattices, advanced together by
+// the same kernels. See ENSEMBLE in kernels.cl.
+struct ensemble_member {
+    double viscosity;
+    double velocity;
+
+    ensemble_member() :
+        viscosity(0.0),
+        velocity(0.0)
+    {}
+};
+
+
+// Parses the members of an ensemble from a list of viscosity:velocity pairs
+// separated by commas, e.g. "0.0089:0.05,0.01:0.1". Returns false if a
+// member is not valid.
+static inline bool parseEnsemble(const std::string & list, std::vector<ensemble_member> & members)
+{
+    std::vector<ensemble_member> parsed;
+    std::stringstream items(list);
+    std::string item;
+
+    while (std::getline(items, item, ',')) {
+        const size_t sep = item.find(':');
+        if (sep == std::string::npos) return false;
+
+        char * end = nullptr;
+        ensemble_member member;
+        member.viscosity = std::strtod(item.c_str(), &end);
+        if (end != item.c_str() + sep || member.viscosity <= 0.0) return false;
+        member.velocity = std::strtod(item.c_str() + sep + 1, &end);
+        if (end == item.c_str() + sep + 1 || *end != '\0') return false;
+
+        parsed.push_back(member);
+    }
+
+    if (parsed.empty()) return false;
+    members = parsed;
+    return true;
+}
+
+
+// Tag of the output files of a member of an ensemble of the given members,
+// as in lbmcl.m03.0100.vti. Empty for a single lattice, so that its files
+// keep their names.
+static inline std::string memberTag(size_t member, size_t members)
+{
+    if (members <= 1) return "";
+
+    std::stringstream tag;
+    tag << ".m" << std::setw(DIGITS(members - 1)) << std::setfill('0') << member;
+    return tag.str();
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "common.h"
+
+
+// D3Q19 lattice, with the same numbering of kernels.cl
+static const int d3q19_ex[Q] = { 0, +1,  0, -1,  0,  0,  0, +1, -1, -1, +1, +1,  0, -1,  0, +1,  0, -1,  0};
+static const int d3q19_ey[Q] = { 0,  0, +1,  0, -1,  0,  0, +1, +1, -1, -1,  0, +1,  0, -1,  0, +1,  0, -1};
+static const int d3q19_ez[Q] = { 0,  0,  0,  0,  0, -1, +1,  0,  0,  0,  0, -1, -1, -1, -1, +1, +1, +1, +1};
+static const int d3q19_s[Q]  = { 0,  3,  4,  1,  2,  6,  5,  9, 10,  7,  8, 17, 18, 15, 16, 13, 14, 11, 12};
+static const double d3q19_w[Q] = {
+    1.0 /  3.0,
+    1.0 / 18.0, 1.0 / 18.0, 1.0 / 18.0, 1.0 / 18.0, 1.0 / 18.0, 1.0 / 18.0,
+    1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0,
+    1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0
+};
+
+// Directions unknown on the moving wall, taken from the opposite ones.
+static const int d3q19_moving_unknowns[] = {5, 11, 12, 13, 14};
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <map>
+#include <new>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#endif
+
+
+// Pages of a buffer sampled by pagePlacement().
+#define NUMA_SAMPLED_PAGES      1024
+
+
+// Allocator leaving the values of a vector uninitialized, so that their
+// pages are not touched by the thread allocating it: the threads writing
+// them first place them on their NUMA nodes.
+template <typename T>
+struct first_touch_allocator : std::allocator<T> {
+    template <typename U>
+    struct rebind {
+        typedef first_touch_allocator<U> other;
+    };
+
+    first_touch_allocator() = default;
+
+    template <typename U>
+    first_touch_allocator(const first_touch_allocator<U> &) {}
+
+    template <typename U>
+    void construct(U * p)
+    {
+        ::new (static_cast<void *>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U * p, Args &&... args)
+    {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T>
+using numa_vector = std::vector< T, first_touch_allocator<T> >;
+
+
+// Page aligned host memory, as required by CL_MEM_USE_HOST_PTR buffers,
+// zeroed by the OpenMP threads in contiguous chunks of pages, so that each
+// chunk is on the NUMA node of its thread (first touch).
+class host_memory
+{
+    std::unique_ptr<void, void (*)(void *)> ptr;
+    size_t bytes;
+
+public:
+    explicit host_memory(size_t size) :
+        ptr(nullptr, std::free),
+        bytes(size)
+    {
+        const size_t page = pageSize();
+        void * p = nullptr;
+        if (posix_memalign(&p, page, ((size + page - 1) / page) * page) != 0) {
+            throw std::bad_alloc();
+        }
+        ptr.reset(p);
+
+        char * values = static_cast<char *>(p);
+        const long pages = static_cast<long>((size + page - 1) / page);
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < pages; ++i) {
+            const size_t begin = i * page;
+            memset(values + begin, 0, std::min(page, size - begin));
+        }
+    }
+
+    inline void * data() const { return ptr.get(); }
+    inline size_t size() const { return bytes; }
+
+    static inline size_t pageSize()
+    {
+#ifdef __linux__
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+        return 4096;
+#endif
+    }
+};
+
+
+// Pins each OpenMP thread to a CPU of the affinity mask of the process, the
+// i-th thread to the i-th CPU, so that the threads never leave the NUMA
+// node of the memory they touched first. Returns false if the affinity of
+// the threads can not be set.
+static inline bool pinThreads()
+{
+#if defined(__linux__) && defined(_OPENMP)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    if (cpus.empty()) return false;
+
+    bool pinned = true;
+    #pragma omp parallel reduction(&&:pinned)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &set);
+        pinned = (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    }
+    return pinned;
+#else
+    return false;
+#endif
+}
+
+
+// Number of OpenMP threads running on each NUMA node, e.g. "node 0: 16,
+// node 1: 16", or "unknown".
+static inline std::string threadPlacement()
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    std::map<int, size_t> threads;
+    bool known = true;
+
+    #pragma omp parallel
+    {
+        unsigned cpu = 0;
+        unsigned node = 0;
+        const bool found = (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0);
+
+        #pragma omp critical
+        {
+            known = known && found;
+            ++threads[static_cast<int>(node)];
+        }
+    }
+
+    if (known) {
+        std::stringstream placement;
+        for (const std::pair<const int, size_t> & node : threads) {
+            if (node.first != threads.begin()->first) placement << ", ";
+            placement << "node " << node.first << ": " << node.second;
+        }
+        return placement.str();
+    }
+#endif
+    return "unknown";
+}
+
+
+// Share of the pages of a buffer on each NUMA node, sampled over at most
+// NUMA_SAMPLED_PAGES pages evenly spread, e.g. "node 0: 50%, node 1: 50%".
+// Pages never touched are "untouched"; "unknown" if the nodes of the pages
+// can not be queried.
+static inline std::string pagePlacement(const void * ptr, size_t size)
+{
+#if defined(__linux__) && defined(SYS_move_pages)
+    if (ptr == nullptr || size == 0) return "unknown";
+
+    const size_t page = host_memory::pageSize();
+    const uintptr_t first = reinterpret_cast<uintptr_t>(ptr) / page * page;
+    const size_t pages = (reinterpret_cast<uintptr_t>(ptr) + size - first + page - 1) / page;
+    const size_t samples = std::min<size_t>(pages, NUMA_SAMPLED_PAGES);
+
+    std::vector<void *> addresses(samples);
+    std::vector<int> status(samples, -1);
+    for (size_t i = 0; i < samples; ++i) {
+        addresses[i] = reinterpret_cast<void *>(first + (i * pages / samples) * page);
+    }
+
+    // Without target nodes, move_pages() only reads the node of each page
+    if (syscall(SYS_move_pages, 0, samples, addresses.data(), nullptr, status.data(), 0) == 0) {
+        std::map<int, size_t> nodes;
+        for (int s : status) {
+            ++nodes[s];
+        }
+
+        std::stringstream placement;
+        for (const std::pair<const int, size_t> & node : nodes) {
+            if (node.first != nodes.begin()->first) placement << ", ";
+            if (node.first >= 0) {
+                placement << "node " << node.first;
+            } else {
+                placement << (node.first == -ENOENT ? "untouched" : "unknown");
+            }
+            placement << ": " << ((100 * node.second + samples / 2) / samples) << "%";
+        }
+        return placement.str();
+    }
+#else
+    (void)ptr;
+    (void)size;
+#endif
+    return "unknown";
+}
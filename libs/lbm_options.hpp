@@ -1,19 +1,84 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <iomanip>
 #include <limits>
 #include <getopt.h>
 
+#include "lbm_output.hpp"
+#include "lbm_autotune.hpp"
+#include "lbm_storage.hpp"
+#include "lbm_ensemble.hpp"
+#include "lbm_simd.hpp"
+
 
 #define RESULTS_FOLDER      "./results"
 
 
+// Engine running the simulation.
+enum lbm_engine {
+    ENGINE_OPENCL,      // OpenCL kernels, see lbmcl.hpp
+    ENGINE_CPU          // native OpenMP threads, see lbmcpu.hpp
+};
+
+
+// Streaming of the distributions between iterations.
+enum lbm_streaming {
+    STREAMING_PUSH,     // from a buffer to the other one, swapped every iteration
+    STREAMING_PULL,     // as push, gathering from the neighbours
+    STREAMING_AA,       // in place on a single buffer (AA pattern)
+    STREAMING_SAILFISH  // as push, shifting along x in local memory
+};
+
+
+static inline const char * lbmStreamingStr(lbm_streaming streaming)
+{
+    switch (streaming) {
+        case STREAMING_PULL: return "pull";
+        case STREAMING_AA:   return "aa";
+        case STREAMING_SAILFISH: return "sailfish";
+        default:             return "push";
+    }
+}
+
+
+// Collision operator of the fluid cells, see COLLISION in kernels.cl.
+enum lbm_collision {
+    COLLISION_BGK,      // single relaxation time
+    COLLISION_TRT,      // two relaxation times, of the even and odd moments
+    COLLISION_MRT       // multiple relaxation times, in moment space
+};
+
+
+static inline const char * lbmCollisionStr(lbm_collision collision)
+{
+    switch (collision) {
+        case COLLISION_TRT: return "trt";
+        case COLLISION_MRT: return "mrt";
+        default:            return "bgk";
+    }
+}
+
+
+// Layout of the distributions stored in checkpoints: restarts require the
+// same streaming, storage and lattice (whole or sparse). The Sailfish
+// streaming leaves the distributions as push does.
+static inline uint64_t lbmLayout(lbm_streaming streaming, lbm_storage storage, bool sparse)
+{
+    if (streaming == STREAMING_SAILFISH) streaming = STREAMING_PUSH;
+    return (static_cast<uint64_t>(sparse) << 16) | (static_cast<uint64_t>(storage) << 8) | static_cast<uint64_t>(streaming);
+}
+
+
 struct lbm_options {
     int platformID;
     int deviceID;
     size_t dim;
+    size_t nx;
+    size_t ny;
+    size_t nz;
     double viscosity;
     double velocity;
     size_t iterations;
@@ -28,11 +93,41 @@ struct lbm_options {
     std::string dump_path;
     bool dump_map;
     bool dump_f;
+    size_t profile_every;
+    size_t writer_threads;
+    vtk_format vtk_fmt;
+    bool vtk_float32;
+    size_t checkpoint_every;
+    std::string restart_file;
+    lbm_engine engine;
+    bool autotune;
+    std::string autotune_cache;
+    bool lws_given;
+    bool stride_given;
+    std::string kernel_cache;
+    lbm_streaming streaming;
+    lbm_storage storage;
+    lbm_collision collision;
+    bool procedural_geometry;
+    bool sparse;
+    size_t z_cells;
+    size_t block_steps;
+    bool local_lattice;
+    bool interior_split;
+    lbm_simd simd;
+    bool pin_threads;
+    size_t diagnostics_every;
+    double tolerance;
+    size_t residual_every;
+    std::vector<ensemble_member> ensemble;
 
     lbm_options() :
         platformID(-1),
         deviceID(-1),
         dim(8),
+        nx(0),
+        ny(0),
+        nz(0),
         viscosity(0.0089),
         velocity(0.05),
         iterations(10),
@@ -46,14 +141,48 @@ struct lbm_options {
         optimize(false),
         dump_path(RESULTS_FOLDER),
         dump_map(false),
-        dump_f(false)
+        dump_f(false),
+        profile_every(1),
+        writer_threads(2),
+        vtk_fmt(VTK_ASCII),
+        vtk_float32(false),
+        checkpoint_every(0),
+        restart_file(""),
+#ifdef LBM_NO_OPENCL
+        engine(ENGINE_CPU),
+#else
+        engine(ENGINE_OPENCL),
+#endif
+        autotune(false),
+        autotune_cache(AUTOTUNE_CACHE_FILE),
+        lws_given(false),
+        stride_given(false),
+        kernel_cache(KERNEL_CACHE_DIR),
+        streaming(STREAMING_PUSH),
+        storage(STORAGE_REAL),
+        collision(COLLISION_BGK),
+        procedural_geometry(false),
+        sparse(false),
+        z_cells(1),
+        block_steps(1),
+        local_lattice(false),
+        interior_split(false),
+        simd(SIMD_AUTO),
+        pin_threads(false),
+        diagnostics_every(0),
+        tolerance(0.0),
+        residual_every(100)
     {}
 
     void print_help()
     {
-        std::cout << "-P  --platform            Use the specified platform                     \n"
+        std::cout << "-E  --engine              Run the simulation with: opencl or cpu         \n"
+                     "-P  --platform            Use the specified platform                     \n"
                      "-D  --device              Use the specified device                       \n"
                      "-d  --dim                 Set the lattice cube dimension                 \n"
+                     "-x  --nx                  Set the lattice size along x (default dim)     \n"
+                     "-y  --ny                  Set the lattice size along y (default dim)     \n"
+                     "-z  --nz                  Set the lattice size along z (default dim)     \n"
                      "-n  --viscosity           Set the fluid viscosity                        \n"
                      "-u  --velocity            Set the x velocity of the moving wall          \n"
                      "-i  --iterations          Specify the number of iterations               \n"
@@ -63,9 +192,33 @@ struct lbm_options {
                      "-F  --use_double          Make use of \"double\" type                    \n"
                      "-o  --optimize            Use \"cl-fast-relaxed-math\" in OpenCL kernels \n"
                      "-v  --vtk_path            Specify where store VTI files                  \n"
+                     "-b  --vtk_format          VTI data format: ascii, binary or zlib         \n"
+                     "-B  --vtk_float32         Store VTI binary data as \"float\"             \n"
                      "-p  --dump_path           Specify where store dumps                      \n"
                      "-m  --dump_map            Dump the lattice map                           \n"
                      "-f  --dump_f              Dump the lattice \"f\" for each iteration      \n"
+                     "-t  --profile_every       Profile compute kernels every N iterations     \n"
+                     "-W  --writer_threads      Number of threads writing output files         \n"
+                     "-c  --checkpoint_every    Store a checkpoint every N iterations          \n"
+                     "-r  --restart             Restart the simulation from a checkpoint file  \n"
+                     "-a  --autotune            Select work group size and stride (cached)     \n"
+                     "-A  --autotune_cache      Cache file of the autotuned configurations     \n"
+                     "-K  --kernel_cache        Cache dir of program binaries (\"\" disables)    \n"
+                     "-S  --streaming           Streaming: push, pull, aa or sailfish (opencl) \n"
+                     "-H  --storage             Storage of f: real, fp32, fp16 or bf16         \n"
+                     "-C  --collision           Collision: bgk, trt or mrt (opencl only)       \n"
+                     "-G  --procedural_geometry Compute the cell types instead of the map read \n"
+                     "-X  --sparse              Update only the cells that are not walls       \n"
+                     "-Z  --z_cells             Cells updated along z by each work item        \n"
+                     "-k  --block_steps         Iterations of each work group tile (opencl)    \n"
+                     "-l  --local_lattice       Whole lattice in local memory (opencl)         \n"
+                     "-I  --interior_split      Fluid-only kernel on the interior (opencl)     \n"
+                     "-V  --simd                CPU vectors: auto, scalar, avx2 or avx512      \n"
+                     "-J  --pin_threads         Pin the OpenMP threads to the CPUs             \n"
+                     "-M  --diagnostics_every   Reduce mass, energy, max u, enstrophy every N  \n"
+                     "-T  --tolerance           Stop once the residual of u is below it        \n"
+                     "-R  --residual_every      Check the residual every N iterations          \n"
+                     "-N  --ensemble            Lattices of viscosity:velocity,... (opencl)    \n"
                      "-h  --help                Show this help message and exit                \n";
         exit(1);
     }
@@ -75,8 +228,9 @@ struct lbm_options {
     {
         opterr = 0;
 
-        const char * const short_opts = "P:D:d:n:u:i:e:v:w:s:Fop:mfh";
+        const char * const short_opts = "E:P:D:d:n:u:i:e:v:b:Bw:s:Fop:mft:W:c:r:aA:K:S:H:C:GXx:y:z:Z:k:lIV:JM:T:R:N:h";
         const option long_opts[] = {
+                {"engine",          required_argument, nullptr, 'E'},
                 {"platform",        required_argument, nullptr, 'P'},
                 {"device",          required_argument, nullptr, 'D'},
                 {"dim",             required_argument, nullptr, 'd'},
@@ -89,9 +243,36 @@ struct lbm_options {
                 {"use_double",      no_argument,       nullptr, 'F'},
                 {"optimize",        no_argument,       nullptr, 'o'},
                 {"vtk_path",        optional_argument, nullptr, 'v'},
+                {"vtk_format",      required_argument, nullptr, 'b'},
+                {"vtk_float32",     no_argument,       nullptr, 'B'},
                 {"dump_path",       optional_argument, nullptr, 'p'},
                 {"dump_map",        no_argument,       nullptr, 'm'},
                 {"dump_f",          no_argument,       nullptr, 'f'},
+                {"profile_every",   required_argument, nullptr, 't'},
+                {"writer_threads",  required_argument, nullptr, 'W'},
+                {"checkpoint_every",required_argument, nullptr, 'c'},
+                {"restart",         required_argument, nullptr, 'r'},
+                {"autotune",        no_argument,       nullptr, 'a'},
+                {"autotune_cache",  required_argument, nullptr, 'A'},
+                {"kernel_cache",    required_argument, nullptr, 'K'},
+                {"streaming",       required_argument, nullptr, 'S'},
+                {"storage",         required_argument, nullptr, 'H'},
+                {"collision",       required_argument, nullptr, 'C'},
+                {"procedural_geometry", no_argument,   nullptr, 'G'},
+                {"sparse",          no_argument,       nullptr, 'X'},
+                {"nx",              required_argument, nullptr, 'x'},
+                {"ny",              required_argument, nullptr, 'y'},
+                {"nz",              required_argument, nullptr, 'z'},
+                {"z_cells",         required_argument, nullptr, 'Z'},
+                {"block_steps",     required_argument, nullptr, 'k'},
+                {"local_lattice",   no_argument,       nullptr, 'l'},
+                {"interior_split",  no_argument,       nullptr, 'I'},
+                {"simd",            required_argument, nullptr, 'V'},
+                {"pin_threads",     no_argument,       nullptr, 'J'},
+                {"diagnostics_every", required_argument, nullptr, 'M'},
+                {"tolerance",       required_argument, nullptr, 'T'},
+                {"residual_every",  required_argument, nullptr, 'R'},
+                {"ensemble",        required_argument, nullptr, 'N'},
                 {"help",            no_argument,       nullptr, 'h'},
                 {nullptr,           no_argument,       nullptr,   0}
         };
@@ -105,6 +286,20 @@ struct lbm_options {
             if (opt < 0) break;
 
             switch (opt) {
+                case 'E':
+                    if (std::string(optarg) == "opencl") {
+#ifdef LBM_NO_OPENCL
+                        std::cerr << "This build has no OpenCL support, please use the cpu engine" << std::endl;
+                        exit(1);
+#endif
+                        engine = ENGINE_OPENCL;
+                    } else if (std::string(optarg) == "cpu") {
+                        engine = ENGINE_CPU;
+                    } else {
+                        std::cerr << "Please enter a valid engine: opencl or cpu" << std::endl;
+                        exit(1);
+                    }
+                    break;
                 case 'P':
                     if ((int_opt = std::stoi(optarg)) < 0) {
                         std::cerr << "Please enter a valid platform" << std::endl;
@@ -152,6 +347,7 @@ struct lbm_options {
                     break;
                 case 'w':
                     sscanf(optarg, "%zu,%zu,%zu", &lwx, &lwy, &lwz);
+                    lws_given = true;
                     break;
                 case 's':
                     if ((int_opt = std::stoi(optarg)) < 0) {
@@ -159,6 +355,7 @@ struct lbm_options {
                         exit(1);
                     }
                     stride = int_opt;
+                    stride_given = true;
                     break;
                 case 'F':
                     use_double = true;
@@ -173,6 +370,21 @@ struct lbm_options {
                         std::cout << "VTI files will be stored in:" << vtk_path << std::endl;
                     }
                     break;
+                case 'b':
+                    if (std::string(optarg) == "ascii") {
+                        vtk_fmt = VTK_ASCII;
+                    } else if (std::string(optarg) == "binary") {
+                        vtk_fmt = VTK_BINARY;
+                    } else if (std::string(optarg) == "zlib") {
+                        vtk_fmt = VTK_ZLIB;
+                    } else {
+                        std::cerr << "Please enter a valid VTI format: ascii, binary or zlib" << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'B':
+                    vtk_float32 = true;
+                    break;
                 case 'p':
                     dump_path  = std::string(optarg);
                     if (dump_path.empty()) {
@@ -186,6 +398,158 @@ struct lbm_options {
                 case 'f':
                     dump_f = true;
                     break;
+                case 't':
+                    if ((int_opt = std::stoi(optarg)) <= 0) {
+                        std::cerr << "Please enter a valid number for profile kernels every N iterations" << std::endl;
+                        exit(1);
+                    }
+                    profile_every = int_opt;
+                    break;
+                case 'W':
+                    if ((int_opt = std::stoi(optarg)) <= 0) {
+                        std::cerr << "Please enter a valid number of writer threads" << std::endl;
+                        exit(1);
+                    }
+                    writer_threads = int_opt;
+                    break;
+                case 'c':
+                    if ((int_opt = std::stoi(optarg)) < 0) {
+                        std::cerr << "Please enter a valid number for store a checkpoint every N iterations" << std::endl;
+                        exit(1);
+                    }
+                    checkpoint_every = int_opt;
+                    break;
+                case 'r':
+                    restart_file = std::string(optarg);
+                    break;
+                case 'a':
+                    autotune = true;
+                    break;
+                case 'A':
+                    autotune_cache = std::string(optarg);
+                    break;
+                case 'K':
+                    kernel_cache = std::string(optarg);
+                    break;
+                case 'S':
+                    if (std::string(optarg) == "push") {
+                        streaming = STREAMING_PUSH;
+                    } else if (std::string(optarg) == "pull") {
+                        streaming = STREAMING_PULL;
+                    } else if (std::string(optarg) == "aa") {
+                        streaming = STREAMING_AA;
+                    } else if (std::string(optarg) == "sailfish") {
+                        streaming = STREAMING_SAILFISH;
+                    } else {
+                        std::cerr << "Please enter a valid streaming: push, pull, aa or sailfish" << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'H':
+                    if (std::string(optarg) == "real") {
+                        storage = STORAGE_REAL;
+                    } else if (std::string(optarg) == "fp32") {
+                        storage = STORAGE_FP32;
+                    } else if (std::string(optarg) == "fp16") {
+                        storage = STORAGE_FP16;
+                    } else if (std::string(optarg) == "bf16") {
+                        storage = STORAGE_BF16;
+                    } else {
+                        std::cerr << "Please enter a valid storage: real, fp32, fp16 or bf16" << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'C':
+                    if (std::string(optarg) == "bgk") {
+                        collision = COLLISION_BGK;
+                    } else if (std::string(optarg) == "trt") {
+                        collision = COLLISION_TRT;
+                    } else if (std::string(optarg) == "mrt") {
+                        collision = COLLISION_MRT;
+                    } else {
+                        std::cerr << "Please enter a valid collision: bgk, trt or mrt" << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'G':
+                    procedural_geometry = true;
+                    break;
+                case 'X':
+                    sparse = true;
+                    break;
+                case 'x':
+                case 'y':
+                case 'z':
+                    if ((int_opt = std::stoi(optarg)) < 0) {
+                        std::cerr << "Please enter a valid lattice size" << std::endl;
+                        exit(1);
+                    }
+                    (opt == 'x' ? nx : (opt == 'y' ? ny : nz)) = int_opt;
+                    break;
+                case 'Z':
+                    if ((int_opt = std::stoi(optarg)) <= 0) {
+                        std::cerr << "Please enter a valid number of cells along z for each work item" << std::endl;
+                        exit(1);
+                    }
+                    z_cells = int_opt;
+                    break;
+                case 'k':
+                    if ((int_opt = std::stoi(optarg)) <= 0) {
+                        std::cerr << "Please enter a valid number of iterations for each tile" << std::endl;
+                        exit(1);
+                    }
+                    block_steps = int_opt;
+                    break;
+                case 'l':
+                    local_lattice = true;
+                    break;
+                case 'I':
+                    interior_split = true;
+                    break;
+                case 'V':
+                    if (std::string(optarg) == "auto") {
+                        simd = SIMD_AUTO;
+                    } else if (std::string(optarg) == "scalar") {
+                        simd = SIMD_SCALAR;
+                    } else if (std::string(optarg) == "avx2") {
+                        simd = SIMD_AVX2;
+                    } else if (std::string(optarg) == "avx512") {
+                        simd = SIMD_AVX512;
+                    } else {
+                        std::cerr << "Please enter a valid simd: auto, scalar, avx2 or avx512" << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'J':
+                    pin_threads = true;
+                    break;
+                case 'M':
+                    if ((int_opt = std::stoi(optarg)) < 0) {
+                        std::cerr << "Please enter a valid number for diagnostics every N iterations" << std::endl;
+                        exit(1);
+                    }
+                    diagnostics_every = int_opt;
+                    break;
+                case 'T':
+                    if ((real_opt = std::atof(optarg)) < 0) {
+                        std::cerr << "Please enter a valid residual tolerance" << std::endl;
+                        exit(1);
+                    }
+                    tolerance = real_opt;
+                    break;
+                case 'R':
+                    if ((int_opt = std::stoi(optarg)) <= 0) {
+                        std::cerr << "Please enter a valid number for residual every N iterations" << std::endl;
+                        exit(1);
+                    }
+                    residual_every = int_opt;
+                    break;
+                case 'N':
+                    if (!parseEnsemble(optarg, ensemble)) {
+                        std::cerr << "Please enter the ensemble as viscosity:velocity pairs separated by commas" << std::endl;
+                        exit(1);
+                    }
+                    break;
                 case 'h':
                 case '?':
                 default:
@@ -193,5 +557,16 @@ struct lbm_options {
                     break;
             }
         }
+
+        // Sizes not given are the ones of the cube. The walls and a layer of
+        // cells moving or bouncing back need at least 3 cells on each axis.
+        if (nx == 0) nx = dim;
+        if (ny == 0) ny = dim;
+        if (nz == 0) nz = dim;
+
+        if (nx < 3 || ny < 3 || nz < 3) {
+            std::cerr << "Please enter a lattice of at least 3 cells on each axis" << std::endl;
+            exit(1);
+        }
     }
 };
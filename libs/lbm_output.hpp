@@ -0,0 +1,549 @@
+#pragma once
+
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <utility>
+#include <functional>
+#include <type_traits>
+
+#include <zlib.h>
+
+#include "common.h"
+
+
+#define DIGITS(val)         (((val) > 0) ? (size_t)log10((double)(val)) + 1 : 1)
+
+#define DUMP_PRECISION      6
+#define VTK_PRECISION       16
+
+// Size of the uncompressed blocks of zlib compressed VTI files.
+#define VTK_ZLIB_BLOCK_SIZE (1 << 15)
+
+// Number of staging buffers used for each kind of output, so that the
+// simulation can fill one of them while the writers store the other one.
+#define OUTPUT_SLOTS        2
+
+
+// Encoding of the data arrays in VTI files.
+enum vtk_format {
+    VTK_ASCII,          // text, human readable
+    VTK_BINARY,         // raw appended data
+    VTK_ZLIB            // appended data compressed with zlib
+};
+
+
+#define IDxyzqDIM(id, q, dim, stride)   (((id) / (stride)) * (dim) + q) * (stride) + ((id) & ((stride) - 1))
+#define IDxyzDIM(x, y, z, nx, ny)       ((x) + ((y) * (nx)) + ((z) * (nx) * (ny)))
+#define IDuxDIM(id, cells)              (0 * (cells) + (id))
+#define IDuyDIM(id, cells)              (1 * (cells) + (id))
+#define IDuzDIM(id, cells)              (2 * (cells) + (id))
+
+// Number of cells of the CSoA layout of a lattice of the given cells: the
+// last block of stride cells is padded.
+static inline size_t paddedCells(size_t cells, size_t stride)
+{
+    return ((cells + stride - 1) / stride) * stride;
+}
+
+
+// Bounded multi-producer multi-consumer lock-free queue (D. Vyukov).
+// The capacity is rounded up to the next power of two.
+template <typename T>
+class mpmc_queue
+{
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<cell[]> buffer;
+    size_t mask;
+    // Producers and consumers positions live on different cache lines.
+    std::atomic<size_t> enqueue_pos;
+    char padding[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeue_pos;
+
+public:
+    explicit mpmc_queue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+
+        buffer.reset(new cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    mpmc_queue(const mpmc_queue &) = delete;
+    mpmc_queue & operator=(const mpmc_queue &) = delete;
+
+    bool try_push(T && value)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell & c = buffer[pos & mask];
+            const size_t seq = c.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.data = std::move(value);
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T & value)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell & c = buffer[pos & mask];
+            const size_t seq = c.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(c.data);
+                    c.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+
+// Waits with an exponential backoff: first yields the CPU, then sleeps up to
+// one millisecond between two attempts.
+class backoff
+{
+private:
+    unsigned int attempts = 0;
+
+public:
+    void pause()
+    {
+        if (attempts < 16) {
+            std::this_thread::yield();
+        } else {
+            const unsigned int shift = std::min(attempts - 16, 10u);
+            std::this_thread::sleep_for(std::chrono::microseconds(1 << shift));
+        }
+        attempts++;
+    }
+
+    void reset()
+    {
+        attempts = 0;
+    }
+};
+
+
+// Fixed size pool of threads writing output files. Jobs are submitted through
+// a bounded lock-free queue: submit() never takes a lock, but it waits while
+// the queue is full, and the std::function of a job may allocate. It is
+// called from OpenCL event callbacks only through output_slot::submit(), see
+// there why that never waits nor allocates.
+class writer_pool
+{
+private:
+    mpmc_queue< std::function<void()> > jobs;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pending;
+    std::atomic<bool> stop;
+
+    void run()
+    {
+        backoff wait;
+        std::function<void()> job;
+        while (true) {
+            if (jobs.try_pop(job)) {
+                job();
+                job = nullptr;
+                pending.fetch_sub(1, std::memory_order_acq_rel);
+                wait.reset();
+            } else if (stop.load(std::memory_order_acquire)) {
+                break;
+            } else {
+                wait.pause();
+            }
+        }
+    }
+
+public:
+    writer_pool(size_t num_threads, size_t capacity)
+        : jobs(capacity),
+          pending(0),
+          stop(false)
+    {
+        if (num_threads == 0) num_threads = 1;
+        for (size_t i = 0; i < num_threads; ++i) {
+            threads.emplace_back(&writer_pool::run, this);
+        }
+    }
+
+    writer_pool(const writer_pool &) = delete;
+    writer_pool & operator=(const writer_pool &) = delete;
+
+    size_t size() const
+    {
+        return threads.size();
+    }
+
+    // Queues job, waiting for the writers to free a place if the queue is full.
+    void submit(std::function<void()> job)
+    {
+        pending.fetch_add(1, std::memory_order_acq_rel);
+        backoff wait;
+        while (!jobs.try_push(std::move(job))) {
+            wait.pause();
+        }
+    }
+
+    // Waits until all the submitted jobs are completed.
+    void drain()
+    {
+        backoff wait;
+        while (pending.load(std::memory_order_acquire) > 0) {
+            wait.pause();
+        }
+    }
+
+    ~writer_pool()
+    {
+        drain();
+        stop.store(true, std::memory_order_release);
+        for (std::thread & t : threads) {
+            t.join();
+        }
+    }
+};
+
+
+// Staging buffer whose content is stored by the writers. Once the buffer is
+// filled, the job is handed to the writers and the slot stays busy until the
+// job ends.
+struct output_slot {
+    void * host_ptr = nullptr;
+    std::atomic<bool> busy;
+    std::function<void()> job;
+    writer_pool * writers = nullptr;
+
+    output_slot() : busy(false) {}
+
+    // Waits until the writers release the slot.
+    void wait() const
+    {
+        backoff idle;
+        while (busy.load(std::memory_order_acquire)) {
+            idle.pause();
+        }
+    }
+
+    // Waits until the writers release the slot, then takes it.
+    void acquire()
+    {
+        wait();
+        busy.store(true, std::memory_order_release);
+    }
+
+    // Hands the job to the writers, which release the slot once it ends. The
+    // engines size the queue of the writers for all their slots, and a slot
+    // is queued at most once while busy, so this never waits for a place.
+    // The queued function only captures the slot, small enough to be stored
+    // without allocating by the common standard libraries: it can be called
+    // from OpenCL event callbacks. job itself is set before the transfer.
+    void submit()
+    {
+        writers->submit([this]() {
+            job();
+            busy.store(false, std::memory_order_release);
+        });
+    }
+};
+
+
+// Stores the cell types of a nx * ny * nz lattice as a text dump.
+static inline void writeMap(const std::string & filename, const map_t * map_values, size_t nx, size_t ny, size_t nz)
+{
+    std::ofstream dump;
+    dump.open(filename);
+
+    dump << "# FLUID       1" << std::endl
+         << "# MOVING      2" << std::endl
+         << "# BOUNDARY    3" << std::endl
+         << "# WALL        4" << std::endl
+         << "# CORNER      5" << std::endl
+         << std::endl;
+
+    for (size_t z = 0; z < nz; ++z) {
+        for (size_t y = 0; y < ny; ++y) {
+            for (size_t x = 0; x < nx; ++x) {
+                const size_t cell_type = map_values[IDxyzDIM(x, y, z, nx, ny)];
+
+                int val = 0;
+                if (is_fluid(cell_type))    val = 1;
+                if (is_moving(cell_type))   val = 2;
+                if (is_boundary(cell_type)) val = 3;
+                if (is_wall(cell_type))     val = 4;
+                if (is_corner(cell_type))   val = 5;
+                dump << val << " ";
+            }
+            dump << std::endl;
+        }
+        dump << std::endl;
+    }
+    dump << std::endl;
+
+    dump.close();
+}
+
+
+// Stores the lattice "f" (CSoA layout) of a nx * ny * nz lattice as a text
+// dump.
+template <typename T>
+void writeF(const std::string & filename, const T * f_values, size_t nx, size_t ny, size_t nz, size_t stride)
+{
+    // (xxx,yyy,zzz)
+    // 1 + D + 1 + D + 1 + D + 1 + 1
+    const size_t dim_digits = DIGITS(std::max(nx, std::max(ny, nz)));
+    const size_t coord_spaces = dim_digits * 3 + 5;
+
+    std::ofstream dump;
+    dump.open(filename);
+
+    for (size_t z = 0; z < nz; ++z) {
+        for (size_t y = 0; y < ny; ++y) {
+            for (size_t s = 0; s < coord_spaces; ++s) {
+                dump << " ";
+            }
+            for (size_t q = 0; q < Q; ++q) {
+                dump << std::setw(DUMP_PRECISION + 2) << q << " ";
+            }
+            dump << std::endl;
+
+            for (size_t x = 0; x < nx; ++x) {
+                const size_t index = IDxyzDIM(x, y, z, nx, ny);
+                dump << std::setw(dim_digits) << "(" << x << "," << y << "," << z << ") ";
+                for (size_t q = 0; q < Q; ++q) {
+                    dump << std::fixed
+                         << std::setw(DUMP_PRECISION + 2)
+                         << std::setprecision(DUMP_PRECISION)
+                         << f_values[IDxyzqDIM(index, q, Q, stride)]
+                         << " ";
+                }
+                dump << std::endl;
+            }
+            dump << std::endl;
+        }
+        dump << std::endl;
+    }
+    dump << std::endl;
+
+    dump.close();
+}
+
+
+// Extent of the wet lattices of a nx * ny * nz lattice, the walls excluded.
+static inline std::string vtiExtent(size_t nx, size_t ny, size_t nz)
+{
+    std::stringstream extent;
+    extent << "0 " << (nx - 3) << " 0 " << (ny - 3) << " 0 " << (nz - 3);
+    return extent.str();
+}
+
+
+// Stores density and velocity of the wet lattices of a nx * ny * nz lattice
+// as a VTK ImageData file with ascii data arrays.
+template <typename T>
+void writeVTIAscii(const std::string & filename, const T * rho_values, const T * u_values, size_t nx, size_t ny, size_t nz)
+{
+    const size_t cells = nx * ny * nz;
+    const std::string dataTypeString = (std::is_same<T, float>::value ? "Float32" : "Float64");
+
+    std::ofstream vtk;
+    vtk.open(filename);
+
+    vtk << "<?xml version=\"1.0\"?>\n"
+        << "<VTKFile type=\"ImageData\" version=\"0.1\" byte_order=\"LittleEndian\" header_type=\"UInt64\">\n"
+        << "  <ImageData WholeExtent=\"" << vtiExtent(nx, ny, nz) << "\" Origin=\"0 0 0\" Spacing=\"1 1 1\">\n"
+        << "    <Piece Extent=\"" << vtiExtent(nx, ny, nz) << "\">\n"
+        << "      <PointData Scalars=\"rho\">\n"
+        << "        <DataArray type=\"" << dataTypeString << "\" Name=\"rho\" NumberOfComponents=\"1\" format=\"ascii\">\n";
+
+    for (size_t z = 1; z < nz - 1; ++z) {
+        for (size_t y = 1; y < ny - 1; ++y) {
+            for (size_t x = 1; x < nx - 1; ++x) {
+                const T val = rho_values[IDxyzDIM(x, y, z, nx, ny)];
+                vtk << std::scientific << std::setprecision(VTK_PRECISION) << val << " ";
+            }
+            vtk << "\n";
+        }
+    }
+
+    vtk << "        </DataArray>\n"
+        << "        <DataArray type=\"" << dataTypeString << "\" Name=\"v\" NumberOfComponents=\"3\" format=\"ascii\">\n";
+
+    for (size_t z = 1; z < nz - 1; ++z) {
+        for (size_t y = 1; y < ny - 1; ++y) {
+            for (size_t x = 1; x < nx - 1; ++x) {
+                const size_t id = IDxyzDIM(x, y, z, nx, ny);
+                const T val_x = u_values[IDuxDIM(id, cells)];
+                const T val_y = u_values[IDuyDIM(id, cells)];
+                const T val_z = u_values[IDuzDIM(id, cells)];
+                vtk << std::scientific << std::setprecision(VTK_PRECISION) << val_x << " "
+                    << std::scientific << std::setprecision(VTK_PRECISION) << val_y << " "
+                    << std::scientific << std::setprecision(VTK_PRECISION) << val_z << " ";
+            }
+            vtk << "\n";
+        }
+    }
+
+    vtk << "        </DataArray>\n"
+        << "      </PointData>\n"
+        << "    </Piece>\n"
+        << "  </ImageData>\n"
+        << "</VTKFile>\n";
+
+    vtk.close();
+}
+
+
+// Appends a data array to an appended data block. Raw arrays are preceded by
+// their size in bytes, compressed ones by the header of vtkZLibDataCompressor:
+// number of blocks, block size, size of the last block and the compressed size
+// of each block (all UInt64).
+static inline void appendVTIArray(std::string & appended, const void * data, size_t size, bool compress)
+{
+    const unsigned char * bytes = static_cast<const unsigned char *>(data);
+
+    if (!compress) {
+        const uint64_t header = size;
+        appended.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        appended.append(reinterpret_cast<const char *>(bytes), size);
+        return;
+    }
+
+    const size_t num_blocks = (size + VTK_ZLIB_BLOCK_SIZE - 1) / VTK_ZLIB_BLOCK_SIZE;
+    const size_t last_block = size - (num_blocks > 0 ? (num_blocks - 1) * VTK_ZLIB_BLOCK_SIZE : 0);
+
+    std::vector<uint64_t> header(3 + num_blocks);
+    header[0] = num_blocks;
+    header[1] = VTK_ZLIB_BLOCK_SIZE;
+    header[2] = last_block;
+
+    std::string blocks;
+    std::vector<Bytef> compressed(compressBound(VTK_ZLIB_BLOCK_SIZE));
+    for (size_t b = 0; b < num_blocks; ++b) {
+        const size_t block_size = (b == num_blocks - 1 ? last_block : VTK_ZLIB_BLOCK_SIZE);
+        uLongf compressed_size = compressed.size();
+        if (compress2(compressed.data(), &compressed_size, bytes + b * VTK_ZLIB_BLOCK_SIZE, block_size, Z_BEST_SPEED) != Z_OK) {
+            std::cerr << "zlib compression failed" << std::endl;
+            exit(1);
+        }
+        header[3 + b] = compressed_size;
+        blocks.append(reinterpret_cast<const char *>(compressed.data()), compressed_size);
+    }
+
+    appended.append(reinterpret_cast<const char *>(header.data()), header.size() * sizeof(uint64_t));
+    appended.append(blocks);
+}
+
+
+// Stores density and velocity of the wet lattices of a nx * ny * nz lattice
+// as a VTK ImageData file with binary appended data arrays, optionally
+// compressed. Values are stored with type OutT.
+template <typename OutT, typename T>
+void writeVTIBinary(const std::string & filename, const T * rho_values, const T * u_values,
+                    size_t nx, size_t ny, size_t nz, bool compress)
+{
+    const size_t cells = nx * ny * nz;
+    const size_t points = (nx - 2) * (ny - 2) * (nz - 2);
+    const std::string dataTypeString = (std::is_same<OutT, float>::value ? "Float32" : "Float64");
+
+    std::vector<OutT> rho_out;
+    std::vector<OutT> v_out;
+    rho_out.reserve(points);
+    v_out.reserve(points * D);
+
+    for (size_t z = 1; z < nz - 1; ++z) {
+        for (size_t y = 1; y < ny - 1; ++y) {
+            for (size_t x = 1; x < nx - 1; ++x) {
+                const size_t id = IDxyzDIM(x, y, z, nx, ny);
+                rho_out.push_back(static_cast<OutT>(rho_values[id]));
+                v_out.push_back(static_cast<OutT>(u_values[IDuxDIM(id, cells)]));
+                v_out.push_back(static_cast<OutT>(u_values[IDuyDIM(id, cells)]));
+                v_out.push_back(static_cast<OutT>(u_values[IDuzDIM(id, cells)]));
+            }
+        }
+    }
+
+    std::string appended;
+    appendVTIArray(appended, rho_out.data(), rho_out.size() * sizeof(OutT), compress);
+    const size_t v_offset = appended.size();
+    appendVTIArray(appended, v_out.data(), v_out.size() * sizeof(OutT), compress);
+
+    std::ofstream vtk;
+    vtk.open(filename, std::ios::out | std::ios::binary);
+
+    vtk << "<?xml version=\"1.0\"?>\n"
+        << "<VTKFile type=\"ImageData\" version=\"0.1\" byte_order=\"LittleEndian\" header_type=\"UInt64\""
+        << (compress ? " compressor=\"vtkZLibDataCompressor\"" : "") << ">\n"
+        << "  <ImageData WholeExtent=\"" << vtiExtent(nx, ny, nz) << "\" Origin=\"0 0 0\" Spacing=\"1 1 1\">\n"
+        << "    <Piece Extent=\"" << vtiExtent(nx, ny, nz) << "\">\n"
+        << "      <PointData Scalars=\"rho\">\n"
+        << "        <DataArray type=\"" << dataTypeString << "\" Name=\"rho\" NumberOfComponents=\"1\" format=\"appended\" offset=\"0\"/>\n"
+        << "        <DataArray type=\"" << dataTypeString << "\" Name=\"v\" NumberOfComponents=\"3\" format=\"appended\" offset=\"" << v_offset << "\"/>\n"
+        << "      </PointData>\n"
+        << "    </Piece>\n"
+        << "  </ImageData>\n"
+        << "  <AppendedData encoding=\"raw\">\n"
+        << "   _";
+    vtk.write(appended.data(), appended.size());
+    vtk << "\n"
+        << "  </AppendedData>\n"
+        << "</VTKFile>\n";
+
+    vtk.close();
+}
+
+
+// Stores density and velocity of the wet lattices of a nx * ny * nz lattice
+// as a VTK ImageData file. If float32 is true, double values are stored as
+// Float32 in binary formats.
+template <typename T>
+void writeVTI(const std::string & filename, const T * rho_values, const T * u_values, size_t nx, size_t ny, size_t nz,
+              vtk_format format = VTK_ASCII, bool float32 = false)
+{
+    if (format == VTK_ASCII) {
+        writeVTIAscii(filename, rho_values, u_values, nx, ny, nz);
+    } else if (float32 || std::is_same<T, float>::value) {
+        writeVTIBinary<float>(filename, rho_values, u_values, nx, ny, nz, format == VTK_ZLIB);
+    } else {
+        writeVTIBinary<double>(filename, rho_values, u_values, nx, ny, nz, format == VTK_ZLIB);
+    }
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include "common.h"
+#include "lbm_lattice.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LBM_SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+// Instruction set of the rows collided by the cpu engine, see collideRowSimd().
+enum lbm_simd {
+    SIMD_AUTO,          // the widest one supported by the CPU
+    SIMD_SCALAR,        // the loops vectorized by the compiler
+    SIMD_AVX2,          // 256 bit vectors: 8 floats or 4 doubles
+    SIMD_AVX512         // 512 bit vectors: 16 floats or 8 doubles
+};
+
+
+static inline const char * lbmSimdStr(lbm_simd simd)
+{
+    switch (simd) {
+        case SIMD_AUTO:   return "auto";
+        case SIMD_AVX2:   return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default:          return "scalar";
+    }
+}
+
+
+// Whether the CPU running the program supports simd, from CPUID.
+static inline bool simdSupported(lbm_simd simd)
+{
+#ifdef LBM_SIMD_X86
+    switch (simd) {
+        case SIMD_AVX2:   return (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+        case SIMD_AVX512: return __builtin_cpu_supports("avx512f");
+        default:          return true;
+    }
+#else
+    return (simd == SIMD_AUTO || simd == SIMD_SCALAR);
+#endif
+}
+
+
+// The instruction set selected by simd: the widest one supported for auto.
+static inline lbm_simd resolveSimd(lbm_simd simd)
+{
+    if (simd != SIMD_AUTO) return simd;
+    if (simdSupported(SIMD_AVX512)) return SIMD_AVX512;
+    if (simdSupported(SIMD_AVX2)) return SIMD_AVX2;
+    return SIMD_SCALAR;
+}
+
+
+// Row being computed by a thread of the cpu engine: the Q distributions of
+// its n cells (f, one direction after the other), their types, and the
+// arrays the collision fills. See LBMCPU::computeRow().
+template <typename T>
+struct simd_row {
+    const map_t * types;
+    const T * f;
+    T * f_post;
+    T * rho;
+    T * ux;
+    T * uy;
+    T * uz;
+    size_t n;
+    T lid_velocity;
+    T omega;
+};
+
+
+#ifdef LBM_SIMD_X86
+// The collision of a row is written once, in lbm_simd_row.hpp, over the
+// vectors of the structs vec<T>, and compiled for each instruction set in
+// its own namespace, with the instruction set enabled only there.
+//
+// GCC fuses the products and sums of the intrinsics once FMA is enabled:
+// the rows would no longer match the scalar loops. Clang only fuses the
+// operations of a single expression.
+#if defined(__clang__)
+#define LBM_SIMD_NO_FMA
+#else
+#define LBM_SIMD_NO_FMA         __attribute__((optimize("fp-contract=off")))
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace lbm_avx2 {
+
+template <typename T> struct vec;
+
+template <>
+struct vec<float> {
+    typedef float T;
+    typedef __m256 v;
+    typedef __m256 mask;
+    static const size_t W = 8;
+
+    static inline v load(const T * p)         { return _mm256_loadu_ps(p); }
+    static inline void store(T * p, v a)      { _mm256_storeu_ps(p, a); }
+    static inline v set1(T a)                 { return _mm256_set1_ps(a); }
+    static inline v add(v a, v b)             { return _mm256_add_ps(a, b); }
+    static inline v sub(v a, v b)             { return _mm256_sub_ps(a, b); }
+    static inline v mul(v a, v b)             { return _mm256_mul_ps(a, b); }
+    static inline v div(v a, v b)             { return _mm256_div_ps(a, b); }
+    static inline v select(mask m, v a, v b)  { return _mm256_blendv_ps(b, a, m); }
+    static inline mask and_not(mask a, mask b) { return _mm256_andnot_ps(a, b); }
+    static inline mask or_(mask a, mask b)    { return _mm256_or_ps(a, b); }
+
+    // Lanes of the W types from p whose bits are all set, or equal to value
+    static inline __m256i types(const map_t * p)
+    {
+        return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)));
+    }
+    static inline mask has(__m256i t, int bits)
+    {
+        const __m256i b = _mm256_set1_epi32(bits);
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(t, b), b));
+    }
+    static inline mask is(__m256i t, int value)
+    {
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(t, _mm256_set1_epi32(value)));
+    }
+};
+
+template <>
+struct vec<double> {
+    typedef double T;
+    typedef __m256d v;
+    typedef __m256d mask;
+    static const size_t W = 4;
+
+    static inline v load(const T * p)         { return _mm256_loadu_pd(p); }
+    static inline void store(T * p, v a)      { _mm256_storeu_pd(p, a); }
+    static inline v set1(T a)                 { return _mm256_set1_pd(a); }
+    static inline v add(v a, v b)             { return _mm256_add_pd(a, b); }
+    static inline v sub(v a, v b)             { return _mm256_sub_pd(a, b); }
+    static inline v mul(v a, v b)             { return _mm256_mul_pd(a, b); }
+    static inline v div(v a, v b)             { return _mm256_div_pd(a, b); }
+    static inline v select(mask m, v a, v b)  { return _mm256_blendv_pd(b, a, m); }
+    static inline mask and_not(mask a, mask b) { return _mm256_andnot_pd(a, b); }
+    static inline mask or_(mask a, mask b)    { return _mm256_or_pd(a, b); }
+
+    static inline __m256i types(const map_t * p)
+    {
+        int bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes));
+    }
+    static inline mask has(__m256i t, int bits)
+    {
+        const __m256i b = _mm256_set1_epi64x(bits);
+        return _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(t, b), b));
+    }
+    static inline mask is(__m256i t, int value)
+    {
+        return _mm256_castsi256_pd(_mm256_cmpeq_epi64(t, _mm256_set1_epi64x(value)));
+    }
+};
+
+#include "lbm_simd_row.hpp"
+
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace lbm_avx512 {
+
+template <typename T> struct vec;
+
+template <>
+struct vec<float> {
+    typedef float T;
+    typedef __m512 v;
+    typedef __mmask16 mask;
+    static const size_t W = 16;
+
+    static inline v load(const T * p)         { return _mm512_loadu_ps(p); }
+    static inline void store(T * p, v a)      { _mm512_storeu_ps(p, a); }
+    static inline v set1(T a)                 { return _mm512_set1_ps(a); }
+    static inline v add(v a, v b)             { return _mm512_add_ps(a, b); }
+    static inline v sub(v a, v b)             { return _mm512_sub_ps(a, b); }
+    static inline v mul(v a, v b)             { return _mm512_mul_ps(a, b); }
+    static inline v div(v a, v b)             { return _mm512_div_ps(a, b); }
+    static inline v select(mask m, v a, v b)  { return _mm512_mask_blend_ps(m, b, a); }
+    static inline mask and_not(mask a, mask b) { return _mm512_kandn(a, b); }
+    static inline mask or_(mask a, mask b)    { return _mm512_kor(a, b); }
+
+    static inline __m512i types(const map_t * p)
+    {
+        // The unmasked conversion reads an undefined vector, GCC warns about it
+        return _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+    }
+    static inline mask has(__m512i t, int bits)
+    {
+        const __m512i b = _mm512_set1_epi32(bits);
+        return _mm512_cmpeq_epi32_mask(_mm512_and_si512(t, b), b);
+    }
+    static inline mask is(__m512i t, int value)
+    {
+        return _mm512_cmpeq_epi32_mask(t, _mm512_set1_epi32(value));
+    }
+};
+
+template <>
+struct vec<double> {
+    typedef double T;
+    typedef __m512d v;
+    typedef __mmask8 mask;
+    static const size_t W = 8;
+
+    static inline v load(const T * p)         { return _mm512_loadu_pd(p); }
+    static inline void store(T * p, v a)      { _mm512_storeu_pd(p, a); }
+    static inline v set1(T a)                 { return _mm512_set1_pd(a); }
+    static inline v add(v a, v b)             { return _mm512_add_pd(a, b); }
+    static inline v sub(v a, v b)             { return _mm512_sub_pd(a, b); }
+    static inline v mul(v a, v b)             { return _mm512_mul_pd(a, b); }
+    static inline v div(v a, v b)             { return _mm512_div_pd(a, b); }
+    static inline v select(mask m, v a, v b)  { return _mm512_mask_blend_pd(m, b, a); }
+    static inline mask and_not(mask a, mask b) { return static_cast<mask>(~a & b); }
+    static inline mask or_(mask a, mask b)    { return static_cast<mask>(a | b); }
+
+    static inline __m512i types(const map_t * p)
+    {
+        return _mm512_maskz_cvtepu8_epi64(0xFF, _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)));
+    }
+    static inline mask has(__m512i t, int bits)
+    {
+        const __m512i b = _mm512_set1_epi64(bits);
+        return _mm512_cmpeq_epi64_mask(_mm512_and_si512(t, b), b);
+    }
+    static inline mask is(__m512i t, int value)
+    {
+        return _mm512_cmpeq_epi64_mask(t, _mm512_set1_epi64(value));
+    }
+};
+
+#include "lbm_simd_row.hpp"
+
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
+
+
+// Collides the row with the vectors of simd, a whole vector of cells at a
+// time from the first one, and returns the number of cells done: the scalar
+// loops of the caller complete the row. The results are the same of the
+// scalar loops, the operations are not reordered nor fused. simd must be
+// supported by the CPU, see resolveSimd().
+template <typename T>
+static inline size_t collideRowSimd(lbm_simd simd, const simd_row<T> & row)
+{
+#ifdef LBM_SIMD_X86
+    switch (simd) {
+        case SIMD_AVX512: return lbm_avx512::collideRow< lbm_avx512::vec<T> >(row);
+        case SIMD_AVX2:   return lbm_avx2::collideRow< lbm_avx2::vec<T> >(row);
+        default:          break;
+    }
+#else
+    (void)simd;
+    (void)row;
+#endif
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Collision of a row of the cpu engine over the vectors of V, included by
+// lbm_simd.hpp once for each instruction set, inside its namespace and with
+// the instruction set enabled. No include guard on purpose.
+//
+// Each step collides V::W cells, as the loops of LBMCPU::computeRow() do,
+// with the same operations in the same order. Returns the cells done.
+template <typename V>
+LBM_SIMD_NO_FMA size_t collideRow(const simd_row<typename V::T> & row)
+{
+    typedef typename V::T T;
+    typedef typename V::v v;
+    typedef typename V::mask mask;
+
+    const size_t n = row.n;
+    const v zero  = V::set1(T(0.0));
+    const v one   = V::set1(T(1.0));
+    const v three = V::set1(T(3.0));
+    const v four_half = V::set1(T(4.5));
+    const v one_half  = V::set1(T(1.5));
+    const v lid_velocity = V::set1(row.lid_velocity);
+    const v omega = V::set1(row.omega);
+
+    size_t x = 0;
+    for (; x + V::W <= n; x += V::W) {
+        const auto types = V::types(row.types + x);
+        const mask moving = V::has(types, MOVING);
+        const mask bounceback = V::and_not(moving, V::has(types, BOUNDARY));
+        const mask collision = V::or_(V::is(types, FLUID), moving);
+
+        v f[Q];
+        for (size_t q = 0; q < Q; ++q) {
+            f[q] = V::load(row.f + q * n + x);
+        }
+
+        for (int q : d3q19_moving_unknowns) {
+            f[q] = V::select(moving, f[d3q19_s[q]], f[q]);
+        }
+
+        /***   Compute Macro quantities (rho & u)   ***/
+        v r = f[0];
+        for (size_t q = 1; q < Q; ++q) {
+            r = V::add(r, f[q]);
+        }
+
+        const v vx = V::div(V::sub(V::add(V::add(V::add(V::add(f[ 1], f[ 7]), f[10]), f[11]), f[15]),
+                                   V::add(V::add(V::add(V::add(f[ 3], f[ 8]), f[ 9]), f[13]), f[17])), r);
+        const v vy = V::div(V::sub(V::add(V::add(V::add(V::add(f[ 2], f[ 7]), f[ 8]), f[12]), f[16]),
+                                   V::add(V::add(V::add(V::add(f[ 4], f[ 9]), f[10]), f[14]), f[18])), r);
+        const v vz = V::div(V::sub(V::add(V::add(V::add(V::add(f[ 6], f[15]), f[16]), f[17]), f[18]),
+                                   V::add(V::add(V::add(V::add(f[ 5], f[11]), f[12]), f[13]), f[14])), r);
+        const v ux = V::select(moving, lid_velocity, vx);
+        const v uy = V::select(moving, zero, vy);
+        const v uz = V::select(moving, zero, vz);
+        const v u2 = V::add(V::add(V::mul(ux, ux), V::mul(uy, uy)), V::mul(uz, uz));
+
+        V::store(row.rho + x, r);
+        V::store(row.ux + x, ux);
+        V::store(row.uy + x, uy);
+        V::store(row.uz + x, uz);
+
+        /***   Boundary Conditions & Collision   ***/
+        for (size_t q = 0; q < Q; ++q) {
+            const v eu = V::add(V::add(V::mul(ux, V::set1(T(d3q19_ex[q]))),
+                                       V::mul(uy, V::set1(T(d3q19_ey[q])))),
+                                V::mul(uz, V::set1(T(d3q19_ez[q]))));
+            const v f_eq = V::mul(V::mul(r, V::set1(T(d3q19_w[q]))),
+                                  V::sub(V::add(V::add(one, V::mul(three, eu)), V::mul(V::mul(four_half, eu), eu)),
+                                         V::mul(one_half, u2)));
+
+            const v value = V::select(bounceback, f[d3q19_s[q]], f[q]);
+            const v collided = V::select(moving, f_eq, V::add(value, V::mul(omega, V::sub(f_eq, value))));
+            V::store(row.f_post + q * n + x, V::select(collision, collided, value));
+        }
+    }
+    return x;
+}
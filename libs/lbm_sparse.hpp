@@ -0,0 +1,80 @@
+#pragma once
+
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "common.h"
+#include "lbm_lattice.hpp"
+#include "lbm_output.hpp"
+
+
+// Compacted lattice of the sparse kernels: the cells that are not walls, in
+// the order of the lattice, with the table of their neighbours. See the
+// sparse kernels in kernels.cl.
+struct sparse_lattice {
+    std::vector<int32_t> cells;         // lattice index of each cell
+    std::vector<int32_t> neighbours;    // cell in x + e_q, -1 for walls (CSoA)
+    size_t padded_cells;                // number of cells rounded up to the stride
+
+    sparse_lattice() :
+        padded_cells(0)
+    {}
+};
+
+
+// Builds the sparse lattice of a nx * ny * nz map. Both the distributions
+// and the neighbour table of the cells use the CSoA layout with the given
+// stride.
+static inline void buildSparseLattice(const map_t * map_values, size_t nx, size_t ny, size_t nz, size_t stride,
+                                      sparse_lattice & lattice)
+{
+    const size_t lattice_dim = nx * ny * nz;
+    std::vector<int32_t> index(lattice_dim, -1);
+
+    lattice.cells.clear();
+    for (size_t id = 0; id < lattice_dim; ++id) {
+        if (!is_wall(map_values[id])) {
+            index[id] = static_cast<int32_t>(lattice.cells.size());
+            lattice.cells.push_back(static_cast<int32_t>(id));
+        }
+    }
+
+    lattice.padded_cells = paddedCells(std::max<size_t>(lattice.cells.size(), 1), stride);
+    lattice.neighbours.assign(lattice.padded_cells * Q, -1);
+
+    for (size_t a = 0; a < lattice.cells.size(); ++a) {
+        const long id = lattice.cells[a];
+        const long x = id % nx;
+        const long y = (id / nx) % ny;
+        const long z = id / (nx * ny);
+
+        for (size_t q = 0; q < Q; ++q) {
+            const long xn = x + d3q19_ex[q];
+            const long yn = y + d3q19_ey[q];
+            const long zn = z + d3q19_ez[q];
+
+            if (xn < 0 || xn >= long(nx) || yn < 0 || yn >= long(ny) || zn < 0 || zn >= long(nz)) continue;
+            lattice.neighbours[IDxyzqDIM(a, q, Q, stride)] = index[IDxyzDIM(xn, yn, zn, nx, ny)];
+        }
+    }
+}
+
+
+// Copies the distributions of the sparse lattice into a nx * ny * nz lattice,
+// both in the CSoA layout with the given stride. Walls are NaN.
+template <typename T>
+void scatterSparse(const T * sparse_values, T * f_values, const sparse_lattice & lattice,
+                   size_t nx, size_t ny, size_t nz, size_t stride)
+{
+    std::fill(f_values, f_values + paddedCells(nx * ny * nz, stride) * Q, std::numeric_limits<T>::quiet_NaN());
+
+    for (size_t a = 0; a < lattice.cells.size(); ++a) {
+        const size_t id = lattice.cells[a];
+        for (size_t q = 0; q < Q; ++q) {
+            f_values[IDxyzqDIM(id, q, Q, stride)] = sparse_values[IDxyzqDIM(a, q, Q, stride)];
+        }
+    }
+}
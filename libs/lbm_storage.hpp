@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "common.h"
+#include "lbm_lattice.hpp"
+
+
+// Storage type of the distributions on the device. The arithmetic is always
+// done with the precision of the simulation. Reduced storage types keep the
+// difference between the distributions and their weights, see kernels.cl.
+enum lbm_storage {
+    STORAGE_REAL,       // same type of the simulation
+    STORAGE_FP32,       // float, for double precision simulations
+    STORAGE_FP16,       // half, for single precision simulations
+    STORAGE_BF16        // bfloat16, for single precision simulations
+};
+
+
+static inline const char * lbmStorageStr(lbm_storage storage)
+{
+    switch (storage) {
+        case STORAGE_FP32: return "fp32";
+        case STORAGE_FP16: return "fp16";
+        case STORAGE_BF16: return "bf16";
+        default:           return "real";
+    }
+}
+
+
+// Bytes of a stored distribution, real_size is sizeof(T) of the simulation.
+static inline size_t storageBytes(lbm_storage storage, size_t real_size)
+{
+    switch (storage) {
+        case STORAGE_FP32: return sizeof(float);
+        case STORAGE_FP16: return sizeof(uint16_t);
+        case STORAGE_BF16: return sizeof(uint16_t);
+        default:           return real_size;
+    }
+}
+
+
+// True if the storage is smaller than the type of the simulation.
+static inline bool storageFits(lbm_storage storage, size_t real_size)
+{
+    return (storage == STORAGE_REAL || storageBytes(storage, real_size) < real_size);
+}
+
+
+static inline float halfToFloat(uint16_t value)
+{
+    const uint32_t exponent = (value >> 10) & 0x1F;
+    const uint32_t mantissa = value & 0x3FF;
+
+    float result;
+    if (exponent == 0) {
+        result = std::ldexp(static_cast<float>(mantissa), -24);
+    } else if (exponent == 0x1F) {
+        result = (mantissa != 0 ? NAN : INFINITY);
+    } else {
+        result = std::ldexp(static_cast<float>(mantissa | 0x400), static_cast<int>(exponent) - 25);
+    }
+    return ((value & 0x8000) ? -result : result);
+}
+
+
+static inline float bf16ToFloat(uint16_t value)
+{
+    const uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+
+// Converts f_dim distributions, in the CSoA layout with the given stride,
+// from the storage type to T, adding back the weights of their directions.
+template <typename T>
+void decodeStorage(const void * stored, T * f_values, size_t f_dim, size_t stride, lbm_storage storage)
+{
+    const float * fp32_values = static_cast<const float *>(stored);
+    const uint16_t * fp16_values = static_cast<const uint16_t *>(stored);
+
+    for (size_t idx = 0; idx < f_dim; ++idx) {
+        const size_t q = (idx / stride) % Q;
+
+        switch (storage) {
+            case STORAGE_FP32:
+                f_values[idx] = T(fp32_values[idx] + d3q19_w[q]);
+                break;
+            case STORAGE_FP16:
+                f_values[idx] = T(halfToFloat(fp16_values[idx]) + d3q19_w[q]);
+                break;
+            case STORAGE_BF16:
+                f_values[idx] = T(bf16ToFloat(fp16_values[idx]) + d3q19_w[q]);
+                break;
+            default:
+                f_values[idx] = static_cast<const T *>(stored)[idx];
+                break;
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+
+// Online statistics of a series of durations (in milliseconds).
+// Count, min, max, mean and standard deviation are updated with the Welford
+// algorithm, while percentiles are estimated through a histogram with
+// logarithmic buckets. The memory used does not depend on the number of
+// samples.
+struct timing_stats {
+    // Each power of two (in nanoseconds) is split in SUB_BUCKETS buckets,
+    // covering durations from 1 ns up to 2^MAX_LOG2_NS ns (~18 minutes).
+    static const size_t SUB_BUCKETS = 8;
+    static const size_t MAX_LOG2_NS = 40;
+    static const size_t BUCKETS     = SUB_BUCKETS * MAX_LOG2_NS;
+
+    uint64_t count;
+    double total;
+    double min;
+    double max;
+    double mean_val;
+    double m2;
+    std::array<uint64_t, BUCKETS> histogram;
+
+    timing_stats() :
+        count(0),
+        total(0.0),
+        min(std::numeric_limits<double>::max()),
+        max(0.0),
+        mean_val(0.0),
+        m2(0.0)
+    {
+        histogram.fill(0);
+    }
+
+    void add(double time_ms)
+    {
+        count++;
+        total += time_ms;
+        min = std::min(min, time_ms);
+        max = std::max(max, time_ms);
+
+        const double delta = time_ms - mean_val;
+        mean_val += delta / count;
+        m2 += delta * (time_ms - mean_val);
+
+        histogram[bucket(time_ms)]++;
+    }
+
+    double mean() const
+    {
+        return (count > 0 ? mean_val : 0.0);
+    }
+
+    double stddev() const
+    {
+        return (count > 1 ? std::sqrt(m2 / (count - 1)) : 0.0);
+    }
+
+    // Estimated p-th percentile (p in [0, 100]). The value returned is the
+    // geometric center of the bucket holding the percentile, clamped to the
+    // observed min and max.
+    double percentile(double p) const
+    {
+        if (count == 0) return 0.0;
+
+        const uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(p / 100.0 * count));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += histogram[b];
+            if (seen >= rank) {
+                const double center_ns = std::pow(2.0, (b + 0.5) / SUB_BUCKETS);
+                return std::min(max, std::max(min, center_ns / 1e6));
+            }
+        }
+        return max;
+    }
+
+private:
+    static size_t bucket(double time_ms)
+    {
+        const double time_ns = time_ms * 1e6;
+        if (!(time_ns > 1.0)) return 0;
+
+        const size_t b = (size_t)(std::log2(time_ns) * SUB_BUCKETS);
+        return std::min(b, BUCKETS - 1);
+    }
+};
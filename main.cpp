@@ -2,12 +2,15 @@
 
 #include "common.h"
 #include "lbm_options.hpp"
+#include "lbmcpu.hpp"
+#ifndef LBM_NO_OPENCL
 #include "lbmcl.hpp"
+#endif
 
-template <typename T>
+template <typename Engine>
 void performSimulation(const lbm_options & opts)
 {
-    LBMCL<T> lbmcl(opts.dim,
+    Engine lbmcl(opts.nx, opts.ny, opts.nz,
                    opts.viscosity,
                    opts.velocity,
                    opts.iterations,
@@ -20,8 +23,30 @@ void performSimulation(const lbm_options & opts)
                    opts.optimize,
                    opts.dump_path,
                    opts.dump_map,
-                   opts.dump_f);
+                   opts.dump_f,
+                   opts.profile_every,
+                   opts.writer_threads);
 
+    lbmcl.setOutputFormat(opts.vtk_fmt, opts.vtk_float32);
+    lbmcl.setCheckpoint(opts.checkpoint_every, opts.restart_file);
+    // A cached configuration never overrides the given one, nor the stride of a checkpoint
+    lbmcl.setAutotune(opts.autotune, opts.autotune_cache,
+                      !opts.lws_given && !opts.stride_given && opts.restart_file.empty());
+    lbmcl.setKernelCache(opts.kernel_cache);
+    lbmcl.setStreaming(opts.streaming);
+    lbmcl.setStorage(opts.storage);
+    lbmcl.setCollision(opts.collision);
+    lbmcl.setProceduralGeometry(opts.procedural_geometry);
+    lbmcl.setSparse(opts.sparse);
+    lbmcl.setZCells(opts.z_cells);
+    lbmcl.setBlockSteps(opts.block_steps);
+    lbmcl.setLocalLattice(opts.local_lattice);
+    lbmcl.setInteriorSplit(opts.interior_split);
+    lbmcl.setSimd(opts.simd);
+    lbmcl.setPinThreads(opts.pin_threads);
+    lbmcl.setDiagnostics(opts.diagnostics_every);
+    lbmcl.setTolerance(opts.tolerance, opts.residual_every);
+    lbmcl.setEnsemble(opts.ensemble);
     lbmcl.setupSimulation(opts.platformID, opts.deviceID);
     lbmcl.printConfiguration();
     lbmcl.performSimulation();
@@ -31,6 +56,7 @@ void performSimulation(const lbm_options & opts)
     std::cout << " Kernels time: " << lbmcl.kernelsTimeMS() << " ms"    << std::endl;
     std::cout << "  Total MLUPS: " << lbmcl.MLUPS()         << " MLUPS" << std::endl;
     std::cout << "Kernels MLUPS: " << lbmcl.kernelsMLUPS()  << " MLUPS" << std::endl;
+    std::cout << std::endl << lbmcl.timingsReport();
 
     std::cerr << lbmcl.statistics(';');
 }
@@ -41,10 +67,20 @@ int main(int argc, char * argv[])
     opts.process_args(argc, argv);
     // opts.print_values();
 
-    if (opts.use_double) {
-        performSimulation<double>(opts);
+    if (opts.engine == ENGINE_CPU) {
+        if (opts.use_double) {
+            performSimulation< LBMCPU<double> >(opts);
+        } else {
+            performSimulation< LBMCPU<float> >(opts);
+        }
     } else {
-        performSimulation<float>(opts);
+#ifndef LBM_NO_OPENCL
+        if (opts.use_double) {
+            performSimulation< LBMCL<double> >(opts);
+        } else {
+            performSimulation< LBMCL<float> >(opts);
+        }
+#endif
     }
 
     return 0;